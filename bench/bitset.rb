@@ -0,0 +1,171 @@
+#!ruby
+#
+# Bitset の各メソッドの計測項目。
+#
+# Bench.item の block はビット長を受け取って準備を行い、
+# 繰り返し回数を受け取って計測対象を実行する Proc を返す。
+#
+
+# 要素の参照・設定
+
+Bench.item "aref", :const do |size|
+  bs = Bench.bitset(size)
+  proc { |n| i = 0; while i < n; bs.aref(i % size); i += 1; end }
+end
+
+Bench.item "aref(index, 32)", :const do |size|
+  bs = Bench.bitset(size)
+  proc { |n| i = 0; while i < n; bs.aref(i % (size - 32), 32); i += 1; end }
+end
+
+Bench.item "aset", :const do |size|
+  bs = Bench.bitset(size)
+  proc { |n| i = 0; while i < n; bs.aset(i % size, i & 1); i += 1; end }
+end
+
+Bench.item "aset(index, 32, bits)", :const do |size|
+  bs = Bench.bitset(size)
+  proc { |n| i = 0; while i < n; bs.aset(i % (size - 32), 32, i); i += 1; end }
+end
+
+Bench.item "test", :const do |size|
+  bs = Bench.bitset(size)
+  proc { |n| i = 0; while i < n; bs.test(i % size); i += 1; end }
+end
+
+Bench.item "push and pop", :const do |size|
+  bs = Bench.bitset(size)
+  proc { |n| n.times { bs.push 1; bs.pop } }
+end
+
+Bench.item "shift and unshift", :linear do |size|
+  bs = Bench.bitset(size)
+  proc { |n| n.times { bs.unshift(bs.shift) } }
+end
+
+Bench.item "Bitset.from_indices", :linear, Bench::HUGE do |size|
+  indices = Bench.bitset(size).to_indices
+  proc { |n| n.times { Bitset.from_indices(indices, size) } }
+end
+
+Bench.item "set_indices!", :const do |size|
+  bs = Bench.bitset(size)
+  indices = Array.new(1024) { |i| (i * 7919) % size }
+  proc { |n| (n / 1024).times { bs.set_indices!(indices) } }
+end
+
+# 論理演算
+
+Bench.item "flip", :linear do |size|
+  bs = Bench.bitset(size)
+  proc { |n| n.times { bs.flip } }
+end
+
+Bench.item "flip!", :linear do |size|
+  bs = Bench.bitset(size)
+  proc { |n| n.times { bs.flip! } }
+end
+
+Bench.item "minus!", :linear do |size|
+  bs = Bench.bitset(size)
+  proc { |n| n.times { bs.minus! } }
+end
+
+Bench.item "bitreflect!", :linear do |size|
+  bs = Bench.bitset(size)
+  proc { |n| n.times { bs.bitreflect! } }
+end
+
+%w(msb_or msb_and msb_xor msb_nor msb_nand msb_xnor lsb_or lsb_and lsb_xor).each do |op|
+  Bench.item op, :linear do |size|
+    a = Bench.bitset(size)
+    b = Bench.bitset(size, "\x0f\xf0\x33\xcc")
+    proc { |n| n.times { a.__send__(op, b) } }
+  end
+end
+
+%w(| & ^ hamming).each do |op|
+  Bench.item op, :linear do |size|
+    a = Bench.bitset(size)
+    b = Bench.bitset(size, "\x0f\xf0\x33\xcc")
+    proc { |n| n.times { a.__send__(op, b) } }
+  end
+end
+
+# ビットの数え上げ
+
+%w(popcount clz ctz parity all? any? none?).each do |op|
+  Bench.item op, :linear do |size|
+    bs = Bench.bitset(size)
+    proc { |n| n.times { bs.__send__(op) } }
+  end
+end
+
+Bench.item "popcount (tracked)", :const do |size|
+  bs = Bench.bitset(size).track!
+  proc { |n| i = 0; while i < n; bs.aset(i % size, i & 1); bs.popcount; i += 1; end }
+end
+
+# 比較とハッシュ値
+
+Bench.item "==", :linear do |size|
+  a = Bench.bitset(size)
+  b = Bench.bitset(size)
+  proc { |n| n.times { a == b } }
+end
+
+Bench.item "<=>", :linear do |size|
+  a = Bench.bitset(size)
+  b = Bench.bitset(size)
+  proc { |n| n.times { a <=> b } }
+end
+
+Bench.item "hash", :linear do |size|
+  bs = Bench.bitset(size)
+  # 毎回書き換えてキャッシュを無効にする
+  proc { |n| n.times { |i| bs.aset(0, i & 1); bs.hash } }
+end
+
+# 変換
+
+%w(digest to_bytes dup).each do |op|
+  Bench.item op, :linear do |size|
+    bs = Bench.bitset(size)
+    proc { |n| n.times { bs.__send__(op) } }
+  end
+end
+
+%w(hexdigest bindigest to_indices).each do |op|
+  Bench.item op, :linear, Bench::HUGE do |size|
+    bs = Bench.bitset(size)
+    proc { |n| n.times { bs.__send__(op) } }
+  end
+end
+
+Bench.item "Bitset.from_bytes", :linear do |size|
+  str = Bench.bitset(size).to_bytes
+  proc { |n| n.times { Bitset.from_bytes(str, size) } }
+end
+
+Bench.item "Bitset.new(bit string)", :linear, Bench::HUGE do |size|
+  str = Bench.bitset(size).bindigest
+  proc { |n| n.times { Bitset.new(str) } }
+end
+
+# mrblib による列挙
+
+%w(each each_with_index each_boolean reverse_each to_a each_byte).each do |op|
+  Bench.item op, :ruby do |size|
+    bs = Bench.bitset(size)
+    if op == "to_a"
+      proc { |n| n.times { bs.to_a } }
+    else
+      proc { |n| n.times { bs.__send__(op) { } } }
+    end
+  end
+end
+
+Bench.item "each_slice(8)", :ruby do |size|
+  bs = Bench.bitset(size)
+  proc { |n| n.times { bs.each_slice(8) { } } }
+end
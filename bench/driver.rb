@@ -0,0 +1,109 @@
+#!ruby
+#
+# ベンチマークの実行部。
+# rake bench によって bench/*.rb と連結され、各ビルドの mruby コマンドで実行される。
+# 結果は JSON として標準出力に書き出す。
+#
+# ARGV[0]: ビルド名
+# ARGV[1]: 計測する最大ビット長 (省略時は 1 Gbit)
+#
+
+module Bench
+  # 計測対象のビット長。埋め込み領域に収まるものから 1 Gbit まで。
+  # 整数に収まらないものは除外する (32 ビットの word boxing では 1 << 30 が Float となる)。
+  SIZES = [
+    Bitset::EMBED_BITSIZE,
+    1 << 10,
+    1 << 16,
+    1 << 20,
+    1 << 24,
+    1 << 30,
+  ].select { |e| e.kind_of?(Integer) }
+
+  # 計算量ごとの繰り返し回数の目安
+  #
+  # const::   ビット長に依存しない操作。一定回数を繰り返す。
+  # linear::  C で全体を走査する操作。合計 WORK ビット分を処理する。
+  # ruby::    mrblib で 1 ビットずつ処理する操作。RUBY_WORK ビットまでに制限する。
+  #
+  # HUGE は結果の大きさがビット長の数倍となる操作の上限として用いる。
+  CONST_REPS = 200_000
+  WORK = 1 << 26
+  RUBY_WORK = 1 << 20
+  HUGE = 1 << 24
+
+  @items = []
+
+  # maxsize を与えると、それより長いビット長では計測しない。
+  # 結果が巨大な文字列や配列となる操作に用いる。
+  def self.item(name, cost = :linear, maxsize = nil, &setup)
+    @items << [name, cost, maxsize, setup]
+  end
+
+  def self.bitset(size, pattern = "\x5a\xc3\x96\x3c")
+    Bitset.from_bytes(pattern * ((size + 31) / 32), size)
+  end
+
+  def self.reps(cost, size)
+    case cost
+    when :const
+      CONST_REPS
+    when :linear
+      n = WORK / size
+      n < 1 ? 1 : n
+    when :ruby
+      return nil if size > RUBY_WORK
+      n = RUBY_WORK / size
+      n < 1 ? 1 : n
+    else
+      raise ArgumentError, "unknown cost - #{cost.inspect}"
+    end
+  end
+
+  def self.now
+    Time.now.to_f
+  end
+
+  # rake bench が連結したスクリプトの末尾から呼ばれる
+  def self.main(argv)
+    run(argv[0] || "host", argv[1] ? argv[1].to_i : SIZES.max)
+  end
+
+  def self.run(build, maxsize)
+    results = []
+
+    @items.each do |name, cost, limit, setup|
+      SIZES.each do |size|
+        next if size > maxsize || (limit && size > limit)
+        reps = reps(cost, size)
+        next unless reps
+
+        job = setup.call(size)
+        GC.start
+        t = now
+        job.call(reps)
+        t = now - t
+        job = nil
+
+        results << [name, size, reps, t]
+        $stderr.puts "#{name} [#{size}] x #{reps}: #{t} s" if $DEBUG
+      end
+    end
+
+    puts to_json(build, results)
+  end
+
+  def self.to_json(build, results)
+    s = "{\n"
+    s << %(  "build": "#{build}",\n)
+    s << %(  "mruby_version": "#{MRUBY_VERSION}",\n)
+    s << %(  "word_bitsize": #{Bitset::WORD_BITSIZE},\n)
+    s << %(  "embed_bitsize": #{Bitset::EMBED_BITSIZE},\n)
+    s << %(  "results": [\n)
+    s << results.map { |name, size, reps, t|
+      %(    { "name": "#{name}", "size": #{size}, "reps": #{reps}, "seconds": #{t}, "ns_per_op": #{t * 1e9 / reps} })
+    }.join(",\n")
+    s << %(\n  ]\n}\n)
+    s
+  end
+end
@@ -36,6 +36,68 @@ MRB_API void mruby_bitset_reverse(mrb_state *mrb, mrb_value bitset);
 
 MRB_API int mruby_bitset_popcount(mrb_state *mrb, mrb_value bitset);
 
+/*
+ * ビット列の中身を直接読み書きするための情報
+ *
+ * words は bit_order の順にビットを並べたワード列で、先頭から
+ * (size + MRUBY_BITSET_WORD_BITS - 1) / MRUBY_BITSET_WORD_BITS ワードが有効である。最後のワードの余りのビットは不定であり、読む側で捨てること。
+ * ビット長を変える操作を行うか、オブジェクトが回収されるまで有効である。
+ */
+#define MRUBY_BITSET_WORD_BITS      ((int)(sizeof(uintptr_t) * CHAR_BIT))
+#define MRUBY_BITSET_MSB_FIRST      0   /* ワードの MSB が若い位置 */
+
+struct mruby_bitset_borrowed
+{
+    uintptr_t *words;
+    size_t size;
+    int bit_order;
+};
+
+/*
+ * 読み込みのために中身を借りる。words に書き込んではならない。
+ */
+MRB_API void mruby_bitset_borrow(mrb_state *mrb, mrb_value bitset, struct mruby_bitset_borrowed *borrowed);
+
+/*
+ * 書き込みのために中身を借りる (凍結されていれば例外)。
+ * 書き終えたら mruby_bitset_modified() を呼ぶこと。
+ */
+MRB_API void mruby_bitset_borrow_for_modify(mrb_state *mrb, mrb_value bitset, struct mruby_bitset_borrowed *borrowed);
+
+/*
+ * 借りたワード列を書き換えた後に、1 ビットの数や要約、ハッシュ値を合わせる
+ */
+MRB_API void mruby_bitset_modified(mrb_state *mrb, mrb_value bitset);
+
+/*
+ * [index, index + width) を dest の先頭から MSB 順に詰めて書き出す。ビット長を超えた部分は 0 となる。
+ * dest は (width + MRUBY_BITSET_WORD_BITS - 1) / MRUBY_BITSET_WORD_BITS ワード以上であること。
+ */
+MRB_API void mruby_bitset_read_range(mrb_state *mrb, mrb_value bitset, size_t index, size_t width, uintptr_t *dest);
+
+/*
+ * src の先頭から width ビットを [index, index + width) に書き込む。
+ * ビット長を超える場合は伸ばす (Bitset::Fixed であれば例外)。
+ */
+MRB_API void mruby_bitset_write_range(mrb_state *mrb, mrb_value bitset, size_t index, size_t width, const uintptr_t *src);
+
+/*
+ * dest = a op b (MSB を合わせ、ビット長は長い方に合わせる)
+ * dest は a や b と同じオブジェクトでもよい。
+ */
+MRB_API void mruby_bitset_or_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b);
+MRB_API void mruby_bitset_nor_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b);
+MRB_API void mruby_bitset_and_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b);
+MRB_API void mruby_bitset_nand_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b);
+MRB_API void mruby_bitset_xor_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b);
+MRB_API void mruby_bitset_xnor_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b);
+MRB_API void mruby_bitset_andnot_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b);
+
+/*
+ * dest = ~src
+ */
+MRB_API void mruby_bitset_flip_into(mrb_state *mrb, mrb_value dest, mrb_value src);
+
 MRB_API mrb_int mruby_bitset_hash(mrb_state *mrb, mrb_value bitset);
 MRB_API struct RString *mruby_bitset_digest(mrb_state *mrb, mrb_value bitset);
 MRB_API struct RString *mruby_bitset_hexdigest(mrb_state *mrb, mrb_value bitset);
@@ -11,7 +11,7 @@ class Bitset
 
   def each_byte
     return to_enum(:each_byte) unless block_given?
-    ((size + 7) / 8).to_i.times { |i| yield aref(i * 8, 8) }
+    to_bytes.each_byte { |b| yield b }
     self
   end
 
@@ -91,9 +91,7 @@ class Bitset
   end
 
   def bytes(&block)
-    a = []
-    ((size + 7) / 8).to_i.times { |i| a << aref(i * 8, 8) }
-    a
+    to_bytes.bytes
   end
 
   def slices(bitsize)
@@ -125,10 +123,6 @@ class Bitset
     aref(size - width, width)
   end
 
-  def test(index)
-    aref(index.to_i) != 0
-  end
-
   def drop(index, width = 1)
     aset(index.to_i, width.to_i, 0, 0)
     self
@@ -152,6 +146,7 @@ class Bitset
 
   alias [] aref
   alias []= aset
+  alias test test?
   alias len size
   alias length size
   #alias << lsh
@@ -164,7 +159,6 @@ class Bitset
   alias twos_complement minus
   alias twos_complement! minus!
   alias ~ flip
-  alias == eql?
   alias delete_at drop
   alias nlz clz
   alias count_nlz clz
@@ -184,6 +178,79 @@ class Bitset
     s
   end
 
+  def lazy
+    Expr.new(nil, self)
+  end
+
+  def Bitset.expr(*bitsets)
+    e = yield(*bitsets.map { |b| b.lazy })
+    e.kind_of?(Expr) ? e : e.lazy
+  end
+
+  class Expr
+    OPCODES = { :~ => -1, :& => -2, :| => -3, :^ => -4, :- => -5 }
+
+    def initialize(op, *operands)
+      @op = op
+      @operands = operands
+    end
+
+    def Expr.wrap(obj)
+      obj.kind_of?(Expr) ? obj : obj.lazy
+    end
+
+    def |(other)
+      Expr.new(:|, self, Expr.wrap(other))
+    end
+
+    def &(other)
+      Expr.new(:&, self, Expr.wrap(other))
+    end
+
+    def ^(other)
+      Expr.new(:^, self, Expr.wrap(other))
+    end
+
+    def -(other)
+      Expr.new(:-, self, Expr.wrap(other))
+    end
+
+    def ~
+      Expr.new(:~, self)
+    end
+
+    def lazy
+      self
+    end
+
+    def to_bitset
+      Expr.evaluate(*compile, false)
+    end
+
+    def count
+      Expr.evaluate(*compile, true)
+    end
+
+    alias popcount count
+
+    def compile(program = [], operands = [])
+      if @op
+        @operands.each { |e| e.compile(program, operands) }
+        program << OPCODES[@op]
+      else
+        b = @operands[0]
+        i = operands.index { |o| o.equal?(b) }
+        unless i
+          i = operands.size
+          operands << b
+        end
+        program << i
+      end
+
+      [program, operands]
+    end
+  end
+
   def Bitset.spec
     {
       BITWIDTH_MAX: BITWIDTH_MAX,
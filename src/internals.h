@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <limits.h>
+#include <math.h>
 
 #if MRUBY_RELEASE_NO < 10400
 # define ARY_LEN(A) ((A)->len)
@@ -9,6 +9,9 @@
 #define BS_WORDBITS     (8 * sizeof(uintptr_t))
 #define BS_EMBEDBITS    (3 * BS_WORDBITS)
 
+/* ビット位置 I を含むワードの中で、I を指すマスク (MSB 基準) */
+#define BS_INDEX_MASK(I) (((uintptr_t)1 << (BS_WORDBITS - 1)) >> ((I) % BS_WORDBITS))
+
 // BS_EXPAND_SIZE は sizeof(uintptr_t) 単位
 #ifdef MRUBY_BITSET_EXPAND_HEAP
 # define BS_EXPAND_SIZE (MRUBY_BITSET_EXPAND_HEAP)
@@ -54,6 +57,101 @@ iswordover(uintptr_t off, int width)
     }
 }
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define BS_LITTLE_ENDIAN 1
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define BS_BIG_ENDIAN 1
+#endif
+
+MRBX_FORCE_INLINE uintptr_t
+byteswap(uintptr_t n)
+{
+#if defined(__GNUC__) || defined(__clang__)
+# if UINTPTR_MAX > UINT32_MAX
+    return __builtin_bswap64(n);
+# else
+    return __builtin_bswap32(n);
+# endif
+#else
+    uintptr_t m = 0;
+    for (int i = sizeof(n); i > 0; i --, n >>= 8) {
+        m = (m << 8) | (n & 0xff);
+    }
+    return m;
+#endif
+}
+
+/*
+ * ワードをバイト列として書き込む・読み込む。_be は上位バイトから、_le は下位バイトから。
+ */
+
+MRBX_FORCE_INLINE void
+store_be(uint8_t *d, uintptr_t n)
+{
+#if defined(BS_LITTLE_ENDIAN)
+    n = byteswap(n);
+    memcpy(d, &n, sizeof(n));
+#elif defined(BS_BIG_ENDIAN)
+    memcpy(d, &n, sizeof(n));
+#else
+    for (int i = sizeof(n); i > 0; i --, d ++) {
+        *d = n >> (8 * (i - 1));
+    }
+#endif
+}
+
+MRBX_FORCE_INLINE void
+store_le(uint8_t *d, uintptr_t n)
+{
+#if defined(BS_LITTLE_ENDIAN)
+    memcpy(d, &n, sizeof(n));
+#elif defined(BS_BIG_ENDIAN)
+    n = byteswap(n);
+    memcpy(d, &n, sizeof(n));
+#else
+    for (int i = sizeof(n); i > 0; i --, d ++, n >>= 8) {
+        *d = n;
+    }
+#endif
+}
+
+MRBX_FORCE_INLINE uintptr_t
+load_be(const uint8_t *s)
+{
+    uintptr_t n;
+#if defined(BS_LITTLE_ENDIAN)
+    memcpy(&n, s, sizeof(n));
+    n = byteswap(n);
+#elif defined(BS_BIG_ENDIAN)
+    memcpy(&n, s, sizeof(n));
+#else
+    n = 0;
+    for (int i = sizeof(n); i > 0; i --, s ++) {
+        n = (n << 8) | *s;
+    }
+#endif
+    return n;
+}
+
+MRBX_FORCE_INLINE uintptr_t
+load_le(const uint8_t *s)
+{
+    uintptr_t n;
+#if defined(BS_LITTLE_ENDIAN)
+    memcpy(&n, s, sizeof(n));
+#elif defined(BS_BIG_ENDIAN)
+    memcpy(&n, s, sizeof(n));
+    n = byteswap(n);
+#else
+    n = 0;
+    s += sizeof(n);
+    for (int i = sizeof(n); i > 0; i --) {
+        n = (n << 8) | *-- s;
+    }
+#endif
+    return n;
+}
+
 static int
 aux_obj_to_bit(mrb_state *mrb, mrb_value obj)
 {
@@ -123,6 +221,11 @@ struct bitset
     /* 0..192; is_embed が 1 の場合、ary メンバによって格納される要素数 */
     size_t embed_len:8;
 
+    size_t has_hash:1;              /* hash メンバが有効な値を保持している */
+    size_t is_tracked:1;            /* popcount メンバを常に更新する */
+    size_t is_fixed:1;              /* Bitset::Fixed; ビット長を変更しない */
+    size_t is_borrowed:1;           /* ptr は Bitset::Matrix の行を指している; 解放も再確保もしない */
+
     union {
         uintptr_t ary[3];           /* is_embed が 1 の時に要素が格納される */
 
@@ -132,16 +235,60 @@ struct bitset
             uintptr_t capacity;     /* ptr の確保した要素数 (uintptr_t 換算) */
         };
     };
+
+    mrb_int hash;                   /* bitset_hash() の算出結果 */
+    size_t popcount;                /* is_tracked が 1 の場合の 1 ビットの数 */
+    struct bitset_summary *summary; /* NULL でなければ、0 ではないワードの階層的な要約 */
 };
 
+static int popcount(uintptr_t n);
+static int count_nlz(uintptr_t n);
+static int count_ntz(uintptr_t n);
+static size_t bitset_popcount_scan(const struct bitset *bs);
+static size_t bitset_popcount_range(const struct bitset *bs, size_t index, size_t width);
+static size_t bitset_popcount(const struct bitset *bs);
+static inline uintptr_t aux_peek_bits(const uintptr_t *p, size_t index, int w);
+static void bitset_copy_bits(uintptr_t *dest, size_t doff, const uintptr_t *src, size_t soff, size_t width);
+static void bitset_grow(mrb_state *mrb, struct bitset *bs, size_t size);
+static void bitset_fill_range(struct bitset *bs, size_t index, size_t width, bool bit);
+static void bitset_resize(mrb_state *mrb, struct bitset *bs, size_t size);
+static void bitset_read_range(const struct bitset *bs, size_t index, size_t width, uintptr_t *dest);
+
+/*
+ * MRUBY_BITSET_STATS を定義してビルドすると、mrb_state ごとにメモリ確保やビット列の移動、
+ * メソッドの呼び出し回数を数えるようになる。結果は Bitset.stats で取得できる。
+ */
+#ifdef MRUBY_BITSET_STATS
+static void bitset_stats_alloc(mrb_state *mrb, size_t bytes);
+static void bitset_stats_realloc(mrb_state *mrb, size_t bytes);
+static void bitset_stats_promote(mrb_state *mrb);
+static void bitset_stats_demote(mrb_state *mrb);
+static void bitset_stats_slide(mrb_state *mrb, size_t bits);
+static void bitset_stats_call(mrb_state *mrb, mrb_value self);
+# define BS_STATS_ALLOC(MRB, BYTES)     bitset_stats_alloc(MRB, BYTES)
+# define BS_STATS_REALLOC(MRB, BYTES)   bitset_stats_realloc(MRB, BYTES)
+# define BS_STATS_PROMOTE(MRB)          bitset_stats_promote(MRB)
+# define BS_STATS_DEMOTE(MRB)           bitset_stats_demote(MRB)
+# define BS_STATS_SLIDE(MRB, BITS)      bitset_stats_slide(MRB, BITS)
+# define BS_STATS_CALL(MRB, SELF)       bitset_stats_call(MRB, SELF)
+#else
+# define BS_STATS_ALLOC(MRB, BYTES)     ((void)0)
+# define BS_STATS_REALLOC(MRB, BYTES)   ((void)0)
+# define BS_STATS_PROMOTE(MRB)          ((void)0)
+# define BS_STATS_DEMOTE(MRB)           ((void)0)
+# define BS_STATS_SLIDE(MRB, BITS)      ((void)0)
+# define BS_STATS_CALL(MRB, SELF)       ((void)0)
+#endif
+
 static void
 bitset_free(mrb_state *mrb, void *ptr)
 {
     if (ptr) {
         struct bitset *p = (struct bitset *)ptr;
-        if (!p->is_embed && p->ptr) {
+        if (!p->is_embed && !p->is_borrowed && p->ptr) {
             mrb_free(mrb, p->ptr);
         }
+        mrb_free(mrb, p->summary);
         memset(p, 0, sizeof(*p));
         mrb_free(mrb, p);
     }
@@ -169,6 +316,24 @@ get_bitset(mrb_state *mrb, mrb_value bs)
     return p;
 }
 
+/*
+ * ビット列を書き換える時に呼ぶ。キャッシュしている値を無効にする。
+ */
+static inline void
+bitset_modified(struct bitset *bs)
+{
+    bs->has_hash = 0;
+}
+
+static struct bitset *
+get_bitset_for_modify(mrb_state *mrb, mrb_value bs)
+{
+    mrbx_obj_modify(mrb, bs);
+    struct bitset *p = get_bitset(mrb, bs);
+    bitset_modified(p);
+    return p;
+}
+
 static void
 bitset_check_uninitialized(mrb_state *mrb, mrb_value bs)
 {
@@ -182,6 +347,26 @@ bitset_check_uninitialized(mrb_state *mrb, mrb_value bs)
     mrbx_obj_modify(mrb, bs);
 }
 
+static bool
+bitset_fixed_class_p(mrb_state *mrb, struct RClass *klass)
+{
+    struct RClass *base = mrb_class_get(mrb, "Bitset");
+    if (klass == base) { return false; }
+
+    struct RClass *fixed = mrb_class_get_under(mrb, base, "Fixed");
+
+    for (; klass; klass = klass->super) {
+        if (klass == fixed) { return true; }
+    }
+
+    return false;
+}
+
+/*
+ * klass (NULL であれば Bitset) のオブジェクトを作る。
+ * 定数の探索を避けるため is_fixed は設定しない。klass が Bitset::Fixed でありうる場合は、
+ * 呼び出し側が bitset_fixed_class_p() で確かめるか、bitset_new_like() を使う。
+ */
 static mrb_value
 bitset_new(mrb_state *mrb, struct RClass *klass, struct bitset **bsp)
 {
@@ -189,6 +374,7 @@ bitset_new(mrb_state *mrb, struct RClass *klass, struct bitset **bsp)
 
     mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, klass));
     struct bitset *bs = mrb_calloc(mrb, 1, sizeof(struct bitset));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset));
     bs->is_embed = 1;
     mrb_data_init(obj, bs, &bitset_type);
     if (bsp) { *bsp = bs; }
@@ -196,6 +382,22 @@ bitset_new(mrb_state *mrb, struct RClass *klass, struct bitset **bsp)
     return obj;
 }
 
+/*
+ * self と同じクラスのオブジェクトを作る。Bitset::Fixed かどうかは self から引き継ぐ。
+ * ビット長は呼び出し側が読み込み関数で設定するまでは 0 である。
+ */
+static mrb_value
+bitset_new_like(mrb_state *mrb, mrb_value self, struct bitset **bsp)
+{
+    bool fixed = get_bitset(mrb, self)->is_fixed;
+    struct bitset *bs;
+    mrb_value obj = bitset_new(mrb, mrb_obj_class(mrb, self), &bs);
+    bs->is_fixed = fixed;
+    if (bsp) { *bsp = bs; }
+
+    return obj;
+}
+
 static inline void
 bitset_getmem_const(const struct bitset *bs, const uintptr_t **ptr, size_t *size)
 {
@@ -248,266 +450,553 @@ bitset_set_size(struct bitset *bs, size_t bitsize)
     }
 }
 
+/*
+ * Bitset::Fixed のビット長を変えようとしていれば例外を起こす。
+ */
 static void
-bitset_reserve(mrb_state *mrb, struct bitset *bs, ssize_t reserve_bitsize)
+bitset_check_fixed(mrb_state *mrb, const struct bitset *bs, size_t newsize)
 {
-    if (reserve_bitsize <= (ssize_t)BS_EMBEDBITS) { return; }
-
-    size_t words = unit_ceil(reserve_bitsize, BS_WORDBITS * BS_EXPAND_SIZE) * BS_EXPAND_SIZE;
+    if (bs->is_fixed && newsize != bitset_size(bs)) {
+        mrb_raisef(mrb, E_TYPE_ERROR,
+                   "can't change bit length of Bitset::Fixed (%S to %S)",
+                   mrb_fixnum_value(bitset_size(bs)),
+                   mrb_fixnum_value(newsize));
+    }
+}
 
-    if (bs->is_embed) {
-        uintptr_t *ptr = mrb_calloc(mrb, words, sizeof(uintptr_t));
-        memcpy(ptr, bs->ary, sizeof(bs->ary));
-        bs->capacity = words;
-        bs->total_len = bs->embed_len;
-        bs->ptr = ptr;
-        bs->is_embed = 0;
-    } else if (words > bs->capacity) {
-        bs->ptr = mrb_realloc(mrb, bs->ptr, words * sizeof(uintptr_t));
-        bs->capacity = words;
+/*
+ * Bitset::Matrix の行を借りたビット列であれば例外を起こす。
+ * 行列の側からの書き換えに追従できない、1 ビットの数や要約を保持させないために使う。
+ */
+static void
+bitset_check_borrowed(mrb_state *mrb, const struct bitset *bs)
+{
+    if (bs->is_borrowed) {
+        mrb_raise(mrb, E_TYPE_ERROR, "can't track or summarize a row of Bitset::Matrix");
     }
 }
 
+/*
+ * 階層的な要約 (summarize! で有効になる)
+ *
+ * 第 0 段は 0 ではないワードごとに 1 を立てたビット列、第 1 段は第 0 段の 0 ではないワードごとに
+ * 1 を立てたビット列とし、1 ワードに収まるまで重ねる (64 分木)。
+ * any? / none? / clz / ctz / next_one / prev_one は上の段から辿ることで、0 ばかりのワードを
+ * 読まずに O(log64 n) ワードで済ませる。
+ * ビット長が変わらない書き換えでは変わったワードの分だけ更新し、それ以外の操作では作り直す。
+ */
+
+#define BS_SUMMARY_LEVELS 12
+
+struct bitset_summary
+{
+    size_t nwords;                          /* 要約の対象としているビット列のワード数 */
+    int nlevels;
+    size_t offset[BS_SUMMARY_LEVELS];       /* words における各段の開始位置 */
+    size_t bits[BS_SUMMARY_LEVELS];         /* 各段のビット数 (一つ下の段のワード数) */
+    uintptr_t words[];
+};
+
+/*
+ * i 番目のワードを返す。末尾のワードであれば、ビット長を超えた余りのビットを落とす。
+ */
 static inline uintptr_t
-bitset_correct_index(mrb_state *mrb, mrb_value bitset, const struct bitset *bs, intptr_t index)
+bitset_word_live(const struct bitset *bs, size_t i)
 {
-    size_t num = bitset_size(bs);
-    mrb_int index_mod = index;
+    size_t size = bitset_size(bs);
+    uintptr_t w = bitset_ptr_const(bs)[i];
 
-    if (index_mod < 0) {
-        index_mod += num;
-        if (index_mod < 0) {
-            mrb_raisef(mrb, E_INDEX_ERROR,
-                       "wrong index for %S (expect -%S or more, but given %S)",
-                       mrb_any_to_s(mrb, bitset),
-                       mrb_fixnum_value(num), mrb_fixnum_value(index));
-        }
+    if ((i + 1) * BS_WORDBITS > size) {
+        w &= ~getmask(BS_WORDBITS - (size - i * BS_WORDBITS));
     }
 
-    return index_mod;
+    return w;
 }
 
-static void
-bitset_check_width(mrb_state *mrb, int bitwidth)
+static inline uintptr_t *
+bitset_summary_level(struct bitset_summary *sm, int level)
 {
-    if (bitwidth < 0 || bitwidth > BS_WORDBITS) {
-        mrb_raisef(mrb, E_RUNTIME_ERROR,
-                   "wrong bitwidth (expect 0..%S, but given %S)",
-                   mrb_fixnum_value(BS_WORDBITS),
-                   mrb_fixnum_value(bitwidth));
-    }
+    return sm->words + sm->offset[level];
 }
 
-static inline uintptr_t
-bitset_aref(mrb_state *mrb, mrb_value self, size_t index, int bitwidth)
+static inline bool
+bitset_summary_test(const struct bitset_summary *sm, size_t i)
 {
-    // TODO: bitwidth == 1 の場合に特化した処理を書く
+    return (sm->words[i / BS_WORDBITS] & BS_INDEX_MASK(i)) != 0;
+}
 
-    const struct bitset *bs = get_bitset(mrb, self);
-    size_t size = bitset_size(bs);
-    int pad = 0;
-    index = bitset_correct_index(mrb, self, bs, index);
-    bitset_check_width(mrb, bitwidth);
+static inline bool
+bitset_summary_any(const struct bitset_summary *sm)
+{
+    return sm->nlevels > 0 && sm->words[sm->offset[sm->nlevels - 1]] != 0;
+}
 
-    if (index >= size) { return 0; }
+/*
+ * ビット列全体から要約を作り直す。要約を持たなければ何もしない。
+ */
+static void
+bitset_summary_rebuild(mrb_state *mrb, struct bitset *bs)
+{
+    struct bitset_summary *sm = bs->summary;
+    if (!sm) { return; }
+
+    size_t nwords = unit_ceil(bitset_size(bs), BS_WORDBITS);
+
+    if (nwords != sm->nwords) {
+        struct bitset_summary layout;
+        size_t total = 0;
+        layout.nlevels = 0;
+
+        for (size_t n = nwords; n > 0; n = unit_ceil(n, BS_WORDBITS)) {
+            layout.bits[layout.nlevels] = n;
+            layout.offset[layout.nlevels] = total;
+            layout.nlevels ++;
+            total += unit_ceil(n, BS_WORDBITS);
+            if (n <= BS_WORDBITS) { break; }
+        }
 
-    if (index + bitwidth > size) {
-        pad = index + bitwidth - size;
-        bitwidth = size - index;
+        sm = mrb_realloc(mrb, sm, sizeof(struct bitset_summary) + total * sizeof(uintptr_t));
+        BS_STATS_REALLOC(mrb, sizeof(struct bitset_summary) + total * sizeof(uintptr_t));
+        bs->summary = sm;
+        sm->nwords = nwords;
+        sm->nlevels = layout.nlevels;
+        memcpy(sm->offset, layout.offset, sizeof(layout.offset));
+        memcpy(sm->bits, layout.bits, sizeof(layout.bits));
     }
 
-    size_t bits;
-    const uintptr_t *ptr = bitset_ptr_const(bs);
+    if (sm->nlevels == 0) { return; }
 
-    ptr += index / BS_WORDBITS;
+    memset(sm->words, 0, (sm->offset[sm->nlevels - 1] + 1) * sizeof(uintptr_t));
 
-    if (iswordover(index, bitwidth)) {
-        // ワード境界をまたぐ
-        size_t low = (index + bitwidth) % BS_WORDBITS;
-        bits = (getbits(ptr[0], BS_WORDBITS - index % BS_WORDBITS, bitwidth - low) << low) |
-               (getbits(ptr[1], BS_WORDBITS, low));
-    } else {
-        bits = getbits(ptr[0], BS_WORDBITS - index % BS_WORDBITS, bitwidth);
+    const uintptr_t *p = bitset_ptr_const(bs);
+    uintptr_t *lv = bitset_summary_level(sm, 0);
+    for (size_t i = 0; i + 1 < nwords; i ++) {
+        if (p[i]) { lv[i / BS_WORDBITS] |= BS_INDEX_MASK(i); }
+    }
+    if (bitset_word_live(bs, nwords - 1)) {
+        lv[(nwords - 1) / BS_WORDBITS] |= BS_INDEX_MASK(nwords - 1);
     }
 
-    return bits << pad;
+    for (int level = 1; level < sm->nlevels; level ++) {
+        const uintptr_t *lower = bitset_summary_level(sm, level - 1);
+        uintptr_t *upper = bitset_summary_level(sm, level);
+        for (size_t i = 0; i < sm->bits[level]; i ++) {
+            if (lower[i]) { upper[i / BS_WORDBITS] |= BS_INDEX_MASK(i); }
+        }
+    }
 }
 
-
-static inline void
-slide_bitset_expand(uintptr_t *ary, const uintptr_t *const term, intptr_t index, ssize_t width)
+/*
+ * i 番目のワードが 0 ではないかどうかを要約に反映する。
+ * 上の段へは、ワードが 0 かどうかが変わった時だけ伝える。
+ */
+static void
+bitset_summary_set(struct bitset_summary *sm, size_t i, bool nonzero)
 {
-    uintptr_t *p = ary + 1 + (width - 1) / BS_WORDBITS;
-    const uintptr_t *q = ary + 1;
-    q += (term - p) - 1;
-    p += (term - p) - 1;
-
-    int shlo = width % BS_WORDBITS;
-    int shhi = (BS_WORDBITS - shlo) % BS_WORDBITS;
-    int maskhi;
-    int masklo = shlo == 0 ? 0 : -1;
+    for (int level = 0; level < sm->nlevels; level ++) {
+        uintptr_t *w = bitset_summary_level(sm, level) + i / BS_WORDBITS;
+        bool was = *w != 0;
 
-    //if (p >= term) { LOGS("BUFFER OVER RUN! - p"); }
-
-    if (q > ary) {
-        for (size_t i = term - ary - (index + width) / BS_WORDBITS - 1; i > 0; i --, p --, q --) {
-            *p = (q[-1] << shhi) | ((q[0] >> shlo) & masklo);
+        if (nonzero) {
+            *w |= BS_INDEX_MASK(i);
+        } else {
+            *w &= ~BS_INDEX_MASK(i);
         }
 
-        //if (q < ary) { LOGS("BUFFER UNDER RUN! - q"); }
+        nonzero = *w != 0;
+        if (nonzero == was) { break; }
+        i /= BS_WORDBITS;
     }
+}
 
-    if (index + width < BS_WORDBITS) {
-        shhi = BS_WORDBITS - index;
-        shlo = index + width;
-        maskhi = shhi < BS_WORDBITS ? -1 : 0;
-        *p = ((q[0] >> shhi << shhi) & maskhi) | ((q[0] << index >> shlo) & masklo);
-    } else {
-        if (q > ary) {
-            *p = (q[-1] << index >> index << shhi) | ((q[0] >> shlo) & masklo);
-            p --; q --;
-        } else if (q >= ary && p > ary) {
-            *p = ((q[0] << index >> index >> shlo) & masklo);
-            p --;
-        }
-
-        for (size_t i = p - ary; i > 0; i --, p --) {
-            *p = 0;
-        }
+/*
+ * ビット長を変えずに [index, index + width) を書き換えた後に呼ぶ。
+ */
+static void
+bitset_summary_update(struct bitset *bs, size_t index, size_t width)
+{
+    struct bitset_summary *sm = bs->summary;
+    if (!sm || width == 0) { return; }
 
-        shhi = BS_WORDBITS - index;
-        maskhi = shhi < BS_WORDBITS ? -1 : 0;
-        *p = ((q[0] >> shhi << shhi) & maskhi);
+    size_t last = (index + width - 1) / BS_WORDBITS;
+    for (size_t i = index / BS_WORDBITS; i <= last; i ++) {
+        bitset_summary_set(sm, i, bitset_word_live(bs, i) != 0);
     }
 }
 
-static inline void
-slide_bitset_collapse(uintptr_t *ary, const uintptr_t *const term, intptr_t index, ssize_t width)
+/*
+ * i 番目以降で最初に 0 ではないワードの位置を返す。無ければ SIZE_MAX を返す。
+ */
+static size_t
+bitset_summary_next_word(struct bitset_summary *sm, size_t i)
 {
-    uintptr_t *p = ary;
-    const uintptr_t *q = ary + (index + width) / BS_WORDBITS;
-
-    width %= BS_WORDBITS;
+    int level = 0;
 
-    //先頭ワードの処理;
-    if (index + width >= BS_WORDBITS) {
-        int shhi = BS_WORDBITS - index;
-        int shlo = index;
-        uintptr_t hi = (*p >> shhi << shhi) & (shhi < BS_WORDBITS ? -1 : 0);
-        uintptr_t lo = (term - q > 0) ? (q[0] << ((index + width) % BS_WORDBITS) >> shlo) : 0;
-        *p = hi | lo;
-        p ++;
-    } else {
-        int shtop = BS_WORDBITS - index;
-        int shhi = index + width;
-        int shlo = BS_WORDBITS - width;
-        uintptr_t top = (*p >> shtop << shtop) & (shtop < BS_WORDBITS ? -1 : 0);
-        uintptr_t hi = (term - q > 0) ? (q[0] << shhi >> index) : 0;
-        uintptr_t lo = (term - q > 1) ? ((q[1] >> shlo) & (shlo < BS_WORDBITS ? -1 : 0)) : 0;
-        *p = top | hi | lo;
-        p ++; q ++;
-    }
+    /* 見つかるまで上の段へ上る */
+    for (;;) {
+        if (level >= sm->nlevels || i >= sm->bits[level]) { return SIZE_MAX; }
 
-    //有効ワードの処理;
-    {
-        int shhi = width % BS_WORDBITS;
-        int shlo = (BS_WORDBITS - width) % BS_WORDBITS;
-        int maskhi = shhi > 0 ? -1 : 0;
-        for (ssize_t i = term - q - 1; i > 0; i --, p ++, q ++) {
-            *p = ((q[0] << shhi) & maskhi) | (q[1] >> shlo);
+        uintptr_t w = bitset_summary_level(sm, level)[i / BS_WORDBITS] & ((uintptr_t)-1 >> (i % BS_WORDBITS));
+        if (w) {
+            i = i / BS_WORDBITS * BS_WORDBITS + count_nlz(w);
+            break;
         }
+
+        i = i / BS_WORDBITS + 1;
+        level ++;
     }
 
-    //有効ワードの端数処理;
-    if (term - q > 0) {
-        int shhi = width;
-        *p = q[0] << shhi;
-        p ++;
+    /* 最初に立っているビットを辿って下りる */
+    while (level > 0) {
+        level --;
+        i = i * BS_WORDBITS + count_nlz(bitset_summary_level(sm, level)[i]);
     }
 
-    //穴埋め;
-    memset(p, 0, sizeof(uintptr_t) * (term - p));
+    return i;
 }
 
-static inline void
-slide_bitset(uintptr_t *ary, const uintptr_t *const term, intptr_t index, ssize_t width)
+/*
+ * i 番目以前で最後に 0 ではないワードの位置を返す。無ければ SIZE_MAX を返す。
+ */
+static size_t
+bitset_summary_prev_word(struct bitset_summary *sm, size_t i)
 {
-    if (index < 0) { index = 0; }
+    int level = 0;
 
-    ary += index / BS_WORDBITS;
-    index %= BS_WORDBITS;
+    if (sm->nlevels == 0) { return SIZE_MAX; }
+    if (i >= sm->bits[0]) { i = sm->bits[0] - 1; }
 
-    if (term - ary < 1) { return; }
+    for (;;) {
+        if (level >= sm->nlevels) { return SIZE_MAX; }
 
-    if (width == 0) {
-        /* do nothing */
-    } else if (width > 0) {
-        slide_bitset_expand(ary, term, index, width);
-    } else {
-        slide_bitset_collapse(ary, term, index, -width);
+        uintptr_t w = bitset_summary_level(sm, level)[i / BS_WORDBITS] & ((uintptr_t)-1 << (BS_WORDBITS - 1 - i % BS_WORDBITS));
+        if (w) {
+            i = i / BS_WORDBITS * BS_WORDBITS + (BS_WORDBITS - 1 - count_ntz(w));
+            break;
+        }
+
+        if (i < BS_WORDBITS) { return SIZE_MAX; }
+        i = i / BS_WORDBITS - 1;
+        level ++;
+    }
+
+    while (level > 0) {
+        level --;
+        i = i * BS_WORDBITS + (BS_WORDBITS - 1 - count_ntz(bitset_summary_level(sm, level)[i]));
     }
+
+    return i;
 }
 
 static void
-bitset_slide(mrb_state *mrb, struct bitset *bs, intptr_t index, ssize_t width)
+bitset_summarize(mrb_state *mrb, struct bitset *bs)
 {
-    if (index < 0) { index = 0; }
-
-    size_t s = bitset_size(bs);
-    if (s < index) { s = index; }
-
-    bitset_reserve(mrb, bs, s + width);
-
-    uintptr_t *ptr = bitset_ptr(bs);
-    slide_bitset(ptr, ptr + unit_ceil(s, BS_WORDBITS), index, width);
+    if (bs->summary) { return; }
 
-    s += width;
-    if ((ssize_t)s < 0) { s = 0; }
-    bitset_set_size(bs, s);
+    bs->summary = mrb_calloc(mrb, 1, sizeof(struct bitset_summary));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset_summary));
+    bs->summary->nwords = SIZE_MAX;
+    bitset_summary_rebuild(mrb, bs);
 }
 
 static void
-replace_bitset(uintptr_t *ptr, uintptr_t index, int width, uintptr_t bits)
+bitset_unsummarize(mrb_state *mrb, struct bitset *bs)
 {
-    uintptr_t mask = getmask(width);
-    bits &= mask;
-    ptr += index / BS_WORDBITS;
-    index %= BS_WORDBITS;
-    if (iswordover(index, width)) {
-        int shhi = width - (BS_WORDBITS - index);
-        int shlo = BS_WORDBITS - (index + width) % BS_WORDBITS;
-        uintptr_t hi = bits >> shhi;
-        uintptr_t lo = bits << shlo;
-        ptr[0] = (ptr[0] & ~(mask >> shhi)) | hi;
-        ptr[1] = lo;
-    } else {
-        int sh = BS_WORDBITS - (index + width);
-        *ptr = (*ptr & ~(mask << sh)) | (bits << sh);
-    }
+    mrb_free(mrb, bs->summary);
+    bs->summary = NULL;
 }
 
 static void
-bitset_aset(mrb_state *mrb, mrb_value self, intptr_t index, int width, uintptr_t bits, int bitwidth)
+bitset_reserve(mrb_state *mrb, struct bitset *bs, ssize_t reserve_bitsize)
 {
-    mrbx_obj_modify(mrb, self);
+    if (reserve_bitsize <= (ssize_t)BS_EMBEDBITS || bs->is_borrowed) { return; }
 
-    struct bitset *bs = get_bitset(mrb, self);
-    index = bitset_correct_index(mrb, self, bs, index);
-    bitset_check_width(mrb, width);
-    bitset_check_width(mrb, bitwidth);
+    size_t words = unit_ceil(reserve_bitsize, BS_WORDBITS * BS_EXPAND_SIZE) * BS_EXPAND_SIZE;
 
-    bitset_slide(mrb, bs, index, bitwidth - width);
-    size_t size = bitset_size(bs);
-    if (index + bitwidth >= size) {
-        bitset_slide(mrb, bs, size, index + bitwidth - size);
+    if (bs->is_embed) {
+        uintptr_t *ptr = mrb_calloc(mrb, words, sizeof(uintptr_t));
+        BS_STATS_ALLOC(mrb, words * sizeof(uintptr_t));
+        BS_STATS_PROMOTE(mrb);
+        memcpy(ptr, bs->ary, sizeof(bs->ary));
+        bs->capacity = words;
+        bs->total_len = bs->embed_len;
+        bs->ptr = ptr;
+        bs->is_embed = 0;
+    } else if (words > bs->capacity) {
+        bs->ptr = mrb_realloc(mrb, bs->ptr, words * sizeof(uintptr_t));
+        BS_STATS_REALLOC(mrb, words * sizeof(uintptr_t));
+        bs->capacity = words;
     }
-    if (bitwidth > 0) { replace_bitset(bitset_ptr(bs), index, bitwidth, bits); }
 }
 
-static void
-bitset_aset_bitset(mrb_state *mrb, mrb_value self, intptr_t index, int width, struct bitset *bs, int bitwidth)
+static inline uintptr_t
+bitset_correct_index(mrb_state *mrb, mrb_value bitset, const struct bitset *bs, intptr_t index)
 {
-    TODO("何か書く");
+    size_t num = bitset_size(bs);
+    mrb_int index_mod = index;
+
+    if (index_mod < 0) {
+        index_mod += num;
+        if (index_mod < 0) {
+            mrb_raisef(mrb, E_INDEX_ERROR,
+                       "wrong index for %S (expect -%S or more, but given %S)",
+                       mrb_any_to_s(mrb, bitset),
+                       mrb_fixnum_value(num), mrb_fixnum_value(index));
+        }
+    }
+
+    return index_mod;
+}
+
+static void
+bitset_check_width(mrb_state *mrb, int bitwidth)
+{
+    if (bitwidth < 0 || bitwidth > BS_WORDBITS) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "wrong bitwidth (expect 0..%S, but given %S)",
+                   mrb_fixnum_value(BS_WORDBITS),
+                   mrb_fixnum_value(bitwidth));
+    }
+}
+
+/*
+ * index から bitwidth ビットを取り出す。範囲の確認は呼び出し側で済ませておくこと。
+ */
+static inline uintptr_t
+bitset_peek(const struct bitset *bs, size_t index, int bitwidth)
+{
+    if (bitwidth < 1) { return 0; }
+
+    const uintptr_t *ptr = bitset_ptr_const(bs) + index / BS_WORDBITS;
+
+    if (iswordover(index, bitwidth)) {
+        // ワード境界をまたぐ
+        size_t low = (index + bitwidth) % BS_WORDBITS;
+        return (getbits(ptr[0], BS_WORDBITS - index % BS_WORDBITS, bitwidth - low) << low) |
+               (getbits(ptr[1], BS_WORDBITS, low));
+    } else {
+        return getbits(ptr[0], BS_WORDBITS - index % BS_WORDBITS, bitwidth);
+    }
+}
+
+/*
+ * index のビットを取り出す。範囲の確認は呼び出し側で済ませておくこと。
+ */
+static inline int
+bitset_test(const struct bitset *bs, size_t index)
+{
+    return (bitset_ptr_const(bs)[index / BS_WORDBITS] & BS_INDEX_MASK(index)) != 0;
+}
+
+static inline uintptr_t
+bitset_aref(mrb_state *mrb, mrb_value self, size_t index, int bitwidth)
+{
+    const struct bitset *bs = get_bitset(mrb, self);
+    size_t size = bitset_size(bs);
+    int pad = 0;
+    index = bitset_correct_index(mrb, self, bs, index);
+
+    if (bitwidth == 1) {
+        return index < size ? bitset_test(bs, index) : 0;
+    }
+
+    bitset_check_width(mrb, bitwidth);
+
+    if (index >= size) { return 0; }
+
+    if (index + bitwidth > size) {
+        pad = index + bitwidth - size;
+        bitwidth = size - index;
+    }
+
+    return bitset_peek(bs, index, bitwidth) << pad;
+}
+
+
+static void
+replace_bitset(uintptr_t *ptr, uintptr_t index, int width, uintptr_t bits)
+{
+    uintptr_t mask = getmask(width);
+    bits &= mask;
+    ptr += index / BS_WORDBITS;
+    index %= BS_WORDBITS;
+    if (iswordover(index, width)) {
+        int shhi = width - (BS_WORDBITS - index);
+        int shlo = BS_WORDBITS - (index + width) % BS_WORDBITS;
+        uintptr_t hi = bits >> shhi;
+        uintptr_t lo = bits << shlo;
+        ptr[0] = (ptr[0] & ~(mask >> shhi)) | hi;
+        ptr[1] = (ptr[1] & ~(mask << shlo)) | lo;
+    } else {
+        int sh = BS_WORDBITS - (index + width);
+        *ptr = (*ptr & ~(mask << sh)) | (bits << sh);
+    }
+}
+
+/*
+ * ptr の [src, src + width) を [dst, dst + width) に動かす。二つの範囲は重なっていてもよく、
+ * 書き込む範囲の外にあるビットは変えない。
+ *
+ * 前へ動かすときは先頭から、後ろへ動かすときは末尾から、dst のワード境界で区切って写すため、
+ * まだ読んでいないビットを上書きすることはない。
+ */
+static void
+move_bitset(uintptr_t *ptr, size_t dst, size_t src, size_t width)
+{
+    if (width == 0 || dst == src) { return; }
+
+    if (dst < src) {
+        while (width > 0) {
+            size_t c = BS_WORDBITS - dst % BS_WORDBITS;
+            if (c > width) { c = width; }
+            replace_bitset(ptr, dst, c, aux_peek_bits(ptr, src, c));
+            dst += c;
+            src += c;
+            width -= c;
+        }
+    } else {
+        while (width > 0) {
+            size_t c = (dst + width) % BS_WORDBITS;
+            if (c == 0 || c > width) { c = (width < BS_WORDBITS) ? width : BS_WORDBITS; }
+            width -= c;
+            replace_bitset(ptr, dst + width, c, aux_peek_bits(ptr, src + width, c));
+        }
+    }
+}
+
+/*
+ * index 以降を width ビットずらす。width が正なら index に 0 を width ビット差し込み、
+ * 負なら index から -width ビットを取り除く (ビット長を超える分は取り除かない)。
+ * index がビット長を超えていれば、先に 0 で index まで伸ばす。
+ */
+static void
+bitset_slide(mrb_state *mrb, struct bitset *bs, intptr_t index, ssize_t width)
+{
+    if (index < 0) { index = 0; }
+
+    size_t s = bitset_size(bs);
+    if (s < (size_t)index) { s = index; }
+    if (width < 0 && (size_t)-width > s - index) { width = -(ssize_t)(s - index); }
+
+    bitset_check_fixed(mrb, bs, s + width);
+    BS_STATS_SLIDE(mrb, s - index);
+
+    bitset_grow(mrb, bs, width > 0 ? s + width : s);
+    uintptr_t *ptr = bitset_ptr(bs);
+
+    if (width > 0) {
+        move_bitset(ptr, index + width, index, s - index);
+        bitset_fill_range(bs, index, width, false);
+    } else if (width < 0) {
+        move_bitset(ptr, index, index - width, s - index + width);
+    }
+
+    bitset_set_size(bs, s + width);
+}
+
+static void
+bitset_aset(mrb_state *mrb, mrb_value self, intptr_t index, int width, uintptr_t bits, int bitwidth)
+{
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+    index = bitset_correct_index(mrb, self, bs, index);
+    bitset_check_width(mrb, width);
+    bitset_check_width(mrb, bitwidth);
+
+    if (bs->is_fixed) {
+        size_t size = bitset_size(bs);
+        bitset_check_fixed(mrb, bs, size + bitwidth - width);
+        if (index + width > size) {
+            mrb_raisef(mrb, E_INDEX_ERROR,
+                       "out of range for Bitset::Fixed (index %S, width %S, but bit length is %S)",
+                       mrb_fixnum_value(index), mrb_fixnum_value(width), mrb_fixnum_value(size));
+        }
+    }
+
+    if (width == bitwidth && index + width <= bitset_size(bs)) {
+        /* ビット長が変わらない場合はスライドせずに置き換えるだけ */
+        if (width > 0) {
+            uintptr_t *ptr = bitset_ptr(bs);
+            if (bs->is_tracked) {
+                size_t oldcount = bitset_popcount_range(bs, index, width);
+                replace_bitset(ptr, index, width, bits);
+                bs->popcount = bs->popcount - oldcount + bitset_popcount_range(bs, index, width);
+            } else {
+                replace_bitset(ptr, index, width, bits);
+            }
+            bitset_summary_update(bs, index, width);
+        }
+        return;
+    }
+
+    bitset_slide(mrb, bs, index, bitwidth - width);
+    size_t size = bitset_size(bs);
+    if (index + bitwidth > size) {
+        bitset_slide(mrb, bs, size, index + bitwidth - size);
+    }
+    if (bitwidth > 0) { replace_bitset(bitset_ptr(bs), index, bitwidth, bits); }
+
+    if (bs->is_tracked) {
+        /* ビット長が変わる場合はスライドで O(n) となるため、数え直しても計算量は変わらない */
+        bs->popcount = bitset_popcount_scan(bs);
+    }
+
+    bitset_summary_rebuild(mrb, bs);
+}
+
+/*
+ * [index, index + width) を src の先頭 bitwidth ビットで置き換える。src のビット長を超えた部分は 0 とする。
+ * bitset_aset と異なり、width と bitwidth は 1 ワードに収まらなくてもよい。
+ */
+static void
+bitset_aset_bitset(mrb_state *mrb, mrb_value self, intptr_t index, int width, const struct bitset *src, int bitwidth)
+{
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+    index = bitset_correct_index(mrb, self, bs, index);
+
+    if (width < 0 || bitwidth < 0) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong negative width (width %S, bitwidth %S)",
+                   mrb_fixnum_value(width), mrb_fixnum_value(bitwidth));
+    }
+
+    if (bs->is_fixed) {
+        size_t size = bitset_size(bs);
+        bitset_check_fixed(mrb, bs, size + bitwidth - width);
+        if (index + width > size) {
+            mrb_raisef(mrb, E_INDEX_ERROR,
+                       "out of range for Bitset::Fixed (index %S, width %S, but bit length is %S)",
+                       mrb_fixnum_value(index), mrb_fixnum_value(width), mrb_fixnum_value(size));
+        }
+    }
+
+    size_t avail = bitset_size(src) < (size_t)bitwidth ? bitset_size(src) : (size_t)bitwidth;
+    const uintptr_t *q = bitset_ptr_const(src);
+
+    if (src == bs && avail > 0) {
+        /* スライドで動く前に写しておく */
+        mrb_value tmp = mrb_str_new(mrb, (const char *)q, unit_ceil(avail, BS_WORDBITS) * sizeof(uintptr_t));
+        q = (const uintptr_t *)RSTRING_PTR(tmp);
+    }
+
+    bool resized = (width != bitwidth || index + width > bitset_size(bs));
+
+    if (resized) {
+        bitset_slide(mrb, bs, index, (ssize_t)bitwidth - width);
+        bitset_grow(mrb, bs, index + bitwidth);
+    }
+
+    size_t oldcount = (!resized && bs->is_tracked) ? bitset_popcount_range(bs, index, bitwidth) : 0;
+    uintptr_t *p = bitset_ptr(bs);
+    bitset_copy_bits(p, index, q, 0, avail);
+    bitset_fill_range(bs, index + avail, bitwidth - avail, false);
+
+    if (resized) {
+        if (bs->is_tracked) { bs->popcount = bitset_popcount_scan(bs); }
+        bitset_summary_rebuild(mrb, bs);
+    } else {
+        if (bs->is_tracked) { bs->popcount = bs->popcount - oldcount + bitset_popcount_range(bs, index, bitwidth); }
+        bitset_summary_update(bs, index, bitwidth);
+    }
 }
 
 static void
@@ -524,13 +1013,19 @@ flip_bitset(mrb_state *mrb, struct bitset *bs)
     }
 
     int rest = BS_WORDBITS - size % BS_WORDBITS;
-    for (int i = size / BS_WORDBITS; i > 0; i --, p ++) {
+    for (size_t i = size / BS_WORDBITS; i > 0; i --, p ++) {
         *p = ~*p;
     }
 
-    if (rest > 0) {
+    if (rest < BS_WORDBITS) {
         *p ^= ((uintptr_t)-1 << rest);
     }
+
+    if (bs->is_tracked) {
+        bs->popcount = size - bs->popcount;
+    }
+
+    bitset_summary_rebuild(mrb, bs);
 }
 
 static void
@@ -542,104 +1037,187 @@ bitset_copy(mrb_state *mrb, struct bitset *dest, const struct bitset *src)
         // embed にする
         dest->is_embed = 1;
         dest->embed_len = src->total_len;
-        memcpy(dest->ary, src->ptr, sizeof(dest->ary));
+        memset(dest->ary, 0, sizeof(dest->ary));
+        memcpy(dest->ary, src->ptr, unit_ceil(src->total_len, BS_WORDBITS) * sizeof(*src->ptr));
     } else {
+        /* 借り物の行は、使っているワードより後ろが他の行となる */
         size_t capacity = unit_ceil(src->total_len, BS_WORDBITS * BS_EXPAND_SIZE) * BS_EXPAND_SIZE;
         dest->ptr = mrb_calloc(mrb, capacity, sizeof(*src->ptr));
-        memcpy(dest->ptr, src->ptr, capacity * sizeof(*src->ptr));
+        BS_STATS_ALLOC(mrb, capacity * sizeof(*src->ptr));
+        memcpy(dest->ptr, src->ptr, unit_ceil(src->total_len, BS_WORDBITS) * sizeof(*src->ptr));
         dest->total_len = src->total_len;
         dest->capacity = capacity;
         dest->is_embed = 0;
     }
+
+    dest->is_fixed = src->is_fixed;
+    dest->is_borrowed = 0;
+
+    dest->has_hash = src->has_hash;
+    dest->hash = src->hash;
+    dest->is_tracked = src->is_tracked;
+    dest->popcount = src->popcount;
+
+    dest->summary = NULL;
+    if (src->summary) { bitset_summarize(mrb, dest); }
 }
 
-static void
-bitset_load_from_bit_string(mrb_state *mrb, struct bitset *bs, struct RString *src, ssize_t width)
+#if defined(__SSE2__) || (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64)))
+# include <emmintrin.h>
+# define BS_DECODE_BLOCK 16
+
+/*
+ * 16 文字をまとめて '0' と '1' に分類する。
+ * 先頭から連続して '0' か '1' である文字数を返し、*bits の下位 16 ビットには
+ * 先頭の文字を最上位ビットとしてそれぞれのビット値を格納する。
+ */
+MRBX_FORCE_INLINE int
+decode_bit_block(const char *ch, uintptr_t *bits)
 {
-    if (width < 0) {
-        const char *ch = RSTR_PTR(src);
-        width = 0;
-        for (mrb_int i = RSTR_LEN(src); i > 0; i --, ch ++) {
-            switch (*ch) {
-            case '0': case '1':
-                width ++;
-                break;
-            case ' ': case '_': case '.': case '-': case ':':
-                break;
-            default:
-                i = 0; /* for ループから脱出 */
-                break;
-            }
-        }
-    }
+    __m128i v = _mm_loadu_si128((const __m128i *)ch);
 
-    bitset_reserve(mrb, bs, width);
-    bitset_set_size(bs, width);
-    if (width < 1) { return; }
+    /* バイト順を反転して、先頭の文字が movemask の最上位ビットになるようにする */
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
 
-    const char *ch = RSTR_PTR(src);
-    uintptr_t *p = bitset_ptr(bs);
+    __m128i one = _mm_cmpeq_epi8(v, _mm_set1_epi8('1'));
+    __m128i valid = _mm_or_si128(one, _mm_cmpeq_epi8(v, _mm_set1_epi8('0')));
+    unsigned invalid = ~_mm_movemask_epi8(valid) & 0xffff;
 
-    for (size_t i = width / BS_WORDBITS; i > 0; i --, p ++, width -= BS_WORDBITS) {
-        uintptr_t n = 0;
-        for (int j = BS_WORDBITS; j > 0; j --) {
-            unsigned char tmp;
+    *bits = _mm_movemask_epi8(one);
 
-            for (;;) {
-                tmp = *ch ++;
-                if (tmp == '0' || tmp == '1') {
-                    tmp -= '0';
-                    break;
-                }
+    if (invalid == 0) {
+        return 16;
+    } else {
+        return count_nlz((uintptr_t)invalid << (BS_WORDBITS - 16));
+    }
+}
+#elif defined(BS_LITTLE_ENDIAN)
+# define BS_DECODE_BLOCK 8
 
-                switch (tmp) {
-                case ' ': case '_': case '.': case '-': case ':':
-                    break;
-                default:
-                    *p ++ = n;
-                    width -= BS_WORDBITS;
-                    goto fill_zero;
-                }
-            }
+/*
+ * SIMD 命令がない場合は 64 ビット整数で 8 文字をまとめて処理する (SWAR)。
+ * 戻り値と *bits の意味は SSE2 版と同じ (ただし *bits は下位 8 ビット)。
+ */
+MRBX_FORCE_INLINE int
+decode_bit_block(const char *ch, uintptr_t *bits)
+{
+    uint64_t x;
+    memcpy(&x, ch, sizeof(x));
+    x ^= UINT64_C(0x3030303030303030); /* '0' と '1' が 0 と 1 になる */
 
-            n |= (uintptr_t)tmp << (j - 1);
-        }
-        *p = n;
+    /* 各バイトの最下位ビットを、先頭のバイトが最上位となるように 8 ビットに集める */
+    *bits = ((x & UINT64_C(0x0101010101010101)) * UINT64_C(0x8040201008040201)) >> 56;
+
+    uint64_t invalid = x & UINT64_C(0xfefefefefefefefe);
+
+    if (invalid == 0) {
+        return 8;
+    } else if ((uint32_t)invalid != 0) {
+        return count_ntz((uint32_t)invalid) / 8;
+    } else {
+        return 4 + count_ntz((uint32_t)(invalid >> 32)) / 8;
     }
+}
+#endif
 
-    {
-        uintptr_t n = 0;
-        int rest = width % BS_WORDBITS;
-        int off = BS_WORDBITS - rest - 1;
-        for (int j = rest; j > 0; j --) {
-            unsigned char tmp;
-
-            for (;;) {
-                tmp = *ch ++;
-                if (tmp == '0' || tmp == '1') {
-                    tmp -= '0';
-                    break;
-                }
+struct bitdecoder
+{
+    uintptr_t *p;
+    uintptr_t n;    /* 書き込み前のビット列 (上位ビットに詰める) */
+    int bits;       /* n に溜まっているビット数 */
+};
 
-                switch (tmp) {
-                case ' ': case '_': case '.': case '-': case ':':
-                    break;
-                default:
-                    *p ++ = n;
-                    width -= BS_WORDBITS;
-                    goto fill_zero;
-                }
+MRBX_FORCE_INLINE void
+bitdecoder_push(struct bitdecoder *d, uintptr_t n, int width)
+{
+    if (d->bits + width < (int)BS_WORDBITS) {
+        d->n |= n << (BS_WORDBITS - d->bits - width);
+        d->bits += width;
+    } else {
+        int rest = d->bits + width - BS_WORDBITS;
+        *d->p ++ = d->n | (n >> rest);
+        d->n = rest > 0 ? n << (BS_WORDBITS - rest) : 0;
+        d->bits = rest;
+    }
+}
+
+/*
+ * '0' と '1' からなる文字列を、区切り文字を読み飛ばしながら最大 maxbits ビットまで p に書き込む。
+ * それ以外の文字が現れたら終了する。書き込んだビット数を返す。
+ *
+ * 区切り文字のないブロックは BS_DECODE_BLOCK 文字ずつまとめて処理し、
+ * 区切り文字を含むブロックでもその手前までをまとめて処理する。
+ */
+static size_t
+decode_bit_string(uintptr_t *p, const char *ch, size_t len, size_t maxbits)
+{
+    struct bitdecoder d = { p, 0, 0 };
+    const char *end = ch + len;
+    size_t total = 0;
+
+    while (total < maxbits) {
+#ifdef BS_DECODE_BLOCK
+        if (end - ch >= BS_DECODE_BLOCK && maxbits - total >= BS_DECODE_BLOCK) {
+            uintptr_t bits;
+            int n = decode_bit_block(ch, &bits);
+            if (n > 0) {
+                bitdecoder_push(&d, bits >> (BS_DECODE_BLOCK - n), n);
+                ch += n;
+                total += n;
+                continue;
             }
+        }
+#endif
+
+        if (ch >= end) { break; }
 
-            n |= (uintptr_t)tmp << (off + j);
+        switch (*ch ++) {
+        case '0':
+            bitdecoder_push(&d, 0, 1);
+            total ++;
+            break;
+        case '1':
+            bitdecoder_push(&d, 1, 1);
+            total ++;
+            break;
+        case ' ': case '_': case '.': case '-': case ':':
+            break;
+        default:
+            goto end_of_bits;
         }
-        *p = n;
-        width -= BS_WORDBITS;
     }
 
-fill_zero:
-    if (width >= 0) {
-        memset(p, 0, unit_ceil(width, BS_WORDBITS) * sizeof(*p));
+end_of_bits:
+    if (d.bits > 0) {
+        *d.p = d.n;
+    }
+
+    return total;
+}
+
+static void
+bitset_load_from_bit_string(mrb_state *mrb, struct bitset *bs, struct RString *src, ssize_t width)
+{
+    /*
+     * 幅が与えられていない場合、文字数はビット数の上限となるため、
+     * 先に数えることはせずに文字数分を確保して一回で読み込む。
+     */
+    size_t maxbits = width < 0 ? (size_t)RSTR_LEN(src) : (size_t)width;
+
+    bitset_reserve(mrb, bs, maxbits);
+
+    uintptr_t *p = bitset_ptr(bs);
+    size_t bits = decode_bit_string(p, RSTR_PTR(src), RSTR_LEN(src), maxbits);
+
+    if (width < 0) {
+        bitset_set_size(bs, bits);
+    } else {
+        size_t used = unit_ceil(bits, BS_WORDBITS);
+        memset(p + used, 0, (unit_ceil(width, BS_WORDBITS) - used) * sizeof(*p));
+        bitset_set_size(bs, width);
     }
 }
 
@@ -753,10 +1331,12 @@ bs_init(mrb_state *mrb, mrb_value self)
     mrb_value arg1 = mrb_undef_value();
     mrb_value arg2 = mrb_undef_value();
     mrb_get_args(mrb, "|oo", &arg1, &arg2);
+    BS_STATS_CALL(mrb, self);
 
     bitset_check_uninitialized(mrb, self);
 
     struct bitset *bs = mrb_calloc(mrb, 1, sizeof(struct bitset));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset));
     mrb_data_init(self, bs, &bitset_type);
     bs->is_embed = true;
 
@@ -784,11 +1364,13 @@ bs_init_copy(mrb_state *mrb, mrb_value self)
 {
     mrb_value origv;
     mrb_get_args(mrb, "o", &origv);
+    BS_STATS_CALL(mrb, self);
     const struct bitset *orig = get_bitset(mrb, origv);
 
     bitset_check_uninitialized(mrb, self);
 
     struct bitset *bs = mrb_calloc(mrb, 1, sizeof(struct bitset));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset));
     mrb_data_init(self, bs, &bitset_type);
     bs->is_embed = true;
 
@@ -801,16 +1383,22 @@ static mrb_value
 bs_size(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
     return mrb_fixnum_value(bitset_size(get_bitset(mrb, self)));
 }
 
+static size_t
+bitset_capacity(const struct bitset *bs)
+{
+    return bs->is_embed ? BS_EMBEDBITS : bs->capacity * BS_WORDBITS;
+}
+
 static mrb_value
 bs_capacity(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
-    const struct bitset *bs = get_bitset(mrb, self);
-    size_t capacity = bs->is_embed ? BS_EMBEDBITS : bs->capacity * BS_WORDBITS;
-    return mrb_fixnum_value(capacity);
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_capacity(get_bitset(mrb, self)));
 }
 
 static mrb_value
@@ -818,6 +1406,7 @@ bs_reserve(mrb_state *mrb, mrb_value self)
 {
     mrb_int bitsize;
     mrb_get_args(mrb, "i", &bitsize);
+    BS_STATS_CALL(mrb, self);
     mrbx_obj_modify(mrb, self);
     bitset_reserve(mrb, get_bitset(mrb, self), bitsize);
     return self;
@@ -826,19 +1415,22 @@ bs_reserve(mrb_state *mrb, mrb_value self)
 static void
 bitset_shrink(mrb_state *mrb, struct bitset *bs)
 {
-    if (bs->is_embed) { return; }
+    if (bs->is_embed || bs->is_borrowed) { return; }
 
     if (bs->total_len <= BS_EMBEDBITS) {
         uintptr_t *ptr = bs->ptr;
         bs->embed_len = bs->total_len;
         bs->is_embed = 1;
         memcpy(bs->ary, ptr, sizeof(bs->ary)); /* ptr は常に 4 以上のはず */
+        mrb_free(mrb, ptr);
+        BS_STATS_DEMOTE(mrb);
     } else {
         size_t used = unit_ceil(bs->total_len, BS_WORDBITS);
 
         if (bs->capacity - used >= BS_EXPAND_SIZE) {
             size_t shrinkwords = align_ceil(used, BS_EXPAND_SIZE);
             bs->ptr = mrb_realloc(mrb, bs->ptr, shrinkwords * sizeof(uintptr_t));
+            BS_STATS_REALLOC(mrb, shrinkwords * sizeof(uintptr_t));
             bs->capacity = shrinkwords;
         }
     }
@@ -848,6 +1440,7 @@ static mrb_value
 bs_shrink(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
     mrbx_obj_modify(mrb, self);
     bitset_shrink(mrb, get_bitset(mrb, self));
     return self;
@@ -858,14 +1451,13 @@ bs_fill(mrb_state *mrb, mrb_value self)
 {
     mrb_value fill = mrb_true_value();
     mrb_get_args(mrb, "|o", &fill);
+    BS_STATS_CALL(mrb, self);
 
-    struct bitset *bs = get_bitset(mrb, self);
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
     size_t size = bitset_size(bs);
     uintptr_t *p = bitset_ptr(bs);
     uintptr_t bits;
 
-    mrbx_obj_modify(mrb, self);
-
     if (mrb_bool(fill)) {
         bits = -1;
     } else {
@@ -880,6 +1472,12 @@ bs_fill(mrb_state *mrb, mrb_value self)
         *p = bits << (BS_WORDBITS - size);
     }
 
+    if (bs->is_tracked) {
+        bs->popcount = bits ? bitset_size(bs) : 0;
+    }
+
+    bitset_summary_rebuild(mrb, bs);
+
     return self;
 }
 
@@ -887,14 +1485,17 @@ static mrb_value
 bs_clear(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
 
-    struct bitset *bs = get_bitset(mrb, self);
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+    bitset_check_fixed(mrb, bs, 0);
     size_t size = bitset_size(bs);
     uintptr_t *p = bitset_ptr(bs);
 
-    mrbx_obj_modify(mrb, self);
     bitset_set_size(bs, 0);
     memset(p, 0, unit_ceil(size, BS_WORDBITS) * sizeof(uintptr_t));
+    bs->popcount = 0;
+    bitset_summary_rebuild(mrb, bs);
 
     return self;
 }
@@ -907,6 +1508,7 @@ static mrb_value
 bs_aref(mrb_state *mrb, mrb_value self)
 {
     mrb_int index, bitwidth;
+    BS_STATS_CALL(mrb, self);
     switch (mrb_get_args(mrb, "i|i", &index, &bitwidth)) {
     case 1:
         bitwidth = 1;
@@ -934,6 +1536,7 @@ bs_aset(mrb_state *mrb, mrb_value self)
     mrb_int index;
     mrb_value args[3];
 
+    BS_STATS_CALL(mrb, self);
     switch (mrb_get_args(mrb, "io|oo", &index, &args[0], &args[1], &args[2])) {
     case 2:
         bitset_aset(mrb, self, index, 1, aux_make_bits(mrb, args[0]), 1);
@@ -994,429 +1597,2461 @@ bs_aset(mrb_state *mrb, mrb_value self)
     return self;
 }
 
-static mrb_value
-bs_flip(mrb_state *mrb, mrb_value self)
+/*
+ * ビット長を size まで伸ばす。新たに現れたビットは 0 となる。
+ */
+static void
+bitset_grow(mrb_state *mrb, struct bitset *bs, size_t size)
 {
-    mrb_get_args(mrb, "");
-    const struct bitset *src = get_bitset(mrb, self);
-    struct bitset *dest;
-    mrb_value dup = bitset_new(mrb, mrb_obj_class(mrb, self), &dest);
-    bitset_copy(mrb, dest, src);
+    size_t oldsize = bitset_size(bs);
+    if (size <= oldsize) { return; }
 
-    flip_bitset(mrb, dest);
+    bitset_reserve(mrb, bs, size);
 
-    return dup;
+    uintptr_t *p = bitset_ptr(bs) + oldsize / BS_WORDBITS;
+    size_t words = unit_ceil(size, BS_WORDBITS) - oldsize / BS_WORDBITS;
+
+    if (oldsize % BS_WORDBITS > 0) {
+        int pad = BS_WORDBITS - oldsize % BS_WORDBITS;
+        *p = *p >> pad << pad;
+        p ++;
+        words --;
+    }
+
+    memset(p, 0, words * sizeof(uintptr_t));
+    bitset_set_size(bs, size);
 }
 
-static mrb_value
-bs_flip_bang(mrb_state *mrb, mrb_value self)
+/*
+ * ビット長を size に変える。伸ばした部分は 0 となる。
+ */
+static void
+bitset_resize(mrb_state *mrb, struct bitset *bs, size_t size)
 {
-    mrb_get_args(mrb, "");
-    struct bitset *bs = get_bitset(mrb, self);
-    mrbx_obj_modify(mrb, self);
-
-    flip_bitset(mrb, bs);
+    size_t oldsize = bitset_size(bs);
+    if (size == oldsize) { return; }
 
-    return self;
-}
+    bitset_check_fixed(mrb, bs, size);
 
-typedef uintptr_t operator_f(uintptr_t a, uintptr_t b);
+    if (size > oldsize) {
+        bitset_grow(mrb, bs, size);
+    } else {
+        bitset_set_size(bs, size);
+        if (bs->is_tracked) { bs->popcount = bitset_popcount_scan(bs); }
+    }
 
-static inline operator_f operator_or;
-static inline operator_f operator_nor;
-static inline operator_f operator_and;
-static inline operator_f operator_nand;
-static inline operator_f operator_xor;
-static inline operator_f operator_xnor;
+    bitset_summary_rebuild(mrb, bs);
+}
 
+/*
+ * [index, index + width) を bit で埋める。範囲はビット長の内側であること。
+ */
 static void
-bitset_msb_operate(mrb_state *mrb, mrb_value self, operator_f *operator)
+bitset_fill_range(struct bitset *bs, size_t index, size_t width, bool bit)
 {
-    const struct bitset *other;
-    mrb_get_args(mrb, "d", &other, &bitset_type);
-    struct bitset *bs = get_bitset(mrb, self);
-    mrbx_obj_modify(mrb, self);
+    if (width == 0) { return; }
 
-    size_t size1 = bitset_size(bs);
-    size_t size2 = bitset_size(other);
+    uintptr_t *p = bitset_ptr(bs) + index / BS_WORDBITS;
+    int off = index % BS_WORDBITS;
+    uintptr_t fill = bit ? (uintptr_t)-1 : 0;
+    uintptr_t mask;
 
-    if (size1 < size2) {
-        bitset_reserve(mrb, bs, size2);
-        bitset_set_size(bs, size2);
+    if (off + width <= BS_WORDBITS) {
+        mask = getmask(width) << (BS_WORDBITS - off - width);
+        *p = (*p & ~mask) | (fill & mask);
+        return;
     }
 
-    uintptr_t *p1 = bitset_ptr(bs);
-    const uintptr_t *p2 = bitset_ptr_const(other);
-
-    for (size_t i = size2 / BS_WORDBITS; i > 0; i --, p1 ++, p2 ++) {
-        *p1 = operator(*p1, *p2);
+    if (off > 0) {
+        mask = (uintptr_t)-1 >> off;
+        *p = (*p & ~mask) | (fill & mask);
+        width -= BS_WORDBITS - off;
+        p ++;
     }
 
-    size1 -= (size2 / BS_WORDBITS) * BS_WORDBITS;
-    size2 -= (size2 / BS_WORDBITS) * BS_WORDBITS;
+    memset(p, bit ? 0xff : 0, width / BS_WORDBITS * sizeof(uintptr_t));
+    p += width / BS_WORDBITS;
+    width %= BS_WORDBITS;
 
-    if (size1 < BS_WORDBITS) {
-        int pad1 = BS_WORDBITS - size1;
-        int pad2 = BS_WORDBITS - size2;
-        *p1 = operator(size1 > 0 ? (*p1 >> pad1 << pad1) : 0,
-                       size2 > 0 ? (*p2 >> pad2 << pad2) : 0);
-    } else {
-        if (size2 > 0) {
-            int pad2 = BS_WORDBITS - size2;
-            uintptr_t n2 = *p2 >> pad2 << pad2;
-            *p1 = operator(*p1, n2);
-            p1 ++;
-            size1 -= BS_WORDBITS;
-        }
+    if (width > 0) {
+        mask = (uintptr_t)-1 << (BS_WORDBITS - width);
+        *p = (*p & ~mask) | (fill & mask);
+    }
+}
 
-        for (size_t i = size1 / BS_WORDBITS; i > 0; i --, p1 ++) {
-            *p1 = operator(*p1, 0);
+/*
+ * 配列の要素を検査して、最大値 + 1 を返す (空であれば 0)。
+ * 負の要素は base を足して補正する。補正しても負になる場合は例外を起こす。
+ */
+static size_t
+aux_indices_limit(mrb_state *mrb, const mrb_value *p, size_t len, mrb_int base)
+{
+    mrb_int max = -1;
+
+    for (size_t i = 0; i < len; i ++) {
+        if (!mrb_fixnum_p(p[i])) {
+            mrb_raisef(mrb, E_TYPE_ERROR,
+                       "wrong index type (expect Integer, but given %S)",
+                       mrb_inspect(mrb, p[i]));
         }
-        size1 %= BS_WORDBITS;
 
-        if (size1 > 0) {
-            int pad1 = BS_WORDBITS - size1;
-            *p1 = operator(*p1 >> pad1 << pad1, 0);
+        mrb_int n = mrb_fixnum(p[i]);
+        if (n < 0) {
+            if (n + base < 0) {
+                mrb_raisef(mrb, E_INDEX_ERROR,
+                           "wrong index (expect -%S or more, but given %S)",
+                           mrb_fixnum_value(base), p[i]);
+            }
+            n += base;
         }
+        if (n > max) { max = n; }
     }
+
+    return max + 1;
 }
 
-static void
-bitset_lsb_operate(mrb_state *mrb, mrb_value self, operator_f *operator)
+/*
+ * 添字の配列によるビットの読み書き (from_indices / set_many! / values_at など)
+ *
+ * 添字の配列は aux_indices_limit() で一度だけ検査し、以降は検査せずに読む。
+ */
+
+enum bitset_bit_op
 {
-    const struct bitset *other;
-    mrb_get_args(mrb, "d", &other, &bitset_type);
-    struct bitset *bs = get_bitset(mrb, self);
-    mrbx_obj_modify(mrb, self);
+    BS_BIT_SET,
+    BS_BIT_RESET,
+    BS_BIT_TOGGLE,
+};
 
-    size_t size1 = bitset_size(bs);
-    size_t size2 = bitset_size(other);
+/* 何個先の添字が指すワードを先読みするか */
+#define BS_PREFETCH_DISTANCE 8
 
-    if (size1 < size2) {
-        bitset_slide(mrb, bs, 0, size2 - size1);
-        size1 = size2;
-    }
+#if defined(__GNUC__) || defined(__clang__)
+# define BS_PREFETCH(P, RW) __builtin_prefetch((P), (RW))
+#else
+# define BS_PREFETCH(P, RW) ((void)0)
+#endif
 
-    uintptr_t *p1 = bitset_ptr(bs);
-    const uintptr_t *p2 = bitset_ptr_const(other);
+/*
+ * 振り分けた後の添字。pos は元の配列での位置。
+ */
+struct bs_index_pos
+{
+    size_t index;
+    size_t pos;
+};
 
-    ssize_t pad = size1 - size2;
+/*
+ * 検査済みの添字配列の k 番目をビット位置に直す。
+ * order を与えた場合は振り分けた後の k 番目を読む。
+ */
+static inline size_t
+aux_index_at(const mrb_value *p, const struct bs_index_pos *order, size_t k, mrb_int base)
+{
+    if (order) { return order[k].index; }
 
-    for (ssize_t i = pad / BS_WORDBITS; i > 0; i --, p1 ++, size1 -= BS_WORDBITS, pad -= BS_WORDBITS) {
-        *p1 = operator(*p1, 0);
-    }
+    mrb_int n = mrb_fixnum(p[k]);
+    return n < 0 ? n + base : n;
+}
 
-    if (pad == 0) {
-        if (size1 != size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) != size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+/*
+ * 添字をビット位置の上位ビットで振り分けて返す。
+ * ビット長に対して添字が多い場合、メモリへのアクセスがほぼ連続するようになる。
+ * 振り分けには計数ソートを用いるため、比較ソートより速い。
+ *
+ * 作業領域は GC に任せる (呼び出したメソッドから戻るまでは GC arena によって保護される)。
+ */
+static const struct bs_index_pos *
+aux_indices_order(mrb_state *mrb, const mrb_value *p, size_t len, mrb_int base, size_t limit)
+{
+    enum { BUCKETS = 4096 };
 
-        for (int i = unit_ceil(size1, BS_WORDBITS); i > 0; i --, p1 ++, p2 ++) {
-            *p1 = operator(*p1, *p2);
-        }
-    } else {
-        if (size1 <= size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) <= size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+    int shift = 0;
+    while (limit > 0 && (limit - 1) >> shift >= BUCKETS) { shift ++; }
 
-        /* NOTE: pad は [1, 32) の値域を取る */
-        int shhi = BS_WORDBITS - pad;
-        int shlo = pad;
+    mrb_value tmp = mrb_str_new(mrb, NULL, (BUCKETS + 1) * sizeof(size_t) + len * sizeof(struct bs_index_pos));
+    size_t *count = (size_t *)RSTRING_PTR(tmp);
+    struct bs_index_pos *order = (struct bs_index_pos *)(count + BUCKETS + 1);
+    memset(count, 0, (BUCKETS + 1) * sizeof(size_t));
 
-        //最初はp2の上位ビットを切り出して下位ビットとする;
-        *p1 = operator(*p1, *p2 >> shlo);
-        p1 ++;
-        size1 -= BS_WORDBITS;
-        size2 -= shhi;
+    for (size_t k = 0; k < len; k ++) {
+        count[(aux_index_at(p, NULL, k, base) >> shift) + 1] ++;
+    }
 
-        if (size1 != size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) != size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+    for (size_t i = 1; i <= BUCKETS; i ++) {
+        count[i] += count[i - 1];
+    }
 
-        for (int i = size1 / BS_WORDBITS; i > 0; i --, p1 ++, p2 ++, size1 -= BS_WORDBITS, size2 -= BS_WORDBITS) {
-            *p1 = operator(*p1, (p2[0] << shhi) | (p2[1] >> shlo));
+    for (size_t k = 0; k < len; k ++) {
+        size_t i = aux_index_at(p, NULL, k, base);
+        struct bs_index_pos *e = &order[count[i >> shift] ++];
+        e->index = i;
+        e->pos = k;
+    }
+
+    return order;
+}
+
+/*
+ * 添字の位置のビットを op に従って書き換える。全ての位置はビット長に収まっていること。
+ * 1 ビットの数の増減を返す。
+ */
+static ssize_t
+bitset_scatter(struct bitset *bs, const mrb_value *p, size_t len, mrb_int base, const struct bs_index_pos *order, enum bitset_bit_op op)
+{
+    uintptr_t *dest = bitset_ptr(bs);
+    ssize_t delta = 0;
+
+    for (size_t k = 0; k < len; k ++) {
+        if (k + BS_PREFETCH_DISTANCE < len) {
+            BS_PREFETCH(dest + aux_index_at(p, order, k + BS_PREFETCH_DISTANCE, base) / BS_WORDBITS, 1);
         }
 
-        if (size1 != size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) != size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+        size_t i = aux_index_at(p, order, k, base);
+        uintptr_t *w = dest + i / BS_WORDBITS;
+        uintptr_t m = BS_INDEX_MASK(i);
+        uintptr_t old = *w;
 
-        if (size1 > 0) {
-            *p1 = operator(*p1, p2[0] << shhi);
+        switch (op) {
+        case BS_BIT_SET:    *w = old | m; break;
+        case BS_BIT_RESET:  *w = old & ~m; break;
+        default:            *w = old ^ m; break;
         }
+
+        delta += (ssize_t)((*w & m) != 0) - (ssize_t)((old & m) != 0);
     }
-}
 
-static inline uintptr_t operator_or(uintptr_t a, uintptr_t b) { return a | b; }
+    return delta;
+}
 
-static mrb_value
-bs_msb_or(mrb_state *mrb, mrb_value self)
+/*
+ * 添字の位置のビットを読み出し、k 番目の結果を out の k ビット目に立てる。
+ * out は 0 で初期化しておくこと。ビット長を超える位置は 0 として扱う。
+ */
+static void
+bitset_gather(const struct bitset *bs, const mrb_value *p, size_t len, mrb_int base, const struct bs_index_pos *order, uintptr_t *out)
 {
-    bitset_msb_operate(mrb, self, operator_or);
-    return self;
+    const uintptr_t *src = bitset_ptr_const(bs);
+    size_t size = bitset_size(bs);
+
+    for (size_t k = 0; k < len; k ++) {
+        if (k + BS_PREFETCH_DISTANCE < len) {
+            size_t j = aux_index_at(p, order, k + BS_PREFETCH_DISTANCE, base);
+            if (j < size) { BS_PREFETCH(src + j / BS_WORDBITS, 0); }
+        }
+
+        size_t i = aux_index_at(p, order, k, base);
+        if (i < size && (src[i / BS_WORDBITS] & BS_INDEX_MASK(i))) {
+            size_t pos = order ? order[k].pos : k;
+            out[pos / BS_WORDBITS] |= BS_INDEX_MASK(pos);
+        }
+    }
 }
 
-static mrb_value
-bs_lsb_or(mrb_state *mrb, mrb_value self)
+static bool
+aux_opt_p(mrb_state *mrb, mrb_value opts, mrb_sym key)
 {
-    bitset_lsb_operate(mrb, self, operator_or);
-    return self;
-}
+    if (mrb_nil_p(opts)) { return false; }
 
-static inline uintptr_t operator_nor(uintptr_t a, uintptr_t b) { return ~(a | b); }
+    return mrb_test(mrb_hash_get(mrb, opts, mrb_symbol_value(key)));
+}
 
-static mrb_value
-bs_msb_nor(mrb_state *mrb, mrb_value self)
+/*
+ * set_indices! / set_many! / toggle_many! の本体。
+ * ビット長を超える位置が含まれる場合は、その位置までビット長を伸ばす。
+ */
+static void
+bitset_update_many(mrb_state *mrb, mrb_value self, mrb_value ary, mrb_value opts, enum bitset_bit_op op)
 {
-    bitset_msb_operate(mrb, self, operator_nor);
-    return self;
+    bool sort = aux_opt_p(mrb, opts, mrb_intern_lit(mrb, "sort"));
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+    const mrb_value *p = RARRAY_PTR(ary);
+    size_t len = RARRAY_LEN(ary);
+    mrb_int base = bitset_size(bs);
+    size_t limit = aux_indices_limit(mrb, p, len, base);
+
+    if (bs->is_fixed && limit > (size_t)base) {
+        mrb_raisef(mrb, E_INDEX_ERROR,
+                   "out of range for Bitset::Fixed (index %S, but bit length is %S)",
+                   mrb_fixnum_value(limit - 1), mrb_fixnum_value(base));
+    }
+
+    bitset_grow(mrb, bs, limit);
+
+    const struct bs_index_pos *order = sort ? aux_indices_order(mrb, p, len, base, bitset_size(bs)) : NULL;
+    ssize_t delta = bitset_scatter(bs, p, len, base, order, op);
+
+    if (bs->is_tracked) {
+        bs->popcount += delta;
+    }
+
+    if (bs->summary) {
+        if (limit > (size_t)base) {
+            bitset_summary_rebuild(mrb, bs);
+        } else {
+            for (size_t i = 0; i < len; i ++) {
+                bitset_summary_update(bs, aux_index_at(p, NULL, i, base), 1);
+            }
+        }
+    }
 }
 
+/*
+ * call-seq:
+ *  Bitset.from_indices(indices, size = nil, sort: false) -> new bitset
+ *
+ * indices の各要素の位置に 1 を立てたビットセットを返す。
+ * size を省略した場合は indices.max + 1 となる。
+ * size を与えた場合、負の添字は size から数えた位置となる。
+ *
+ * sort: true を与えると、1 を立てる前にビット位置を振り分ける。
+ * 巨大なビットセットにばらばらな添字を与える場合に速くなる。
+ */
 static mrb_value
-bs_lsb_nor(mrb_state *mrb, mrb_value self)
+bs_s_from_indices(mrb_state *mrb, mrb_value klass)
 {
-    bitset_lsb_operate(mrb, self, operator_nor);
-    return self;
-}
+    mrb_value ary, sizeobj = mrb_nil_value(), opts = mrb_nil_value();
+    mrb_get_args(mrb, "A|oH", &ary, &sizeobj, &opts);
 
-static inline uintptr_t operator_and(uintptr_t a, uintptr_t b) { return a & b; }
+    if (mrb_hash_p(sizeobj) && mrb_nil_p(opts)) {
+        opts = sizeobj;
+        sizeobj = mrb_nil_value();
+    }
 
-static mrb_value
-bs_msb_and(mrb_state *mrb, mrb_value self)
-{
-    bitset_msb_operate(mrb, self, operator_and);
-    return self;
+    mrb_int base = 0;
+    if (!mrb_nil_p(sizeobj)) {
+        base = mrb_int(mrb, sizeobj);
+        if (base < 0) { mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong negative bit size"); }
+    }
+
+    bool sort = aux_opt_p(mrb, opts, mrb_intern_lit(mrb, "sort"));
+    const mrb_value *p = RARRAY_PTR(ary);
+    size_t len = RARRAY_LEN(ary);
+    size_t limit = aux_indices_limit(mrb, p, len, base);
+    size_t size = mrb_nil_p(sizeobj) ? limit : (size_t)base;
+
+    if (limit > size) {
+        mrb_raisef(mrb, E_INDEX_ERROR,
+                   "wrong index (expect less than %S, but given %S)",
+                   mrb_fixnum_value(size), mrb_fixnum_value(limit - 1));
+    }
+
+    struct bitset *bs;
+    mrb_value obj = bitset_new(mrb, mrb_class_ptr(klass), &bs);
+    bs->is_fixed = bitset_fixed_class_p(mrb, mrb_class_ptr(klass));
+    bitset_grow(mrb, bs, size);
+    bitset_scatter(bs, p, len, base, sort ? aux_indices_order(mrb, p, len, base, size) : NULL, BS_BIT_SET);
+
+    return obj;
 }
 
+/*
+ * call-seq:
+ *  set_indices!(indices, sort: false) -> self
+ *
+ * indices の各要素の位置に 1 を立てる。負の添字は末尾から数える。
+ * ビット長を超える位置が含まれる場合は、その位置までビット長を伸ばす。
+ */
 static mrb_value
-bs_lsb_and(mrb_state *mrb, mrb_value self)
+bs_set_indices_bang(mrb_state *mrb, mrb_value self)
 {
-    bitset_lsb_operate(mrb, self, operator_and);
+    mrb_value ary, opts = mrb_nil_value();
+    mrb_get_args(mrb, "A|H", &ary, &opts);
+    BS_STATS_CALL(mrb, self);
+
+    bitset_update_many(mrb, self, ary, opts, BS_BIT_SET);
+
     return self;
 }
 
-static inline uintptr_t operator_nand(uintptr_t a, uintptr_t b) { return ~(a & b); }
-
+/*
+ * call-seq:
+ *  set_many!(indices, bit = true, sort: false) -> self
+ *  toggle_many!(indices, sort: false) -> self
+ *
+ * indices の各要素の位置のビットを bit にする / 反転する。負の添字は末尾から数える。
+ * ビット長を超える位置が含まれる場合は、その位置までビット長を伸ばす。
+ */
 static mrb_value
-bs_msb_nand(mrb_state *mrb, mrb_value self)
+bs_set_many_bang(mrb_state *mrb, mrb_value self)
 {
-    bitset_msb_operate(mrb, self, operator_nand);
+    mrb_value ary, bit = mrb_true_value(), opts = mrb_nil_value();
+    mrb_get_args(mrb, "A|oH", &ary, &bit, &opts);
+    BS_STATS_CALL(mrb, self);
+
+    if (mrb_hash_p(bit) && mrb_nil_p(opts)) {
+        opts = bit;
+        bit = mrb_true_value();
+    }
+
+    bool on = mrb_fixnum_p(bit) ? mrb_fixnum(bit) != 0 : mrb_test(bit);
+    bitset_update_many(mrb, self, ary, opts, on ? BS_BIT_SET : BS_BIT_RESET);
+
     return self;
 }
 
 static mrb_value
-bs_lsb_nand(mrb_state *mrb, mrb_value self)
+bs_toggle_many_bang(mrb_state *mrb, mrb_value self)
 {
-    bitset_lsb_operate(mrb, self, operator_nand);
+    mrb_value ary, opts = mrb_nil_value();
+    mrb_get_args(mrb, "A|H", &ary, &opts);
+    BS_STATS_CALL(mrb, self);
+
+    bitset_update_many(mrb, self, ary, opts, BS_BIT_TOGGLE);
+
     return self;
 }
 
-static inline uintptr_t operator_xor(uintptr_t a, uintptr_t b) { return a ^ b; }
-
+/*
+ * call-seq:
+ *  values_at(indices, packed: false, sort: false) -> array or new bitset
+ *
+ * indices の各要素の位置のビットを 0 か 1 の配列として返す。
+ * packed: true を与えると、k 番目の結果を k ビット目とした Bitset を返す。
+ * ビット長を超える位置は 0 となる。
+ */
 static mrb_value
-bs_msb_xor(mrb_state *mrb, mrb_value self)
+bs_values_at(mrb_state *mrb, mrb_value self)
 {
-    bitset_msb_operate(mrb, self, operator_xor);
-    return self;
+    mrb_value ary, opts = mrb_nil_value();
+    mrb_get_args(mrb, "A|H", &ary, &opts);
+    BS_STATS_CALL(mrb, self);
+
+    bool sort = aux_opt_p(mrb, opts, mrb_intern_lit(mrb, "sort"));
+    bool packed = aux_opt_p(mrb, opts, mrb_intern_lit(mrb, "packed"));
+    const struct bitset *bs = get_bitset(mrb, self);
+    const mrb_value *p = RARRAY_PTR(ary);
+    size_t len = RARRAY_LEN(ary);
+    mrb_int base = bitset_size(bs);
+    size_t limit = aux_indices_limit(mrb, p, len, base);
+
+    struct bitset *res;
+    mrb_value obj = bitset_new(mrb, NULL, &res);
+    bitset_grow(mrb, res, len);
+
+    const struct bs_index_pos *order = sort ? aux_indices_order(mrb, p, len, base, limit) : NULL;
+    bitset_gather(bs, p, len, base, order, bitset_ptr(res));
+
+    if (packed) { return obj; }
+
+    mrb_value values = mrb_ary_new_capa(mrb, len);
+    for (size_t k = 0; k < len; k ++) {
+        mrb_ary_push(mrb, values, mrb_fixnum_value(bitset_test(res, k)));
+    }
+
+    return values;
 }
 
+/*
+ * call-seq:
+ *  to_indices -> array
+ *
+ * 1 が立っているビット位置を昇順に並べた配列を返す。from_indices の逆変換。
+ */
 static mrb_value
-bs_lsb_xor(mrb_state *mrb, mrb_value self)
+bs_to_indices(mrb_state *mrb, mrb_value self)
 {
-    bitset_lsb_operate(mrb, self, operator_xor);
-    return self;
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+
+    const struct bitset *bs = get_bitset(mrb, self);
+    const uintptr_t *p = bitset_ptr_const(bs);
+    size_t size = bitset_size(bs);
+    mrb_value ary = mrb_ary_new_capa(mrb, bitset_popcount(bs));
+
+    if (bs->summary) {
+        for (size_t i = bitset_summary_next_word(bs->summary, 0); i != SIZE_MAX; i = bitset_summary_next_word(bs->summary, i + 1)) {
+            uintptr_t w = bitset_word_live(bs, i);
+            while (w) {
+                int z = count_nlz(w);
+                mrb_ary_push(mrb, ary, mrb_fixnum_value(i * BS_WORDBITS + z));
+                w &= ~BS_INDEX_MASK(z);
+            }
+        }
+
+        return ary;
+    }
+
+    for (size_t off = 0; off < size; off += BS_WORDBITS, p ++) {
+        uintptr_t w = *p;
+        if (size - off < BS_WORDBITS) {
+            w &= ~getmask(BS_WORDBITS - (size - off));
+        }
+
+        while (w) {
+            int z = count_nlz(w);
+            mrb_ary_push(mrb, ary, mrb_fixnum_value(off + z));
+            w &= ~BS_INDEX_MASK(z);
+        }
+    }
+
+    return ary;
 }
 
-static inline uintptr_t operator_xnor(uintptr_t a, uintptr_t b) { return ~(a ^ b); }
+/*
+ * 単一ビットの操作
+ *
+ * ワードとマスクを直接求めるため、ビット幅の確認やスライドを伴わない。
+ */
+
+/*
+ * index のビットを op に従って書き換え、書き換える前の値を返す。
+ * 範囲外であれば index までビット長を伸ばす (Bitset::Fixed であれば IndexError)。
+ */
+static int
+bitset_bit_update(mrb_state *mrb, mrb_value self, mrb_int index, enum bitset_bit_op op)
+{
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+    size_t i = bitset_correct_index(mrb, self, bs, index);
+
+    if (i >= bitset_size(bs)) {
+        if (bs->is_fixed) {
+            mrb_raisef(mrb, E_INDEX_ERROR,
+                       "out of range for Bitset::Fixed (index %S, but bit length is %S)",
+                       mrb_fixnum_value(index), mrb_fixnum_value(bitset_size(bs)));
+        }
+
+        bitset_grow(mrb, bs, i + 1);
+        bitset_summary_rebuild(mrb, bs);
+    }
+
+    uintptr_t *w = bitset_ptr(bs) + i / BS_WORDBITS;
+    uintptr_t m = BS_INDEX_MASK(i);
+    int old = (*w & m) != 0;
+    int bit;
+
+    switch (op) {
+    case BS_BIT_SET:    bit = 1; *w |= m; break;
+    case BS_BIT_RESET:  bit = 0; *w &= ~m; break;
+    default:            bit = !old; *w ^= m; break;
+    }
+
+    if (bs->is_tracked) {
+        bs->popcount += (ssize_t)bit - (ssize_t)old;
+    }
+
+    if (bs->summary && bit != old) {
+        bitset_summary_set(bs->summary, i / BS_WORDBITS, bitset_word_live(bs, i / BS_WORDBITS) != 0);
+    }
+
+    return old;
+}
+
+/*
+ * call-seq:
+ *  test?(index) -> true or false
+ *
+ * index のビットが 1 であれば真。ビット長を超える位置は 0 として扱う。
+ */
+static mrb_value
+bs_test_p(mrb_state *mrb, mrb_value self)
+{
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+
+    const struct bitset *bs = get_bitset(mrb, self);
+    size_t i = bitset_correct_index(mrb, self, bs, index);
+
+    return mrb_bool_value(i < bitset_size(bs) && bitset_test(bs, i));
+}
 
+/*
+ * call-seq:
+ *  set!(index) -> self
+ *  reset!(index) -> self
+ *  toggle!(index) -> self
+ *
+ * index のビットを 1 にする / 0 にする / 反転する。
+ */
 static mrb_value
-bs_msb_xnor(mrb_state *mrb, mrb_value self)
+bs_set_bang(mrb_state *mrb, mrb_value self)
 {
-    bitset_msb_operate(mrb, self, operator_xnor);
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+    bitset_bit_update(mrb, self, index, BS_BIT_SET);
     return self;
 }
 
 static mrb_value
-bs_lsb_xnor(mrb_state *mrb, mrb_value self)
+bs_reset_bang(mrb_state *mrb, mrb_value self)
 {
-    bitset_lsb_operate(mrb, self, operator_xnor);
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+    bitset_bit_update(mrb, self, index, BS_BIT_RESET);
     return self;
 }
 
-static uintptr_t
-bitreflect(uintptr_t n)
+static mrb_value
+bs_toggle_bang(mrb_state *mrb, mrb_value self)
 {
-#if UINTPTR_MAX > UINT32_MAX
-    // バイトオーダスワップ (__buildin_bswapll) から始める
-    // 逆から行うと、最適化で bswap に置き換えられなくなる
-    n = ( n                          >> 32) | ( n << 32                         );
-    n = ((n & 0x0000ffff0000ffffULL) << 16) | ((n >> 16) & 0x0000ffff0000ffffULL);
-    n = ((n & 0x00ff00ff00ff00ffULL) <<  8) | ((n >>  8) & 0x00ff00ff00ff00ffULL);
-    n = ((n & 0x0f0f0f0f0f0f0f0fULL) <<  4) | ((n >>  4) & 0x0f0f0f0f0f0f0f0fULL);
-    n = ((n & 0x3333333333333333ULL) <<  2) | ((n >>  2) & 0x3333333333333333ULL);
-    n = ((n & 0x5555555555555555ULL) <<  1) | ((n >>  1) & 0x5555555555555555ULL);
-#else
-    n = ( n                 << 16) | ( n >> 16                );
-    n = ((n & 0x00ff00ffUL) <<  8) | ((n >>  8) & 0x00ff00ffUL);
-    n = ((n & 0x0f0f0f0fUL) <<  4) | ((n >>  4) & 0x0f0f0f0fUL);
-    n = ((n & 0x33333333UL) <<  2) | ((n >>  2) & 0x33333333UL);
-    n = ((n & 0x55555555UL) <<  1) | ((n >>  1) & 0x55555555UL);
-#endif
-    return n;
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+    bitset_bit_update(mrb, self, index, BS_BIT_TOGGLE);
+    return self;
 }
 
-static void
-bitset_bitreflect(mrb_state *mrb, struct bitset *dest, const struct bitset *src)
+/*
+ * call-seq:
+ *  test_and_set!(index) -> true or false
+ *  test_and_reset!(index) -> true or false
+ *
+ * index のビットを 1 / 0 にして、書き換える前の値を返す。
+ */
+static mrb_value
+bs_test_and_set_bang(mrb_state *mrb, mrb_value self)
 {
-    uintptr_t *p;
-    size_t size;
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(bitset_bit_update(mrb, self, index, BS_BIT_SET));
+}
 
-    if (!src || src == dest) {
-        size = bitset_size(dest);
-        uintptr_t *head = bitset_ptr(dest);
-        uintptr_t *tail = head + unit_ceil(size, BS_WORDBITS);
-        uintptr_t *q;
+static mrb_value
+bs_test_and_reset_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(bitset_bit_update(mrb, self, index, BS_BIT_RESET));
+}
 
-        // 最初は単純なワード単位でのスワップとビットの逆順
-        for (p = head, q = tail - 1; p < q; p ++, q --) {
-            uintptr_t t = bitreflect(*q);
-            *q = bitreflect(*p);
-            *p = t;
-        }
+/*
+ * Bitset::Fixed
+ *
+ * 構築時にビット長を決め、以降は変更しない Bitset。
+ * 読み出しは Bitset と同じ処理を用いる。書き込みはワードとマスクを求めて置き換えるだけとなる。
+ * ビット長が変わる操作 (push / shift / clear など) は TypeError を、範囲外の書き込みは IndexError を起こす。
+ */
 
-        if (p == q) {
-            *p = bitreflect(*p);
-        }
+/*
+ * call-seq:
+ *  Bitset::Fixed.new(size, bits = nil) -> new fixed bitset
+ *
+ * [bits] nil or false (all 0), true (all 1), integer, string, array
+ */
+static mrb_value
+bs_fixed_init(mrb_state *mrb, mrb_value self)
+{
+    mrb_int size;
+    mrb_value bits = mrb_nil_value();
+    mrb_get_args(mrb, "i|o", &size, &bits);
+    BS_STATS_CALL(mrb, self);
 
-        p = head;
-    } else {
-        const uintptr_t *q;
-        bitset_getmem_const(src, &q, &size);
+    if (size < 0) { mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong negative bit size"); }
 
-        bitset_reserve(mrb, dest, size);
-        bitset_set_size(dest, size);
+    bitset_check_uninitialized(mrb, self);
 
-        p = bitset_ptr(dest) + unit_ceil(size, BS_WORDBITS);
-        for (size_t i = unit_ceil(size, BS_WORDBITS); i > 0; i --, p --, q ++) {
-            p[-1] = bitreflect(*q);
-        }
+    struct bitset *bs = mrb_calloc(mrb, 1, sizeof(struct bitset));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset));
+    mrb_data_init(self, bs, &bitset_type);
+    bs->is_embed = 1;
 
-        mrb_assert(p == bitset_ptr(dest));
+    if (!mrb_nil_p(bits) && mrb_type(bits) != MRB_TT_FALSE && mrb_type(bits) != MRB_TT_TRUE) {
+        bitset_load_from_object(mrb, bs, bits, size);
     }
 
-    size_t rest = size % BS_WORDBITS;
-    if (rest > 0) {
-        // ビットシフト
-        int shhi = BS_WORDBITS - rest;
-        int shlo = rest;
-        for (size_t i = size / BS_WORDBITS; i > 0; i --, p ++) {
-            p[0] = (p[0] << shhi) | (p[1] >> shlo);
+    /* 足りない部分は 0 で埋める。バッファの確保はここでの 1 回だけ */
+    bitset_grow(mrb, bs, size);
+
+    if (mrb_type(bits) == MRB_TT_TRUE && size > 0) {
+        uintptr_t *p = bitset_ptr(bs);
+        memset(p, 0xff, unit_ceil(size, BS_WORDBITS) * sizeof(uintptr_t));
+        if (size % BS_WORDBITS > 0) {
+            int pad = BS_WORDBITS - size % BS_WORDBITS;
+            p[size / BS_WORDBITS] = (uintptr_t)-1 << pad;
         }
-        *p <<= shhi;
     }
-}
 
-static mrb_value
-bs_bitreflect(mrb_state *mrb, mrb_value self)
-{
-    mrb_get_args(mrb, "");
-    struct bitset *dest;
-    mrb_value obj = bitset_new(mrb, mrb_obj_class(mrb, self), &dest);
-    bitset_bitreflect(mrb, dest, get_bitset(mrb, self));
-    return obj;
-}
+    bs->is_fixed = 1;
 
-static mrb_value
-bs_bitreflect_bang(mrb_state *mrb, mrb_value self)
-{
-    mrb_get_args(mrb, "");
-    bitset_bitreflect(mrb, get_bitset(mrb, self), NULL);
     return self;
 }
 
-static void
-bitset_minus(mrb_state *mrb, struct bitset *dest, const struct bitset *src)
+/*
+ * call-seq:
+ *  aset(index, bit) -> self
+ *  aset(index, width, bits) -> self
+ *  aset(index, width, bitwidth, bits) -> self (width == bitwidth のみ)
+ *
+ * 1 ビットの書き込みは、範囲の確認とワードの置き換えだけを行う。
+ */
+static mrb_value
+bs_fixed_aset(mrb_state *mrb, mrb_value self)
 {
-    size_t size = bitset_size(src);
-    bitset_reserve(mrb, dest, size);
-    bitset_set_size(dest, size);
-    if (size < 1) { return; }
-
-    size_t words = unit_ceil(size, BS_WORDBITS);
-    uintptr_t *p = bitset_ptr(dest);
-    const uintptr_t *q = bitset_ptr_const(src);
-
-    p += words - 1;
-    q += words - 1;
+    mrb_int index;
+    mrb_value args[3];
 
-    int overflow = 0;
-    int pad = BS_WORDBITS - size % BS_WORDBITS;
-    if (pad < BS_WORDBITS) {
-        uintptr_t n = -(*q >> pad) << pad;
-        if (n == 0) {
-            overflow = 1;
-        }
-        *p = n;
-        p --; q --; words --;
+    if (mrb_get_args(mrb, "io|oo", &index, &args[0], &args[1], &args[2]) != 2) {
+        return bs_aset(mrb, self);
     }
 
-    for (; words > 0; words --, p --, q --) {
-        uintptr_t n = ~*q;
-        if (n == 0) {
-            n = overflow;
-            overflow = 1;
-        } else {
-            n += overflow;
-            if (n == 0) {
-                overflow = 1;
-            } else {
-                overflow = 0;
-            }
-        }
+    BS_STATS_CALL(mrb, self);
 
-        *p = n;
-    }
+    uintptr_t bit = aux_make_bits(mrb, args[0]) & 1;
+    bitset_bit_update(mrb, self, index, bit ? BS_BIT_SET : BS_BIT_RESET);
+
+    return self;
 }
 
 static mrb_value
-bs_minus(mrb_state *mrb, mrb_value self)
+bs_flip(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
-
+    BS_STATS_CALL(mrb, self);
     const struct bitset *src = get_bitset(mrb, self);
     struct bitset *dest;
-    mrb_value obj = bitset_new(mrb, mrb_obj_class(mrb, self), &dest);
+    mrb_value dup = bitset_new_like(mrb, self, &dest);
+    bitset_copy(mrb, dest, src);
 
-    bitset_minus(mrb, dest, src);
+    flip_bitset(mrb, dest);
 
-    return obj;
+    return dup;
 }
 
 static mrb_value
-bs_minus_bang(mrb_state *mrb, mrb_value self)
+bs_flip_bang(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
 
-    struct bitset *bs = get_bitset(mrb, self);
-
-    mrbx_obj_modify(mrb, self);
-    bitset_minus(mrb, bs, bs);
+    flip_bitset(mrb, bs);
 
     return self;
 }
 
-static int
-popcount(uintptr_t n)
+typedef uintptr_t operator_f(uintptr_t a, uintptr_t b);
+
+static inline operator_f operator_or;
+static inline operator_f operator_nor;
+static inline operator_f operator_and;
+static inline operator_f operator_nand;
+static inline operator_f operator_xor;
+static inline operator_f operator_xnor;
+static inline operator_f operator_andnot;
+
+/*
+ * 要約を持つビット列への msb_and。自身の 0 ではないワードだけを辿り、
+ * other 側のワードが 0 であれば (other も要約を持つ場合はそれで判断して) 読まずに 0 とする。
+ */
+static void
+bitset_msb_and_summarized(struct bitset *bs, const struct bitset *other)
 {
-#if 0 && (defined(__GNUC__) || defined(__clang__))
-    if (!n) { return 0; }
+    struct bitset_summary *sm = bs->summary;
+    uintptr_t *p = bitset_ptr(bs);
+    size_t words2 = unit_ceil(bitset_size(other), BS_WORDBITS);
 
-# if UINTPTR_MAX > UINT32_MAX
-    return __builtin_popcountll(n);
-# else
-    return __builtin_popcount(n);
-# endif
-#elif 1
-    /* utils/mkpopcnt.rb で出力 */
-    static const char table[] = {
-        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    for (size_t i = bitset_summary_next_word(sm, 0); i != SIZE_MAX; i = bitset_summary_next_word(sm, i + 1)) {
+        uintptr_t old = bitset_word_live(bs, i);
+        uintptr_t n = 0;
+
+        if (i < words2 && (!other->summary || bitset_summary_test(other->summary, i))) {
+            n = old & bitset_word_live(other, i);
+        }
+
+        p[i] = n;
+
+        if (bs->is_tracked) {
+            bs->popcount -= popcount(old) - popcount(n);
+        }
+
+        if (!n) { bitset_summary_set(sm, i, false); }
+    }
+}
+
+static void
+bitset_msb_operate(mrb_state *mrb, mrb_value self, operator_f *operator)
+{
+    const struct bitset *other;
+    mrb_get_args(mrb, "d", &other, &bitset_type);
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+
+    size_t size1 = bitset_size(bs);
+    size_t size2 = bitset_size(other);
+
+    if (operator == operator_and && bs->summary && size1 >= size2) {
+        bitset_msb_and_summarized(bs, other);
+        return;
+    }
+
+    if (size1 < size2) {
+        bitset_check_fixed(mrb, bs, size2);
+        bitset_reserve(mrb, bs, size2);
+        bitset_set_size(bs, size2);
+    }
+
+    uintptr_t *p1 = bitset_ptr(bs);
+    const uintptr_t *p2 = bitset_ptr_const(other);
+
+    for (size_t i = size2 / BS_WORDBITS; i > 0; i --, p1 ++, p2 ++) {
+        *p1 = operator(*p1, *p2);
+    }
+
+    size1 -= (size2 / BS_WORDBITS) * BS_WORDBITS;
+    size2 -= (size2 / BS_WORDBITS) * BS_WORDBITS;
+
+    if (size1 < BS_WORDBITS) {
+        int pad1 = BS_WORDBITS - size1;
+        int pad2 = BS_WORDBITS - size2;
+        *p1 = operator(size1 > 0 ? (*p1 >> pad1 << pad1) : 0,
+                       size2 > 0 ? (*p2 >> pad2 << pad2) : 0);
+    } else {
+        if (size2 > 0) {
+            int pad2 = BS_WORDBITS - size2;
+            uintptr_t n2 = *p2 >> pad2 << pad2;
+            *p1 = operator(*p1, n2);
+            p1 ++;
+            size1 -= BS_WORDBITS;
+        }
+
+        for (size_t i = size1 / BS_WORDBITS; i > 0; i --, p1 ++) {
+            *p1 = operator(*p1, 0);
+        }
+        size1 %= BS_WORDBITS;
+
+        if (size1 > 0) {
+            int pad1 = BS_WORDBITS - size1;
+            *p1 = operator(*p1 >> pad1 << pad1, 0);
+        }
+    }
+
+    if (bs->is_tracked) {
+        bs->popcount = bitset_popcount_scan(bs);
+    }
+
+    bitset_summary_rebuild(mrb, bs);
+}
+
+static void
+bitset_lsb_operate(mrb_state *mrb, mrb_value self, operator_f *operator)
+{
+    const struct bitset *other;
+    mrb_get_args(mrb, "d", &other, &bitset_type);
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+
+    size_t size1 = bitset_size(bs);
+    size_t size2 = bitset_size(other);
+
+    if (size1 < size2) {
+        bitset_check_fixed(mrb, bs, size2);
+        bitset_slide(mrb, bs, 0, size2 - size1);
+        size1 = size2;
+    }
+
+    uintptr_t *p1 = bitset_ptr(bs);
+    const uintptr_t *p2 = bitset_ptr_const(other);
+
+    ssize_t pad = size1 - size2;
+
+    for (ssize_t i = pad / BS_WORDBITS; i > 0; i --, p1 ++, size1 -= BS_WORDBITS, pad -= BS_WORDBITS) {
+        *p1 = operator(*p1, 0);
+    }
+
+    if (pad == 0) {
+        if (size1 != size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) != size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+
+        for (int i = unit_ceil(size1, BS_WORDBITS); i > 0; i --, p1 ++, p2 ++) {
+            *p1 = operator(*p1, *p2);
+        }
+    } else {
+        if (size1 <= size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) <= size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+
+        /* NOTE: pad は [1, 32) の値域を取る */
+        int shhi = BS_WORDBITS - pad;
+        int shlo = pad;
+
+        //最初はp2の上位ビットを切り出して下位ビットとする;
+        *p1 = operator(*p1, *p2 >> shlo);
+        p1 ++;
+        size1 -= BS_WORDBITS;
+        size2 -= shhi;
+
+        if (size1 != size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) != size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+
+        for (int i = size1 / BS_WORDBITS; i > 0; i --, p1 ++, p2 ++, size1 -= BS_WORDBITS, size2 -= BS_WORDBITS) {
+            *p1 = operator(*p1, (p2[0] << shhi) | (p2[1] >> shlo));
+        }
+
+        if (size1 != size2) { mrb_raisef(mrb, E_RUNTIME_ERROR, "[BUG] size1(%S) != size2(%S) [BUG]", mrb_fixnum_value(size1), mrb_fixnum_value(size2)); }
+
+        if (size1 > 0) {
+            *p1 = operator(*p1, p2[0] << shhi);
+        }
+    }
+
+    if (bs->is_tracked) {
+        bs->popcount = bitset_popcount_scan(bs);
+    }
+
+    bitset_summary_rebuild(mrb, bs);
+}
+
+/* ビット長 size のワード列 p の j 番目のワード。範囲外は 0 とする */
+static inline uintptr_t
+aux_word_at(const uintptr_t *p, size_t size, size_t j)
+{
+    if (j * BS_WORDBITS >= size) { return 0; }
+    if ((j + 1) * BS_WORDBITS <= size) { return p[j]; }
+    return p[j] & ~getmask(BS_WORDBITS - (size - j * BS_WORDBITS));
+}
+
+/*
+ * dest = a operator b。MSB を合わせ、ビット長は長い方に合わせる。
+ * ワードを前から順に読み書きするため、dest は a や b と同じでもよい。
+ */
+MRBX_FORCE_INLINE void
+bitset_operate_into_n(mrb_state *mrb, struct bitset *dest, const struct bitset *a, const struct bitset *b, operator_f *operator)
+{
+    size_t size1 = bitset_size(a);
+    size_t size2 = bitset_size(b);
+    size_t size = size1 > size2 ? size1 : size2;
+
+    bitset_check_fixed(mrb, dest, size);
+    bitset_reserve(mrb, dest, size);
+
+    /* dest が a や b と同じであれば、確保し直した後のポインタを使う必要がある */
+    const uintptr_t *p1 = bitset_ptr_const(a);
+    const uintptr_t *p2 = bitset_ptr_const(b);
+    uintptr_t *p = bitset_ptr(dest);
+    size_t full = (size1 < size2 ? size1 : size2) / BS_WORDBITS;
+    size_t words = unit_ceil(size, BS_WORDBITS);
+    size_t j = 0;
+
+    for (; j < full; j ++) {
+        p[j] = operator(p1[j], p2[j]);
+    }
+
+    for (; j < words; j ++) {
+        p[j] = operator(aux_word_at(p1, size1, j), aux_word_at(p2, size2, j));
+    }
+
+    if (size % BS_WORDBITS > 0) {
+        p[words - 1] &= ~getmask(BS_WORDBITS - size % BS_WORDBITS);
+    }
+
+    bitset_set_size(dest, size);
+
+    if (dest->is_tracked) {
+        dest->popcount = bitset_popcount_scan(dest);
+    }
+
+    bitset_summary_rebuild(mrb, dest);
+}
+
+static void
+bitset_operate_into(mrb_state *mrb, struct bitset *dest, const struct bitset *a, const struct bitset *b, operator_f *operator)
+{
+    if (operator == operator_or) {
+        bitset_operate_into_n(mrb, dest, a, b, operator_or);
+    } else if (operator == operator_nor) {
+        bitset_operate_into_n(mrb, dest, a, b, operator_nor);
+    } else if (operator == operator_and) {
+        bitset_operate_into_n(mrb, dest, a, b, operator_and);
+    } else if (operator == operator_nand) {
+        bitset_operate_into_n(mrb, dest, a, b, operator_nand);
+    } else if (operator == operator_xor) {
+        bitset_operate_into_n(mrb, dest, a, b, operator_xor);
+    } else if (operator == operator_xnor) {
+        bitset_operate_into_n(mrb, dest, a, b, operator_xnor);
+    } else {
+        bitset_operate_into_n(mrb, dest, a, b, operator_andnot);
+    }
+}
+
+static inline uintptr_t operator_or(uintptr_t a, uintptr_t b) { return a | b; }
+
+static mrb_value
+bs_msb_or(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_msb_operate(mrb, self, operator_or);
+    return self;
+}
+
+static mrb_value
+bs_lsb_or(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_lsb_operate(mrb, self, operator_or);
+    return self;
+}
+
+static inline uintptr_t operator_nor(uintptr_t a, uintptr_t b) { return ~(a | b); }
+
+static mrb_value
+bs_msb_nor(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_msb_operate(mrb, self, operator_nor);
+    return self;
+}
+
+static mrb_value
+bs_lsb_nor(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_lsb_operate(mrb, self, operator_nor);
+    return self;
+}
+
+static inline uintptr_t operator_and(uintptr_t a, uintptr_t b) { return a & b; }
+
+static mrb_value
+bs_msb_and(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_msb_operate(mrb, self, operator_and);
+    return self;
+}
+
+static mrb_value
+bs_lsb_and(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_lsb_operate(mrb, self, operator_and);
+    return self;
+}
+
+static inline uintptr_t operator_nand(uintptr_t a, uintptr_t b) { return ~(a & b); }
+
+static mrb_value
+bs_msb_nand(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_msb_operate(mrb, self, operator_nand);
+    return self;
+}
+
+static mrb_value
+bs_lsb_nand(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_lsb_operate(mrb, self, operator_nand);
+    return self;
+}
+
+static inline uintptr_t operator_xor(uintptr_t a, uintptr_t b) { return a ^ b; }
+
+static mrb_value
+bs_msb_xor(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_msb_operate(mrb, self, operator_xor);
+    return self;
+}
+
+static mrb_value
+bs_lsb_xor(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_lsb_operate(mrb, self, operator_xor);
+    return self;
+}
+
+static inline uintptr_t operator_xnor(uintptr_t a, uintptr_t b) { return ~(a ^ b); }
+static inline uintptr_t operator_andnot(uintptr_t a, uintptr_t b) { return a & ~b; }
+
+static mrb_value
+bs_msb_xnor(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_msb_operate(mrb, self, operator_xnor);
+    return self;
+}
+
+static mrb_value
+bs_lsb_xnor(mrb_state *mrb, mrb_value self)
+{
+    BS_STATS_CALL(mrb, self);
+    bitset_lsb_operate(mrb, self, operator_xnor);
+    return self;
+}
+
+/*
+ * 遅延評価の式 (Bitset::Expr)
+ *
+ * mrblib で組み立てた式の木を後置記法の命令列に直し、ここで BS_EXPR_BLOCK ワードずつ評価する。
+ * 途中の結果はブロック分だけのスタックに置くため、中間のビット列を丸ごと作ることはなく、
+ * 各オペランドは一度だけ読まれ、結果は一度だけ書かれる (count であれば書かれない)。
+ *
+ * 命令は 0 以上であればオペランドの番号、負であれば演算子を表す。
+ * ビット長の異なるオペランドは msb_or などと同じく MSB を合わせ、短い方の後ろを 0 とみなす。
+ */
+
+enum bitset_expr_op
+{
+    BS_EXPR_NOT = -1,
+    BS_EXPR_AND = -2,
+    BS_EXPR_OR = -3,
+    BS_EXPR_XOR = -4,
+    BS_EXPR_ANDNOT = -5,
+};
+
+#define BS_EXPR_BLOCK 64
+
+struct bitset_expr
+{
+    mrb_int len;                    /* 命令数 */
+    const mrb_int *code;
+    const size_t *size;             /* 各命令の結果のビット長 */
+    const struct bitset **operands;
+    mrb_int depth;                  /* スタックの最大の深さ */
+};
+
+static void
+bitset_expr_load(uintptr_t *t, const struct bitset *bs, size_t j, size_t n)
+{
+    size_t size = bitset_size(bs);
+    size_t full = size / BS_WORDBITS;
+    size_t k = 0;
+
+    if (j < full) {
+        k = full - j < n ? full - j : n;
+        memcpy(t, bitset_ptr_const(bs) + j, k * sizeof(uintptr_t));
+    }
+
+    for (; k < n; k ++) {
+        t[k] = (j + k) * BS_WORDBITS < size ? bitset_word_live(bs, j + k) : 0;
+    }
+}
+
+/*
+ * ワード j から始まる n ワードのうち、ビット長 size を超える部分を 0 にする。
+ */
+static void
+bitset_expr_clip(uintptr_t *t, size_t j, size_t n, size_t size)
+{
+    size_t k = size / BS_WORDBITS;
+
+    if (k >= j + n) { return; }
+
+    k = k > j ? k - j : 0;
+    if ((j + k) * BS_WORDBITS < size) {
+        t[k] &= ~getmask(BS_WORDBITS - (size - (j + k) * BS_WORDBITS));
+        k ++;
+    }
+
+    for (; k < n; k ++) { t[k] = 0; }
+}
+
+/*
+ * words ワードを評価して dest に書き出し、1 の数を返す。
+ * dest が NULL であれば 1 の数だけを数え、dest が非 NULL であれば 1 の数は数えない (0 を返す)。
+ * stack は ex->depth * BS_EXPR_BLOCK ワードの作業領域。
+ */
+static size_t
+bitset_expr_run(const struct bitset_expr *ex, uintptr_t *dest, size_t words, uintptr_t *stack)
+{
+    size_t count = 0;
+
+    for (size_t j = 0; j < words; j += BS_EXPR_BLOCK) {
+        size_t n = words - j < BS_EXPR_BLOCK ? words - j : BS_EXPR_BLOCK;
+        uintptr_t *top = stack;
+
+        for (mrb_int i = 0; i < ex->len; i ++) {
+            mrb_int c = ex->code[i];
+
+            if (c >= 0) {
+                bitset_expr_load(top, ex->operands[c], j, n);
+                top += BS_EXPR_BLOCK;
+                continue;
+            }
+
+            if (c == BS_EXPR_NOT) {
+                uintptr_t *a = top - BS_EXPR_BLOCK;
+                for (size_t k = 0; k < n; k ++) { a[k] = ~a[k]; }
+                bitset_expr_clip(a, j, n, ex->size[i]);
+                continue;
+            }
+
+            top -= BS_EXPR_BLOCK;
+            uintptr_t *a = top - BS_EXPR_BLOCK;
+            const uintptr_t *b = top;
+
+            switch (c) {
+            case BS_EXPR_AND:
+                for (size_t k = 0; k < n; k ++) { a[k] &= b[k]; }
+                break;
+            case BS_EXPR_OR:
+                for (size_t k = 0; k < n; k ++) { a[k] |= b[k]; }
+                break;
+            case BS_EXPR_XOR:
+                for (size_t k = 0; k < n; k ++) { a[k] ^= b[k]; }
+                break;
+            default:
+                for (size_t k = 0; k < n; k ++) { a[k] &= ~b[k]; }
+                break;
+            }
+        }
+
+        if (dest) {
+            memcpy(dest + j, stack, n * sizeof(uintptr_t));
+        } else {
+            for (size_t k = 0; k < n; k ++) { count += popcount(stack[k]); }
+        }
+    }
+
+    return count;
+}
+
+/*
+ * 命令列を確かめながら、各命令の結果のビット長とスタックの深さを求める。
+ */
+static void
+bitset_expr_prepare(mrb_state *mrb, struct bitset_expr *ex, size_t *size, size_t *sizestack)
+{
+    mrb_int sp = 0;
+    ex->depth = 0;
+
+    for (mrb_int i = 0; i < ex->len; i ++) {
+        mrb_int c = ex->code[i];
+
+        if (c >= 0) {
+            sizestack[sp] = bitset_size(ex->operands[c]);
+            sp ++;
+            if (sp > ex->depth) { ex->depth = sp; }
+        } else if (c == BS_EXPR_NOT) {
+            if (sp < 1) { goto broken; }
+        } else if (c >= BS_EXPR_ANDNOT) {
+            if (sp < 2) { goto broken; }
+            sp --;
+            if (sizestack[sp] > sizestack[sp - 1]) { sizestack[sp - 1] = sizestack[sp]; }
+        } else {
+            goto broken;
+        }
+
+        size[i] = sizestack[sp - 1];
+    }
+
+    if (sp == 1) { return; }
+
+broken:
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "broken expression program");
+}
+
+/*
+ * call-seq:
+ *  Bitset::Expr.evaluate(program, operands, count_only) -> bitset or integer
+ *
+ * Bitset::Expr#to_bitset と Bitset::Expr#count から呼ばれる。
+ */
+static mrb_value
+bs_expr_s_evaluate(mrb_state *mrb, mrb_value klass)
+{
+    mrb_value program, operands;
+    mrb_bool count_only;
+    mrb_get_args(mrb, "AAb", &program, &operands, &count_only);
+    BS_STATS_CALL(mrb, klass);
+
+    struct bitset_expr ex;
+    mrb_int noperands = RARRAY_LEN(operands);
+    ex.len = RARRAY_LEN(program);
+
+    if (ex.len < 1) { mrb_raise(mrb, E_ARGUMENT_ERROR, "broken expression program"); }
+
+    /*
+     * mrb_int は size_t より小さいことがある (MRB_INT16 など) ため、同じ作業領域に code を
+     * 先に詰めると size と ops の境界がずれる。code は別に確保する。
+     */
+    mrb_value tmp = mrb_str_new(mrb, NULL, ex.len * sizeof(size_t) * 2 + noperands * sizeof(struct bitset *));
+    mrb_value codetmp = mrb_str_new(mrb, NULL, ex.len * sizeof(mrb_int));
+    size_t *size = (size_t *)RSTRING_PTR(tmp);
+    const struct bitset **ops = (const struct bitset **)(size + ex.len * 2);
+    mrb_int *code = (mrb_int *)RSTRING_PTR(codetmp);
+
+    for (mrb_int i = 0; i < noperands; i ++) {
+        ops[i] = get_bitset(mrb, RARRAY_PTR(operands)[i]);
+    }
+
+    for (mrb_int i = 0; i < ex.len; i ++) {
+        code[i] = mrb_int(mrb, RARRAY_PTR(program)[i]);
+        if (code[i] >= noperands) {
+            mrb_raisef(mrb, E_INDEX_ERROR, "operand out of range - %S", mrb_fixnum_value(code[i]));
+        }
+    }
+
+    ex.code = code;
+    ex.size = size;
+    ex.operands = ops;
+    bitset_expr_prepare(mrb, &ex, size, size + ex.len);
+
+    size_t bits = size[ex.len - 1];
+    size_t words = unit_ceil(bits, BS_WORDBITS);
+    mrb_value stack = mrb_str_new(mrb, NULL, ex.depth * BS_EXPR_BLOCK * sizeof(uintptr_t));
+
+    if (count_only) {
+        size_t count = bitset_expr_run(&ex, NULL, words, (uintptr_t *)RSTRING_PTR(stack));
+        return mrb_fixnum_value(count);
+    }
+
+    struct bitset *dest;
+    mrb_value obj = bitset_new(mrb, NULL, &dest);
+    bitset_grow(mrb, dest, bits);
+    bitset_expr_run(&ex, bitset_ptr(dest), words, (uintptr_t *)RSTRING_PTR(stack));
+
+    return obj;
+}
+
+#if defined(__has_builtin)
+# define BS_HAS_BUILTIN(X) __has_builtin(X)
+#else
+# define BS_HAS_BUILTIN(X) 0
+#endif
+
+static uintptr_t
+bitreflect(uintptr_t n)
+{
+#if UINTPTR_MAX > UINT32_MAX && BS_HAS_BUILTIN(__builtin_bitreverse64)
+    // clang は rbit 命令などに置き換える
+    return __builtin_bitreverse64(n);
+#elif UINTPTR_MAX <= UINT32_MAX && BS_HAS_BUILTIN(__builtin_bitreverse32)
+    return __builtin_bitreverse32(n);
+#elif UINTPTR_MAX > UINT32_MAX
+    // バイトオーダスワップ (__buildin_bswapll) から始める
+    // 逆から行うと、最適化で bswap に置き換えられなくなる
+    n = ( n                          >> 32) | ( n << 32                         );
+    n = ((n & 0x0000ffff0000ffffULL) << 16) | ((n >> 16) & 0x0000ffff0000ffffULL);
+    n = ((n & 0x00ff00ff00ff00ffULL) <<  8) | ((n >>  8) & 0x00ff00ff00ff00ffULL);
+    n = ((n & 0x0f0f0f0f0f0f0f0fULL) <<  4) | ((n >>  4) & 0x0f0f0f0f0f0f0f0fULL);
+    n = ((n & 0x3333333333333333ULL) <<  2) | ((n >>  2) & 0x3333333333333333ULL);
+    n = ((n & 0x5555555555555555ULL) <<  1) | ((n >>  1) & 0x5555555555555555ULL);
+    return n;
+#else
+    n = ( n                 << 16) | ( n >> 16                );
+    n = ((n & 0x00ff00ffUL) <<  8) | ((n >>  8) & 0x00ff00ffUL);
+    n = ((n & 0x0f0f0f0fUL) <<  4) | ((n >>  4) & 0x0f0f0f0fUL);
+    n = ((n & 0x33333333UL) <<  2) | ((n >>  2) & 0x33333333UL);
+    n = ((n & 0x55555555UL) <<  1) | ((n >>  1) & 0x55555555UL);
+    return n;
+#endif
+}
+
+#if defined(__SSSE3__) && defined(BS_LITTLE_ENDIAN) && UINTPTR_MAX > UINT32_MAX
+# include <tmmintrin.h>
+# define BS_BITREFLECT_SSSE3 1
+
+/*
+ * 16 バイト (2 ワード) のバイト順を逆にして、各バイトのビット順も逆にする。
+ * リトルエンディアンでは、ワードの並びを逆にして各ワードを bitreflect したものと同じになる。
+ * バイト内のビットの逆順は、上下 4 ビットごとの表引き (pshufb) で行う。
+ */
+MRBX_FORCE_INLINE __m128i
+bitreflect128(__m128i v)
+{
+    const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i lut = _mm_setr_epi8(0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+                                      0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf);
+    const __m128i m4 = _mm_set1_epi8(0x0f);
+
+    v = _mm_shuffle_epi8(v, rev);
+    __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, m4));
+    __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), m4));
+    return _mm_or_si128(_mm_slli_epi16(lo, 4), hi);
+}
+#endif
+
+/*
+ * q (size ビット) を逆順にして p に書き出す。
+ *
+ * 逆順にしたワードを R[k] = bitreflect(q[words - 1 - k]) とすれば、ビット長がワードの倍数でない時は
+ * p[k] = R[k] << pad | R[k + 1] >> rest となる。R[k + 1] を次のワードへ持ち越すことで、
+ * ワードの逆順と詰め直しを 1 回の走査で済ませる。
+ */
+static void
+bitset_bitreflect_copy(uintptr_t *p, const uintptr_t *q, size_t size)
+{
+    size_t words = unit_ceil(size, BS_WORDBITS);
+    int rest = size % BS_WORDBITS;
+    int pad = BS_WORDBITS - rest;
+    size_t k = 0;
+
+    if (rest == 0) {
+#ifdef BS_BITREFLECT_SSSE3
+        for (; k + 2 <= words; k += 2) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(q + words - 2 - k));
+            _mm_storeu_si128((__m128i *)(p + k), bitreflect128(v));
+        }
+#endif
+        for (; k < words; k ++) {
+            p[k] = bitreflect(q[words - 1 - k]);
+        }
+        return;
+    }
+
+#ifdef BS_BITREFLECT_SSSE3
+    if (words >= 4) {
+        const __m128i shl = _mm_cvtsi32_si128(pad);
+        const __m128i shr = _mm_cvtsi32_si128(rest);
+        __m128i cur = bitreflect128(_mm_loadu_si128((const __m128i *)(q + words - 2)));
+
+        for (; k + 4 <= words; k += 2) {
+            /* cur は R[k], R[k + 1]、next は R[k + 2], R[k + 3] */
+            __m128i next = bitreflect128(_mm_loadu_si128((const __m128i *)(q + words - 4 - k)));
+            __m128i succ = _mm_alignr_epi8(next, cur, 8);
+            __m128i v = _mm_or_si128(_mm_sll_epi64(cur, shl), _mm_srl_epi64(succ, shr));
+            _mm_storeu_si128((__m128i *)(p + k), v);
+            cur = next;
+        }
+    }
+#endif
+
+    uintptr_t r = bitreflect(q[words - 1 - k]);
+    for (; k + 1 < words; k ++) {
+        uintptr_t succ = bitreflect(q[words - 2 - k]);
+        p[k] = (r << pad) | (succ >> rest);
+        r = succ;
+    }
+    p[k] = r << pad;
+}
+
+/*
+ * p (size ビット) をその場で逆順にする。
+ *
+ * 詰め直しを伴う場合も、先頭と末尾から同時に書き進めることで 1 回の走査で済ませる。
+ * 先頭の p[k] は元の p[j] と p[j - 1] から、末尾の p[j] は元の p[k] と p[k - 1] から決まる (j = words - 1 - k)。
+ * どちらも読み込んでから書き込むため、上書きしてしまう p[k - 1] の逆順は rb に、
+ * 次の先頭で使う p[j - 1] の逆順は rf に持ち越す。
+ */
+static void
+bitset_bitreflect_inplace(uintptr_t *p, size_t size)
+{
+    size_t words = unit_ceil(size, BS_WORDBITS);
+    int rest = size % BS_WORDBITS;
+    int pad = BS_WORDBITS - rest;
+
+    if (words == 0) { return; }
+
+    if (rest == 0) {
+        uintptr_t *q;
+        for (q = p + words - 1; p < q; p ++, q --) {
+            uintptr_t t = bitreflect(*q);
+            *q = bitreflect(*p);
+            *p = t;
+        }
+
+        if (p == q) {
+            *p = bitreflect(*p);
+        }
+
+        return;
+    }
+
+    uintptr_t rb = 0;
+    uintptr_t rf = bitreflect(p[words - 1]);
+    size_t k = 0;
+
+    for (; k < words - 1 - k; k ++) {
+        size_t j = words - 1 - k;
+        uintptr_t a = bitreflect(p[k]);
+        uintptr_t nf = bitreflect(p[j - 1]);
+        p[k] = (rf << pad) | (nf >> rest);
+        p[j] = (a << pad) | (rb >> rest);
+        rb = a;
+        rf = nf;
+    }
+
+    if (k == words - 1 - k) {
+        p[k] = (rf << pad) | (rb >> rest);
+    }
+}
+
+static void
+bitset_bitreflect(mrb_state *mrb, struct bitset *dest, const struct bitset *src)
+{
+    if (!src || src == dest) {
+        bitset_bitreflect_inplace(bitset_ptr(dest), bitset_size(dest));
+    } else {
+        const uintptr_t *q;
+        size_t size;
+        bitset_getmem_const(src, &q, &size);
+
+        bitset_reserve(mrb, dest, size);
+        bitset_set_size(dest, size);
+        bitset_bitreflect_copy(bitset_ptr(dest), q, size);
+    }
+
+    bitset_summary_rebuild(mrb, dest);
+}
+
+static mrb_value
+bs_bitreflect(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    struct bitset *dest;
+    mrb_value obj = bitset_new_like(mrb, self, &dest);
+    bitset_bitreflect(mrb, dest, get_bitset(mrb, self));
+    return obj;
+}
+
+static mrb_value
+bs_bitreflect_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    bitset_bitreflect(mrb, get_bitset_for_modify(mrb, self), NULL);
+    return self;
+}
+
+static void
+bitset_minus(mrb_state *mrb, struct bitset *dest, const struct bitset *src)
+{
+    size_t size = bitset_size(src);
+    bitset_reserve(mrb, dest, size);
+    bitset_set_size(dest, size);
+    if (size < 1) { return; }
+
+    size_t words = unit_ceil(size, BS_WORDBITS);
+    uintptr_t *p = bitset_ptr(dest);
+    const uintptr_t *q = bitset_ptr_const(src);
+
+    p += words - 1;
+    q += words - 1;
+
+    int overflow = 0;
+    int pad = BS_WORDBITS - size % BS_WORDBITS;
+    if (pad < BS_WORDBITS) {
+        uintptr_t n = -(*q >> pad) << pad;
+        if (n == 0) {
+            overflow = 1;
+        }
+        *p = n;
+        p --; q --; words --;
+    }
+
+    for (; words > 0; words --, p --, q --) {
+        uintptr_t n = ~*q;
+        if (n == 0) {
+            n = overflow;
+            overflow = 1;
+        } else {
+            n += overflow;
+            if (n == 0) {
+                overflow = 1;
+            } else {
+                overflow = 0;
+            }
+        }
+
+        *p = n;
+    }
+
+    if (dest->is_tracked) {
+        dest->popcount = bitset_popcount_scan(dest);
+    }
+
+    bitset_summary_rebuild(mrb, dest);
+}
+
+static mrb_value
+bs_minus(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+
+    const struct bitset *src = get_bitset(mrb, self);
+    struct bitset *dest;
+    mrb_value obj = bitset_new_like(mrb, self, &dest);
+
+    bitset_minus(mrb, dest, src);
+
+    return obj;
+}
+
+static mrb_value
+bs_minus_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+
+    struct bitset *bs = get_bitset_for_modify(mrb, self);
+
+    bitset_minus(mrb, bs, bs);
+
+    return self;
+}
+
+/*
+ * 桁上がり付きの加算と、桁借り付きの減算。
+ * *carry は 0 か 1 で、呼び出し後は新しい桁上がり (桁借り) となる。
+ */
+static inline uintptr_t
+aux_addc(uintptr_t a, uintptr_t b, int *carry)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    uintptr_t s;
+    int c1 = __builtin_add_overflow(a, b, &s);
+    int c2 = __builtin_add_overflow(s, (uintptr_t)*carry, &s);
+    *carry = c1 | c2;
+    return s;
+#else
+    uintptr_t s1 = a + b;
+    uintptr_t s2 = s1 + *carry;
+    *carry = (s1 < a) | (s2 < s1);
+    return s2;
+#endif
+}
+
+static inline uintptr_t
+aux_subb(uintptr_t a, uintptr_t b, int *borrow)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    uintptr_t d;
+    int b1 = __builtin_sub_overflow(a, b, &d);
+    int b2 = __builtin_sub_overflow(d, (uintptr_t)*borrow, &d);
+    *borrow = b1 | b2;
+    return d;
+#else
+    uintptr_t d1 = a - b;
+    uintptr_t d2 = d1 - *borrow;
+    *borrow = (a < b) | (d1 < (uintptr_t)*borrow);
+    return d2;
+#endif
+}
+
+/*
+ * other のビット位置 from から 1 ワード分を、ビット列と同じく上位に詰めて取り出す。
+ * 0 より前と、ビット長を超えた部分は 0 とする。
+ */
+static inline uintptr_t
+aux_operand_word(const struct bitset *other, ptrdiff_t from)
+{
+    ptrdiff_t to = from + BS_WORDBITS;
+    ptrdiff_t lo = from < 0 ? 0 : from;
+    ptrdiff_t hi = to > (ptrdiff_t)bitset_size(other) ? (ptrdiff_t)bitset_size(other) : to;
+
+    if (lo >= hi) { return 0; }
+
+    return bitset_peek(other, lo, hi - lo) << (to - hi);
+}
+
+/*
+ * LSB を揃えて other の値を足す (subtract であれば引く)。other の上位の余るビットは無視する。
+ * 最上位からの桁あふれ (引き算では桁借り) があれば true を返す。dry であれば書き換えずに判定だけを行う。
+ *
+ * ビット長が size の bs の各ワードは、値を 2 ** pad 倍したものの BS_WORDBITS ビットごとの桁となる。
+ * other も同じ位置に揃えたワードとして取り出せば、末尾のワードから普通の多倍長の加減算で済む。
+ * 余りのビットはどちらも 0 なので、結果の余りのビットも 0 のままとなる。
+ */
+static bool
+bitset_add_words(struct bitset *bs, const struct bitset *other, bool subtract, bool dry)
+{
+    size_t size = bitset_size(bs);
+    uintptr_t *p = bitset_ptr(bs);
+    ptrdiff_t d = (ptrdiff_t)bitset_size(other) - (ptrdiff_t)size;
+
+    /* これより前のワードでは other が 0 となるので、桁上がりがなくなれば終わる */
+    size_t live = d >= 0 ? 0 : (size_t)-d / BS_WORDBITS;
+    int carry = 0;
+
+    for (size_t i = unit_ceil(size, BS_WORDBITS); i > 0; i --) {
+        size_t j = i - 1;
+        if (j < live && !carry) { break; }
+
+        uintptr_t q = aux_operand_word(other, (ptrdiff_t)(j * BS_WORDBITS) + d);
+        uintptr_t n = subtract ? aux_subb(p[j], q, &carry) : aux_addc(p[j], q, &carry);
+        if (!dry) { p[j] = n; }
+    }
+
+    return carry;
+}
+
+enum bitset_overflow { BS_OVERFLOW_WRAP, BS_OVERFLOW_RAISE, BS_OVERFLOW_SATURATE };
+
+static const char *const bitset_overflow_names[] = { "wrap", "raise", "saturate" };
+
+/*
+ * ビット長を固定幅とする符号なし整数として、other を足す (subtract であれば引く)。
+ * 結果が幅に収まらない場合の扱いは mode による。
+ *
+ * [BS_OVERFLOW_WRAP]     2 ** size で割った余りとする
+ * [BS_OVERFLOW_RAISE]    RangeError を起こす。bs は変更しない
+ * [BS_OVERFLOW_SATURATE] 足し算であれば全て 1、引き算であれば全て 0 とする
+ */
+static void
+bitset_arith(mrb_state *mrb, struct bitset *bs, const struct bitset *other, bool subtract, enum bitset_overflow mode)
+{
+    size_t size = bitset_size(bs);
+    size_t osize = bitset_size(other);
+    bool overflow = osize > size && bitset_popcount_range(other, 0, osize - size) != 0;
+
+    if (mode == BS_OVERFLOW_RAISE) {
+        if (overflow || bitset_add_words(bs, other, subtract, true)) {
+            mrb_raisef(mrb, E_RANGE_ERROR,
+                       "%S out of %S bits",
+                       mrb_str_new_cstr(mrb, subtract ? "underflow" : "overflow"),
+                       mrb_fixnum_value(size));
+        }
+        bitset_add_words(bs, other, subtract, false);
+    } else if (mode == BS_OVERFLOW_SATURATE && overflow) {
+        bitset_fill_range(bs, 0, size, !subtract);
+    } else {
+        overflow = bitset_add_words(bs, other, subtract, false) || overflow;
+        if (mode == BS_OVERFLOW_SATURATE && overflow) {
+            bitset_fill_range(bs, 0, size, !subtract);
+        }
+    }
+
+    if (bs->is_tracked) {
+        bs->popcount = bitset_popcount_scan(bs);
+    }
+
+    bitset_summary_rebuild(mrb, bs);
+}
+
+static enum bitset_overflow
+aux_overflow_mode(mrb_state *mrb, mrb_value opts)
+{
+    if (mrb_nil_p(opts)) { return BS_OVERFLOW_WRAP; }
+
+    mrb_value mode = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "overflow")));
+    if (mrb_nil_p(mode)) { return BS_OVERFLOW_WRAP; }
+
+    if (mrb_symbol_p(mode)) {
+        for (int i = 0; i < (int)(sizeof(bitset_overflow_names) / sizeof(bitset_overflow_names[0])); i ++) {
+            if (mrb_symbol(mode) == mrb_intern_cstr(mrb, bitset_overflow_names[i])) {
+                return (enum bitset_overflow)i;
+            }
+        }
+    }
+
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong overflow mode (expect :wrap, :raise or :saturate, but given %S)",
+               mrb_inspect(mrb, mode));
+    return BS_OVERFLOW_WRAP;
+}
+
+/*
+ * 整数であれば、その絶対値を 64 ビットのビット列として tmp に置く。負の値は足し算と引き算を入れ替える。
+ */
+static const struct bitset *
+aux_arith_operand(mrb_state *mrb, mrb_value other, struct bitset *tmp, bool *subtract)
+{
+    if (!mrb_fixnum_p(other)) { return get_bitset(mrb, other); }
+
+    mrb_int n = mrb_fixnum(other);
+    uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+    if (n < 0) { *subtract = !*subtract; }
+
+    memset(tmp, 0, sizeof(*tmp));
+    tmp->is_embed = 1;
+    tmp->embed_len = 64;
+    for (int i = 0; i < 64 / BS_WORDBITS; i ++) {
+        tmp->ary[i] = (uintptr_t)(u >> (64 - BS_WORDBITS * (i + 1)));
+    }
+
+    return tmp;
+}
+
+static mrb_value
+aux_arith(mrb_state *mrb, mrb_value self, mrb_value other, mrb_value opts, bool subtract)
+{
+    enum bitset_overflow mode = aux_overflow_mode(mrb, opts);
+    struct bitset tmp;
+    const struct bitset *operand = aux_arith_operand(mrb, other, &tmp, &subtract);
+    bitset_arith(mrb, get_bitset_for_modify(mrb, self), operand, subtract, mode);
+    return self;
+}
+
+/*
+ * call-seq:
+ *  add!(other, overflow: :wrap) -> self
+ *  sub!(other, overflow: :wrap) -> self
+ *
+ * ビット列を、ビット長を幅とする符号なし整数 (MSB が先頭) とみなして other を足す (引く)。
+ * other は Bitset (LSB を揃える) か整数。
+ * overflow には幅に収まらない場合の扱いとして :wrap, :raise, :saturate のいずれかを与える。
+ */
+static mrb_value
+bs_add_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_value other, opts = mrb_nil_value();
+    mrb_get_args(mrb, "o|H", &other, &opts);
+    BS_STATS_CALL(mrb, self);
+    return aux_arith(mrb, self, other, opts, false);
+}
+
+static mrb_value
+bs_sub_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_value other, opts = mrb_nil_value();
+    mrb_get_args(mrb, "o|H", &other, &opts);
+    BS_STATS_CALL(mrb, self);
+    return aux_arith(mrb, self, other, opts, true);
+}
+
+/*
+ * call-seq:
+ *  inc!(overflow: :wrap) -> self
+ *  dec!(overflow: :wrap) -> self
+ *
+ * 桁上がり (桁借り) が止まったワードで終わるため、ならせば定数時間となる。
+ */
+static mrb_value
+bs_inc_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_value opts = mrb_nil_value();
+    mrb_get_args(mrb, "|H", &opts);
+    BS_STATS_CALL(mrb, self);
+    return aux_arith(mrb, self, mrb_fixnum_value(1), opts, false);
+}
+
+static mrb_value
+bs_dec_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_value opts = mrb_nil_value();
+    mrb_get_args(mrb, "|H", &opts);
+    BS_STATS_CALL(mrb, self);
+    return aux_arith(mrb, self, mrb_fixnum_value(1), opts, true);
+}
+
+/*
+ * ワード単位の並列ビット抽出 (pext) と並列ビット配置 (pdep)。
+ *
+ * x86 では BMI2 の pext / pdep 命令を使えるかを実行時に調べ (bitset_pbits_init)、使えなければ
+ * マスクの 1 ビットごとに処理する汎用版を使う。いずれも Intel の定義と同じく LSB 側から数えた順序を保つため、
+ * MSB から並ぶビット列でもマスクで選んだ順序がそのまま残る。
+ */
+
+typedef uintptr_t bitset_pbits_f(uintptr_t x, uintptr_t m);
+
+static uintptr_t
+pext_soft(uintptr_t x, uintptr_t m)
+{
+    uintptr_t r = 0;
+
+    for (uintptr_t bb = 1; m != 0; bb <<= 1, m &= m - 1) {
+        if (x & m & -m) { r |= bb; }
+    }
+
+    return r;
+}
+
+static uintptr_t
+pdep_soft(uintptr_t x, uintptr_t m)
+{
+    uintptr_t r = 0;
+
+    for (uintptr_t bb = 1; m != 0; bb <<= 1, m &= m - 1) {
+        if (x & bb) { r |= m & -m; }
+    }
+
+    return r;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+# include <immintrin.h>
+
+__attribute__((target("bmi2"))) static uintptr_t
+pext_bmi2(uintptr_t x, uintptr_t m)
+{
+# if UINTPTR_MAX > UINT32_MAX
+    return _pext_u64(x, m);
+# else
+    return _pext_u32(x, m);
+# endif
+}
+
+__attribute__((target("bmi2"))) static uintptr_t
+pdep_bmi2(uintptr_t x, uintptr_t m)
+{
+# if UINTPTR_MAX > UINT32_MAX
+    return _pdep_u64(x, m);
+# else
+    return _pdep_u32(x, m);
+# endif
+}
+#endif
+
+static bitset_pbits_f *bitset_pext = pext_soft;
+static bitset_pbits_f *bitset_pdep = pdep_soft;
+
+static void
+bitset_pbits_init(void)
+{
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2")) {
+        bitset_pext = pext_bmi2;
+        bitset_pdep = pdep_bmi2;
+    }
+#endif
+}
+
+/*
+ * 下位に詰めた c ビットの n を、p のビット位置 index から書き込む (論理和)。p は 0 で埋めておくこと。
+ */
+static inline void
+aux_put_bits(uintptr_t *p, size_t index, uintptr_t n, int c)
+{
+    if (c < 1) { return; }
+
+    p += index / BS_WORDBITS;
+    int off = index % BS_WORDBITS;
+
+    if (off + c <= BS_WORDBITS) {
+        p[0] |= n << (BS_WORDBITS - off - c);
+    } else {
+        int spill = off + c - BS_WORDBITS;
+        p[0] |= n >> spill;
+        p[1] |= n << (BS_WORDBITS - spill);
+    }
+}
+
+/*
+ * bs のビット位置 index から c ビットを下位に詰めて取り出す。ビット長を超えた部分は 0 とする。
+ */
+static inline uintptr_t
+aux_take_bits(const struct bitset *bs, size_t index, int c)
+{
+    size_t size = bitset_size(bs);
+
+    if (c < 1 || index >= size) { return 0; }
+
+    int avail = size - index < (size_t)c ? (int)(size - index) : c;
+    return bitset_peek(bs, index, avail) << (c - avail);
+}
+
+/*
+ * mask の 1 の位置にある bs のビットを先頭から順に詰めて dest に書き出す。
+ * dest は popcount(mask) ビットの 0 で埋めたワード列。bs のビット長を超えた位置は 0 とする。
+ */
+static void
+bitset_extract(const struct bitset *bs, const struct bitset *mask, uintptr_t *dest)
+{
+    size_t words = unit_ceil(bitset_size(mask), BS_WORDBITS);
+    size_t swords = unit_ceil(bitset_size(bs), BS_WORDBITS);
+    size_t out = 0;
+
+    for (size_t j = 0; j < words; j ++) {
+        uintptr_t m = bitset_word_live(mask, j);
+        if (m == 0) { continue; }
+
+        int c = popcount(m);
+        uintptr_t x = j < swords ? bitset_word_live(bs, j) : 0;
+        aux_put_bits(dest, out, bitset_pext(x, m), c);
+        out += c;
+    }
+}
+
+/*
+ * mask の 1 の位置 (bs のビット長の内側のみ) を、src の先頭から順に取り出したビットで置き換える。
+ * src が足りなければ 0 を置く。1 ビットの数が変わった分を返す。
+ */
+static ssize_t
+bitset_deposit(struct bitset *bs, const struct bitset *mask, const struct bitset *src)
+{
+    size_t size = bitset_size(bs);
+    size_t words = unit_ceil(size < bitset_size(mask) ? size : bitset_size(mask), BS_WORDBITS);
+    uintptr_t *p = bitset_ptr(bs);
+    size_t in = 0;
+    ssize_t diff = 0;
+
+    for (size_t j = 0; j < words; j ++) {
+        uintptr_t m = bitset_word_live(mask, j);
+        if (j == size / BS_WORDBITS) { m &= ~getmask(BS_WORDBITS - size % BS_WORDBITS); }
+        if (m == 0) { continue; }
+
+        int c = popcount(m);
+        uintptr_t n = (p[j] & ~m) | bitset_pdep(aux_take_bits(src, in, c), m);
+        diff += popcount(n) - popcount(p[j]);
+        p[j] = n;
+        in += c;
+    }
+
+    return diff;
+}
+
+/*
+ * call-seq:
+ *  extract(mask) -> new bitset
+ *
+ * mask (Bitset) の 1 が立っている位置のビットを、先頭から順に詰めた Bitset を返す。
+ * 結果のビット長は mask の 1 の数となる。
+ */
+static mrb_value
+bs_extract(mrb_state *mrb, mrb_value self)
+{
+    const struct bitset *mask;
+    mrb_get_args(mrb, "d", &mask, &bitset_type);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset *bs = get_bitset(mrb, self);
+
+    struct bitset *dest;
+    mrb_value obj = bitset_new(mrb, NULL, &dest);
+    bitset_grow(mrb, dest, bitset_popcount(mask));
+    bitset_extract(bs, mask, bitset_ptr(dest));
+
+    return obj;
+}
+
+static void
+aux_deposit(mrb_state *mrb, struct bitset *bs, mrb_value maskv, mrb_value srcv)
+{
+    const struct bitset *mask = get_bitset(mrb, maskv);
+    const struct bitset *src = get_bitset(mrb, srcv);
+
+    if (src == bs) {
+        /* 書き換えながら読むことになるため、複製から取り出す */
+        struct bitset *tmp;
+        bitset_new(mrb, NULL, &tmp);
+        bitset_copy(mrb, tmp, src);
+        src = tmp;
+    }
+
+    ssize_t diff = bitset_deposit(bs, mask, src);
+
+    if (bs->is_tracked) {
+        bs->popcount += diff;
+    }
+
+    bitset_summary_rebuild(mrb, bs);
+}
+
+/*
+ * call-seq:
+ *  deposit(mask, src) -> new bitset
+ *  deposit!(mask, src) -> self
+ *
+ * mask (Bitset) の 1 が立っている位置を、src (Bitset) の先頭から順に取り出したビットで置き換える。
+ * extract の逆の操作となる。src が足りない位置には 0 を置く。ビット長は変わらない。
+ */
+static mrb_value
+bs_deposit(mrb_state *mrb, mrb_value self)
+{
+    mrb_value mask, src;
+    mrb_get_args(mrb, "oo", &mask, &src);
+    BS_STATS_CALL(mrb, self);
+
+    struct bitset *dest;
+    mrb_value obj = bitset_new_like(mrb, self, &dest);
+    bitset_copy(mrb, dest, get_bitset(mrb, self));
+    bitset_modified(dest);
+    aux_deposit(mrb, dest, mask, src);
+
+    return obj;
+}
+
+static mrb_value
+bs_deposit_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_value mask, src;
+    mrb_get_args(mrb, "oo", &mask, &src);
+    BS_STATS_CALL(mrb, self);
+    aux_deposit(mrb, get_bitset_for_modify(mrb, self), mask, src);
+    return self;
+}
+
+/*
+ * p のビット位置 index から w (1..BS_WORDBITS) ビットを下位に詰めて取り出す。
+ * [index, index + w) は有効な範囲であること。bitset_peek と違い、範囲の分岐を最小にしている。
+ */
+static inline uintptr_t
+aux_peek_bits(const uintptr_t *p, size_t index, int w)
+{
+    p += index / BS_WORDBITS;
+    int off = index % BS_WORDBITS;
+    uintptr_t n = p[0] << off;
+
+    if (off + w > BS_WORDBITS) {
+        n |= p[1] >> (BS_WORDBITS - off);
+    }
+
+    return n >> (BS_WORDBITS - w);
+}
+
+/*
+ * src のビット位置 soff から width ビットを、dest のビット位置 doff 以降に写す。
+ * 書き込む範囲の外にある dest のビットは変えない。src と dest は重なっていないこと。
+ *
+ * dest のワード境界に合わせてから、1 ワードずつ (soff が揃っていれば memcpy で) 写す。
+ */
+static void
+bitset_copy_bits(uintptr_t *dest, size_t doff, const uintptr_t *src, size_t soff, size_t width)
+{
+    if (width == 0) { return; }
+
+    dest += doff / BS_WORDBITS;
+    doff %= BS_WORDBITS;
+
+    if (doff > 0) {
+        size_t c = BS_WORDBITS - doff;
+        if (c > width) { c = width; }
+        replace_bitset(dest, doff, c, aux_peek_bits(src, soff, c));
+        dest ++;
+        soff += c;
+        width -= c;
+    }
+
+    src += soff / BS_WORDBITS;
+    soff %= BS_WORDBITS;
+    size_t words = width / BS_WORDBITS;
+
+    if (soff == 0) {
+        memcpy(dest, src, words * sizeof(uintptr_t));
+        dest += words;
+        src += words;
+    } else {
+        for (; words > 0; words --, dest ++, src ++) {
+            *dest = (src[0] << soff) | (src[1] >> (BS_WORDBITS - soff));
+        }
+    }
+
+    width %= BS_WORDBITS;
+    if (width > 0) {
+        replace_bitset(dest, 0, width, aux_peek_bits(src, soff, width));
+    }
+}
+
+/*
+ * [index, index + width) を dest の先頭から詰めて書き出す。ビット長を超えた部分と、
+ * 最後のワードの余りは 0 とする。
+ */
+static void
+bitset_read_range(const struct bitset *bs, size_t index, size_t width, uintptr_t *dest)
+{
+    size_t size = bitset_size(bs);
+    size_t avail = index < size ? (width < size - index ? width : size - index) : 0;
+    size_t words = unit_ceil(width, BS_WORDBITS);
+
+    bitset_copy_bits(dest, 0, bitset_ptr_const(bs), index, avail);
+
+    size_t j = avail / BS_WORDBITS;
+    if (avail % BS_WORDBITS > 0) {
+        dest[j] &= ~getmask(BS_WORDBITS - avail % BS_WORDBITS);
+        j ++;
+    }
+
+    memset(dest + j, 0, (words - j) * sizeof(uintptr_t));
+}
+
+/*
+ * src の先頭から width ビットを [index, index + width) に書き込む。ビット長を超えれば伸ばす。
+ */
+static void
+bitset_write_range(mrb_state *mrb, struct bitset *bs, size_t index, size_t width, const uintptr_t *src)
+{
+    if (width == 0) { return; }
+
+    if (width > SIZE_MAX - index) {
+        mrb_raise(mrb, E_RANGE_ERROR, "bit range too large");
+    }
+
+    if (index + width > bitset_size(bs)) {
+        bitset_resize(mrb, bs, index + width);
+    }
+
+    size_t oldcount = bs->is_tracked ? bitset_popcount_range(bs, index, width) : 0;
+    bitset_copy_bits(bitset_ptr(bs), index, src, 0, width);
+
+    if (bs->is_tracked) {
+        bs->popcount = bs->popcount - oldcount + bitset_popcount_range(bs, index, width);
+    }
+
+    bitset_summary_update(bs, index, width);
+}
+
+/*
+ * n 本のビット列のビットを交互に並べる (Morton 順序、Z 順序)。
+ *
+ * 各ビット列から c = BS_WORDBITS / n ビットずつ取り出し、それぞれを n ビット間隔に広げて重ねた
+ * n * c ビットを出力の末尾に書き足す。n が 2 と 3 の場合は定数のマスクとシフトで広げ、
+ * それ以外は pdep で広げる。元に戻す場合はこの逆を行う。
+ */
+
+/* 位置 0, n, 2n ... の c ビットを立てたマスク */
+static uintptr_t
+aux_spread_mask(int n, int c)
+{
+    uintptr_t m = 0;
+
+    for (int i = 0; i < c; i ++) {
+        m |= (uintptr_t)1 << (i * n);
+    }
+
+    return m;
+}
+
+/*
+ * 下位に詰めた x のビットを n ビット間隔に広げる。
+ */
+static inline uintptr_t
+aux_spread(uintptr_t x, int n, uintptr_t mask)
+{
+    switch (n) {
+    case 1:
+        return x;
+#if UINTPTR_MAX > UINT32_MAX
+    case 2:
+        x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+        x = (x | (x <<  8)) & 0x00ff00ff00ff00ffULL;
+        x = (x | (x <<  4)) & 0x0f0f0f0f0f0f0f0fULL;
+        x = (x | (x <<  2)) & 0x3333333333333333ULL;
+        x = (x | (x <<  1)) & 0x5555555555555555ULL;
+        return x;
+    case 3:
+        x = (x | (x << 32)) & 0x001f00000000ffffULL;
+        x = (x | (x << 16)) & 0x001f0000ff0000ffULL;
+        x = (x | (x <<  8)) & 0x100f00f00f00f00fULL;
+        x = (x | (x <<  4)) & 0x10c30c30c30c30c3ULL;
+        x = (x | (x <<  2)) & 0x1249249249249249ULL;
+        return x;
+#else
+    case 2:
+        x = (x | (x <<  8)) & 0x00ff00ffUL;
+        x = (x | (x <<  4)) & 0x0f0f0f0fUL;
+        x = (x | (x <<  2)) & 0x33333333UL;
+        x = (x | (x <<  1)) & 0x55555555UL;
+        return x;
+    case 3:
+        x = (x | (x << 16)) & 0x030000ffUL;
+        x = (x | (x <<  8)) & 0x0300f00fUL;
+        x = (x | (x <<  4)) & 0x030c30c3UL;
+        x = (x | (x <<  2)) & 0x09249249UL;
+        return x;
+#endif
+    default:
+        return bitset_pdep(x, mask);
+    }
+}
+
+/*
+ * aux_spread の逆。n ビット間隔のビット (x の位置 0, n, 2n ...) を下位に詰める。
+ */
+static inline uintptr_t
+aux_compact(uintptr_t x, int n, uintptr_t mask)
+{
+    switch (n) {
+    case 1:
+        return x;
+#if UINTPTR_MAX > UINT32_MAX
+    case 2:
+        x &= 0x5555555555555555ULL;
+        x = (x | (x >>  1)) & 0x3333333333333333ULL;
+        x = (x | (x >>  2)) & 0x0f0f0f0f0f0f0f0fULL;
+        x = (x | (x >>  4)) & 0x00ff00ff00ff00ffULL;
+        x = (x | (x >>  8)) & 0x0000ffff0000ffffULL;
+        x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+        return x;
+    case 3:
+        x &= 0x1249249249249249ULL;
+        x = (x | (x >>  2)) & 0x10c30c30c30c30c3ULL;
+        x = (x | (x >>  4)) & 0x100f00f00f00f00fULL;
+        x = (x | (x >>  8)) & 0x001f0000ff0000ffULL;
+        x = (x | (x >> 16)) & 0x001f00000000ffffULL;
+        x = (x | (x >> 32)) & 0x00000000001fffffULL;
+        return x;
+#else
+    case 2:
+        x &= 0x55555555UL;
+        x = (x | (x >>  1)) & 0x33333333UL;
+        x = (x | (x >>  2)) & 0x0f0f0f0fUL;
+        x = (x | (x >>  4)) & 0x00ff00ffUL;
+        x = (x | (x >>  8)) & 0x0000ffffUL;
+        return x;
+    case 3:
+        x &= 0x09249249UL;
+        x = (x | (x >>  2)) & 0x030c30c3UL;
+        x = (x | (x >>  4)) & 0x0300f00fUL;
+        x = (x | (x >>  8)) & 0x030000ffUL;
+        x = (x | (x >> 16)) & 0x000003ffUL;
+        return x;
+#endif
+    default:
+        return bitset_pext(x, mask);
+    }
+}
+
+/*
+ * n 本の len ビットのビット列 src を交互に並べて dest (n * len ビット、0 で埋めておく) に書き出す。
+ * dest の i * n + k ビット目が src[k] の i ビット目となる。
+ */
+MRBX_FORCE_INLINE void
+bitset_interleave_n(uintptr_t *dest, const uintptr_t *const *sp, const int n, size_t len)
+{
+    const int c = BS_WORDBITS / n;
+    const uintptr_t mask = aux_spread_mask(n, c);
+    size_t i = 0;
+
+    for (; i + c <= len; i += c) {
+        uintptr_t v = 0;
+
+        for (int k = 0; k < n; k ++) {
+            v |= aux_spread(aux_peek_bits(sp[k], i, c), n, mask) << (n - 1 - k);
+        }
+
+        aux_put_bits(dest, i * n, v, c * n);
+    }
+
+    if (i < len) {
+        int w = len - i;
+        uintptr_t v = 0;
+
+        for (int k = 0; k < n; k ++) {
+            v |= aux_spread(aux_peek_bits(sp[k], i, w), n, mask) << (n - 1 - k);
+        }
+
+        aux_put_bits(dest, i * n, v, w * n);
+    }
+}
+
+static void
+bitset_interleave(uintptr_t *dest, const struct bitset *const *src, int n, size_t len)
+{
+    const uintptr_t *sp[BS_WORDBITS];
+
+    for (int k = 0; k < n; k ++) {
+        sp[k] = bitset_ptr_const(src[k]);
+    }
+
+    /* よく使う 2 と 3 は定数として展開させる */
+    switch (n) {
+    case 2:  bitset_interleave_n(dest, sp, 2, len); break;
+    case 3:  bitset_interleave_n(dest, sp, 3, len); break;
+    default: bitset_interleave_n(dest, sp, n, len); break;
+    }
+}
+
+/*
+ * bitset_interleave の逆。src (n * len ビット) を n 本のビット列 dest (len ビット、0 で埋めておく) に分ける。
+ */
+MRBX_FORCE_INLINE void
+bitset_deinterleave_n(uintptr_t *const *dest, const uintptr_t *p, const int n, size_t len)
+{
+    const int c = BS_WORDBITS / n;
+    const uintptr_t mask = aux_spread_mask(n, c);
+
+    for (size_t i = 0; i < len; i += c) {
+        int w = len - i < (size_t)c ? (int)(len - i) : c;
+        uintptr_t v = aux_peek_bits(p, i * n, w * n);
+
+        for (int k = 0; k < n; k ++) {
+            aux_put_bits(dest[k], i, aux_compact(v >> (n - 1 - k), n, mask), w);
+        }
+    }
+}
+
+static void
+bitset_deinterleave(uintptr_t *const *dest, const struct bitset *src, int n, size_t len)
+{
+    const uintptr_t *p = bitset_ptr_const(src);
+
+    switch (n) {
+    case 2:  bitset_deinterleave_n(dest, p, 2, len); break;
+    case 3:  bitset_deinterleave_n(dest, p, 3, len); break;
+    default: bitset_deinterleave_n(dest, p, n, len); break;
+    }
+}
+
+/*
+ * call-seq:
+ *  Bitset.interleave(*bitsets) -> new bitset
+ *
+ * 同じビット長のビット列を 1 ビットずつ交互に並べた Bitset を返す。
+ * 座標ごとのビット列から Z 順序 (Morton 順序) のキーを作る場合に使う。
+ */
+static mrb_value
+bs_s_interleave(mrb_state *mrb, mrb_value klass)
+{
+    mrb_value *argv;
+    mrb_int argc;
+    mrb_get_args(mrb, "*", &argv, &argc);
+    BS_STATS_CALL(mrb, klass);
+
+    if (argc < 1 || argc > BS_WORDBITS) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong number of bitsets (expect 1..%S, but given %S)",
+                   mrb_fixnum_value(BS_WORDBITS), mrb_fixnum_value(argc));
+    }
+
+    const struct bitset *src[BS_WORDBITS];
+    for (mrb_int k = 0; k < argc; k ++) {
+        src[k] = get_bitset(mrb, argv[k]);
+        if (bitset_size(src[k]) != bitset_size(src[0])) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "bit length mismatch (%S for %S)",
+                       mrb_fixnum_value(bitset_size(src[k])), mrb_fixnum_value(bitset_size(src[0])));
+        }
+    }
+
+    size_t len = bitset_size(src[0]);
+    if (len > SIZE_MAX / argc) { mrb_raise(mrb, E_ARGUMENT_ERROR, "bitset too large"); }
+
+    struct bitset *dest;
+    mrb_value obj = bitset_new(mrb, mrb_class_ptr(klass), &dest);
+    dest->is_fixed = bitset_fixed_class_p(mrb, mrb_class_ptr(klass));
+    bitset_grow(mrb, dest, len * argc);
+    bitset_interleave(bitset_ptr(dest), src, argc, len);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  deinterleave(n) -> array of bitsets
+ *
+ * Bitset.interleave の逆。ビット長は n の倍数でなければならない。
+ */
+static mrb_value
+bs_deinterleave(mrb_state *mrb, mrb_value self)
+{
+    mrb_int n;
+    mrb_get_args(mrb, "i", &n);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset *bs = get_bitset(mrb, self);
+    size_t size = bitset_size(bs);
+
+    if (n < 1 || n > BS_WORDBITS) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong number of bitsets (expect 1..%S, but given %S)",
+                   mrb_fixnum_value(BS_WORDBITS), mrb_fixnum_value(n));
+    }
+
+    if (size % n != 0) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "bit length is not a multiple of %S (%S)",
+                   mrb_fixnum_value(n), mrb_fixnum_value(size));
+    }
+
+    mrb_value ary = mrb_ary_new_capa(mrb, n);
+    uintptr_t *dest[BS_WORDBITS];
+
+    for (mrb_int k = 0; k < n; k ++) {
+        struct bitset *d;
+        mrb_ary_push(mrb, ary, bitset_new_like(mrb, self, &d));
+        bitset_grow(mrb, d, size / n);
+        dest[k] = bitset_ptr(d);
+    }
+
+    bitset_deinterleave(dest, bs, n, size / n);
+
+    return ary;
+}
+
+static int
+popcount(uintptr_t n)
+{
+#if 0 && (defined(__GNUC__) || defined(__clang__))
+    if (!n) { return 0; }
+
+# if UINTPTR_MAX > UINT32_MAX
+    return __builtin_popcountll(n);
+# else
+    return __builtin_popcount(n);
+# endif
+#elif 1
+    /* utils/mkpopcnt.rb で出力 */
+    static const char table[] = {
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+        1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+        2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
         2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
         3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
         1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
@@ -1429,558 +4064,4383 @@ popcount(uintptr_t n)
         4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8,
     };
 
-    int count = 0;
-    for (int i = 0; i < sizeof(n); i ++) {
-        count += table[(uint8_t)(n >> (i * 8)) & 0xff];
+    int count = 0;
+    for (int i = 0; i < sizeof(n); i ++) {
+        count += table[(uint8_t)(n >> (i * 8)) & 0xff];
+    }
+    return count;
+#else
+# if UINTPTR_MAX > UINT32_MAX
+    //n = ( n       & 0x1111111111111111ULL) +
+    //    ((n >> 1) & 0x1111111111111111ULL) +
+    //    ((n >> 2) & 0x1111111111111111ULL) +
+    //    ((n >> 3) & 0x1111111111111111ULL);
+    n = (n & 0x5555555555555555ULL) + ((n >>  1) & 0x5555555555555555ULL);
+    n = (n & 0x3333333333333333ULL) + ((n >>  2) & 0x3333333333333333ULL);
+    n = (n + (n >> 4)) & 0x0f0f0f0f0f0f0f0fULL; /* 4 + 4 = 8 が最大なので、加算前のビットマスクは不要 */
+    n += n >>  8; /* 以降は 0..64 に収まるため、ビットマスクは不要 */
+    n += n >> 16;
+    n += n >> 32;
+# else
+    n = (n & 0x55555555UL) + ((n >>  1) & 0x55555555UL);
+    n = (n & 0x33333333UL) + ((n >>  2) & 0x33333333UL);
+    n = (n + (n >> 4)) & 0x0f0f0f0fUL; /* 4 + 4 = 8 が最大なので、加算前のビットマスクは不要 */
+    n += n >>  8; /* 以降は 0..32 に収まるため、ビットマスクは不要 */
+    n += n >> 16;
+# endif
+    return n & 0xff;
+#endif
+}
+
+static size_t
+bitset_popcount_scan(const struct bitset *bs)
+{
+    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
+    size_t size = bitset_size(bs);
+    size_t cnt = 0;
+
+    for (size_t i = size / BS_WORDBITS; i > 0; i --, p ++) {
+        cnt += popcount(*p);
+    }
+
+    size %= BS_WORDBITS;
+    if (size > 0) {
+        cnt += popcount(*p >> (BS_WORDBITS - size));
+    }
+
+    return cnt;
+}
+
+/*
+ * [index, index + width) の範囲にある 1 ビットを数える。範囲はビット長に切り詰められる。
+ */
+static size_t
+bitset_popcount_range(const struct bitset *bs, size_t index, size_t width)
+{
+    size_t size = bitset_size(bs);
+    if (index >= size || width == 0) { return 0; }
+    if (width > size - index) { width = size - index; }
+
+    const uintptr_t *p = bitset_ptr_const(bs) + index / BS_WORDBITS;
+    int off = index % BS_WORDBITS;
+    size_t cnt = 0;
+
+    if (off + width <= BS_WORDBITS) {
+        return popcount(*p << off >> (BS_WORDBITS - width));
+    }
+
+    cnt += popcount(*p << off);
+    width -= BS_WORDBITS - off;
+    p ++;
+
+    for (; width >= BS_WORDBITS; width -= BS_WORDBITS, p ++) {
+        cnt += popcount(*p);
+    }
+
+    if (width > 0) {
+        cnt += popcount(*p >> (BS_WORDBITS - width));
+    }
+
+    return cnt;
+}
+
+static size_t
+bitset_popcount(const struct bitset *bs)
+{
+    if (bs->is_tracked) {
+        return bs->popcount;
+    } else {
+        return bitset_popcount_scan(bs);
+    }
+}
+
+MRB_API int
+mruby_bitset_popcount(mrb_state *mrb, mrb_value bitset)
+{
+    return bitset_popcount(get_bitset(mrb, bitset));
+}
+
+static mrb_value
+bs_popcount(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_popcount(get_bitset(mrb, self)));
+}
+
+/*
+ * call-seq:
+ *  track! -> self
+ *
+ * 1 ビットの数を常に追跡するようにする。
+ * 以降は popcount / all? / any? / none? が全体を走査せずに結果を返す。
+ * その代わりに、ビット列を変更する操作では変更したワードの差分を数える処理が加わる。
+ */
+static mrb_value
+bs_track_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    struct bitset *bs = get_bitset(mrb, self);
+    bitset_check_borrowed(mrb, bs);
+
+    if (!bs->is_tracked) {
+        bs->popcount = bitset_popcount_scan(bs);
+        bs->is_tracked = 1;
+    }
+
+    return self;
+}
+
+static mrb_value
+bs_untrack_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    get_bitset(mrb, self)->is_tracked = 0;
+    return self;
+}
+
+static mrb_value
+bs_tracked_p(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(get_bitset(mrb, self)->is_tracked);
+}
+
+/*
+ * 以降は any? / none? / clz / ctz / next_one / prev_one / to_indices が 0 のワードを読み飛ばし、
+ * msb_and は自身の 0 ではないワードだけを処理する。
+ * 1 がまばらな巨大なビット列に向く。要約の大きさはビット列の 1/63 程度となる。
+ */
+static mrb_value
+bs_summarize_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    struct bitset *bs = get_bitset(mrb, self);
+    bitset_check_borrowed(mrb, bs);
+    bitset_summarize(mrb, bs);
+    return self;
+}
+
+static mrb_value
+bs_unsummarize_bang(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    bitset_unsummarize(mrb, get_bitset(mrb, self));
+    return self;
+}
+
+static mrb_value
+bs_summarized_p(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(get_bitset(mrb, self)->summary != NULL);
+}
+
+static int
+count_nlz(uintptr_t n)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    if (!n) { return BS_WORDBITS; }
+
+# if UINTPTR_MAX > UINT32_MAX
+    return __builtin_clzll(n);
+# else
+    return __builtin_clz(n);
+# endif
+#else
+# if UINTPTR_MAX > UINT32_MAX
+    n |= n >> 32;
+# endif
+    n |= n >> 16;
+    n |= n >>  8;
+    n |= n >>  4;
+    n |= n >>  2;
+    n |= n >>  1;
+    return popcount(~n);
+#endif
+}
+
+static size_t
+bitset_clz(const struct bitset *bs)
+{
+    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
+    size_t size = bitset_size(bs);
+    size_t cnt = 0;
+
+    if (bs->summary) {
+        size_t i = bitset_summary_next_word(bs->summary, 0);
+        return i == SIZE_MAX ? size : i * BS_WORDBITS + count_nlz(bitset_word_live(bs, i));
+    }
+
+    for (int i = size / BS_WORDBITS; i > 0; i --, p ++) {
+        if (*p) {
+            return cnt + count_nlz(*p);
+        }
+
+        cnt += BS_WORDBITS;
+    }
+
+    size %= BS_WORDBITS;
+    if (size > 0) {
+        uintptr_t sh = BS_WORDBITS - size;
+        uintptr_t nn = *p >> sh << sh;
+        if (nn) {
+            cnt += count_nlz(nn);
+        } else {
+            cnt += size;
+        }
+    }
+
+    return cnt;
+}
+
+static mrb_value
+bs_clz(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_clz(get_bitset(mrb, self)));
+}
+
+static int
+count_ntz(uintptr_t n)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    if (!n) { return BS_WORDBITS; }
+
+# if UINTPTR_MAX > UINT32_MAX
+    return __builtin_ctzll(n);
+# else
+    return __builtin_ctz(n);
+# endif
+#else
+    return popcount((n & -n) - 1);
+#endif
+}
+
+static size_t
+bitset_ctz(const struct bitset *bs)
+{
+    size_t size = bitset_size(bs);
+
+    if (bs->summary) {
+        size_t i = bitset_summary_prev_word(bs->summary, SIZE_MAX);
+        if (i == SIZE_MAX) { return size; }
+        return size - (i + 1) * BS_WORDBITS + count_ntz(bitset_word_live(bs, i));
+    }
+
+    const uintptr_t *head = bs->is_embed ? bs->ary : bs->ptr;
+    const uintptr_t *p = head + unit_ceil(size, BS_WORDBITS) - 1;
+    size_t cnt = 0;
+    size_t rest = size % BS_WORDBITS;
+
+    if (rest > 0) {
+        uintptr_t sh = BS_WORDBITS - rest;
+        uintptr_t nn = *p >> sh;
+        if (nn) {
+            return count_ntz(nn);
+        } else {
+            cnt += rest;
+        }
+        size -= rest;
+        p --;
+    }
+
+    for (; p >= head; p --) {
+        if (*p) {
+            cnt += count_ntz(*p);
+            break;
+        }
+
+        cnt += BS_WORDBITS;
+    }
+
+    return cnt;
+}
+
+static mrb_value
+bs_ctz(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_ctz(get_bitset(mrb, self)));
+}
+
+/*
+ * [from, limit) の中で最初に現れる 1 ビット (invert が真であれば 0 ビット) の位置を返す。
+ * limit はビット長以下であること。見つからなければ SIZE_MAX を返す。
+ * 走査するのは from から見つかった位置 (または limit) までのワードだけ。
+ */
+static size_t
+bitset_next_within(const struct bitset *bs, size_t from, size_t limit, bool invert)
+{
+    if (from >= limit) { return SIZE_MAX; }
+
+    const uintptr_t *p = bitset_ptr_const(bs) + from / BS_WORDBITS;
+    const uintptr_t *end = bitset_ptr_const(bs) + unit_ceil(limit, BS_WORDBITS);
+    uintptr_t flip = invert ? (uintptr_t)-1 : 0;
+
+    /* 最初のワードは from より前のビットを落とす */
+    uintptr_t w = (*p ^ flip) & ((uintptr_t)-1 >> (from % BS_WORDBITS));
+
+    while (!w) {
+        if (++ p >= end) { return SIZE_MAX; }
+
+        if (!invert && bs->summary) {
+            /* 0 のワードは要約で読み飛ばす */
+            size_t i = bitset_summary_next_word(bs->summary, p - bitset_ptr_const(bs));
+            if (i == SIZE_MAX || bitset_ptr_const(bs) + i >= end) { return SIZE_MAX; }
+            p = bitset_ptr_const(bs) + i;
+        }
+
+        w = *p ^ flip;
+    }
+
+    size_t index = (p - bitset_ptr_const(bs)) * BS_WORDBITS + count_nlz(w);
+
+    /* 末尾のワードの余りのビットは不定なので、limit を超えたら見つからなかったものとする */
+    return index < limit ? index : SIZE_MAX;
+}
+
+/*
+ * from 以降 (from を含む) で最初に現れる 1 ビット (invert が真であれば 0 ビット) の位置を返す。
+ * 見つからなければ SIZE_MAX を返す。
+ */
+static size_t
+bitset_next(const struct bitset *bs, size_t from, bool invert)
+{
+    return bitset_next_within(bs, from, bitset_size(bs), invert);
+}
+
+/*
+ * from 以前 (from を含む) で最後に現れる 1 ビット (invert が真であれば 0 ビット) の位置を返す。
+ * from がビット長を超える場合は末尾から探す。見つからなければ SIZE_MAX を返す。
+ */
+static size_t
+bitset_prev(const struct bitset *bs, size_t from, bool invert)
+{
+    size_t size = bitset_size(bs);
+    if (size == 0) { return SIZE_MAX; }
+    if (from >= size) { from = size - 1; }
+
+    const uintptr_t *head = bitset_ptr_const(bs);
+    const uintptr_t *p = head + from / BS_WORDBITS;
+    uintptr_t flip = invert ? (uintptr_t)-1 : 0;
+
+    /* 最初のワードは from より後ろのビットを落とす */
+    uintptr_t w = (*p ^ flip) & ((uintptr_t)-1 << (BS_WORDBITS - 1 - from % BS_WORDBITS));
+
+    while (!w) {
+        if (p == head) { return SIZE_MAX; }
+
+        if (!invert && bs->summary) {
+            size_t i = bitset_summary_prev_word(bs->summary, p - head - 1);
+            if (i == SIZE_MAX) { return SIZE_MAX; }
+            p = head + i;
+            w = *p;
+        } else {
+            w = *-- p ^ flip;
+        }
+    }
+
+    return (p - head) * BS_WORDBITS + (BS_WORDBITS - 1 - count_ntz(w));
+}
+
+static mrb_value
+aux_find_bit(mrb_state *mrb, mrb_value self, bool forward, bool invert)
+{
+    mrb_int from = forward ? 0 : -1;
+    mrb_get_args(mrb, "|i", &from);
+    BS_STATS_CALL(mrb, self);
+
+    const struct bitset *bs = get_bitset(mrb, self);
+    size_t index;
+
+    if (from < 0) {
+        if (from + (mrb_int)bitset_size(bs) < 0) { return mrb_nil_value(); }
+        from += bitset_size(bs);
+    }
+
+    if (forward) {
+        index = bitset_next(bs, from, invert);
+    } else {
+        index = bitset_prev(bs, from, invert);
+    }
+
+    return index == SIZE_MAX ? mrb_nil_value() : mrb_fixnum_value(index);
+}
+
+/*
+ * call-seq:
+ *  next_one(from = 0) -> index or nil
+ *  next_zero(from = 0) -> index or nil
+ *  prev_one(from = -1) -> index or nil
+ *  prev_zero(from = -1) -> index or nil
+ *
+ * from 以降 (prev_* であれば以前) で最初に見つかった 1 (または 0) のビット位置を返す。
+ * from 自身も含む。見つからなければ nil を返す。
+ */
+static mrb_value
+bs_next_one(mrb_state *mrb, mrb_value self)
+{
+    return aux_find_bit(mrb, self, true, false);
+}
+
+static mrb_value
+bs_next_zero(mrb_state *mrb, mrb_value self)
+{
+    return aux_find_bit(mrb, self, true, true);
+}
+
+static mrb_value
+bs_prev_one(mrb_state *mrb, mrb_value self)
+{
+    return aux_find_bit(mrb, self, false, false);
+}
+
+static mrb_value
+bs_prev_zero(mrb_state *mrb, mrb_value self)
+{
+    return aux_find_bit(mrb, self, false, true);
+}
+
+static int
+fold_parity(uintptr_t n)
+{
+#if UINTPTR_MAX > UINT32_MAX
+    n ^= n >> 32;
+#endif
+    n ^= n >> 16;
+    n ^= n >>  8;
+    n ^= n >>  4;
+    n ^= n >>  2;
+    n ^= n >>  1;
+    return n & 1;
+}
+
+static int
+bitset_parity(const struct bitset *bs)
+{
+    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
+    size_t size = bitset_size(bs);
+    uintptr_t total = 0;
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        total ^= *p;
+    }
+
+    if (size > 0) {
+        /* 下位ビットを無効化するために右シフト */
+        total ^= *p >> (BS_WORDBITS - size);
+    }
+
+    return fold_parity(total);
+}
+
+static mrb_value
+bs_parity(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_parity(get_bitset(mrb, self)));
+}
+
+static bool
+bitset_all(const struct bitset *bs)
+{
+    if (bs->is_tracked) { return bs->popcount == bitset_size(bs); }
+
+    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
+    size_t size = bitset_size(bs);
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        if (~*p) { return false; }
+    }
+
+    if (size > 0) {
+        if (~((intptr_t)*p >> (BS_WORDBITS - size))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static mrb_value
+bs_all(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(bitset_all(get_bitset(mrb, self)));
+}
+
+static bool
+bitset_any(const struct bitset *bs)
+{
+    if (bs->is_tracked) { return bs->popcount > 0; }
+    if (bs->summary) { return bitset_summary_any(bs->summary); }
+
+    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
+    size_t size = bitset_size(bs);
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        if (*p) { return true; }
+    }
+
+    if (size > 0) {
+        if ((*p >> (BS_WORDBITS - size)) > 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static mrb_value
+bs_any(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(bitset_any(get_bitset(mrb, self)));
+}
+
+static bool
+bitset_none(const struct bitset *bs)
+{
+    if (bs->is_tracked) { return bs->popcount == 0; }
+    if (bs->summary) { return !bitset_summary_any(bs->summary); }
+
+    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
+    size_t size = bitset_size(bs);
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        if (*p) { return false; }
+    }
+
+    if (size > 0) {
+        if ((*p >> (BS_WORDBITS - size)) > 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static mrb_value
+bs_none(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(bitset_none(get_bitset(mrb, self)));
+}
+
+static bool
+bitset_equal(const struct bitset *a, const struct bitset *b)
+{
+    size_t size = bitset_size(a);
+    if (size != bitset_size(b)) { return false; }
+    if (a == b) { return true; }
+    if (a->has_hash && b->has_hash && a->hash != b->hash) { return false; }
+
+    const uintptr_t *p = bitset_ptr_const(a);
+    const uintptr_t *q = bitset_ptr_const(b);
+
+    /* ワード単位の比較は memcmp に任せる (libc の実装はベクトル化されている) */
+    size_t words = size / BS_WORDBITS;
+    if (memcmp(p, q, words * sizeof(uintptr_t)) != 0) { return false; }
+
+    size %= BS_WORDBITS;
+
+    if (size > 0) {
+        size_t pad = BS_WORDBITS - size;
+        if ((p[words] >> pad) != (q[words] >> pad)) { return false; }
+    }
+
+    return true;
+}
+
+/*
+ * MSB を最上位とする符号なし整数とみなして n と比較する。
+ */
+static bool
+bitset_equal_integer(const struct bitset *bs, mrb_int n)
+{
+    if (n < 0) { return false; }
+
+    size_t size = bitset_size(bs);
+    int width = size < 8 * sizeof(mrb_int) ? size : 8 * sizeof(mrb_int);
+    size_t high = size - width;
+
+    if (width < (int)(8 * sizeof(mrb_int)) && ((uint64_t)n >> width) != 0) { return false; }
+    if (high > 0 && bitset_popcount_range(bs, 0, high) != 0) { return false; }
+
+    uint64_t m = 0;
+    for (size_t i = high; i < size; ) {
+        int w = size - i < BS_WORDBITS ? size - i : BS_WORDBITS;
+        m = (m << (w - 1) << 1) | bitset_peek(bs, i, w);
+        i += w;
+    }
+
+    return m == (uint64_t)n;
+}
+
+/*
+ * Bitset.new(str) と同じ規則で文字列を解釈して比較する。
+ */
+static bool
+bitset_equal_bit_string(const struct bitset *bs, const char *str, size_t len)
+{
+    size_t size = bitset_size(bs);
+    size_t i = 0;
+
+    for (; len > 0; len --, str ++) {
+        switch (*str) {
+        case '0': case '1':
+            if (i >= size || bitset_peek(bs, i, 1) != (uintptr_t)(*str - '0')) { return false; }
+            i ++;
+            break;
+        case ' ': case '_': case '.': case '-': case ':':
+            break;
+        default:
+            len = 1; /* for ループから脱出 */
+            break;
+        }
+    }
+
+    return i == size;
+}
+
+static mrb_value
+bs_eql(mrb_state *mrb, mrb_value self)
+{
+    mrb_value other;
+    mrb_get_args(mrb, "o", &other);
+    BS_STATS_CALL(mrb, self);
+    struct bitset *bs = get_bitset(mrb, self);
+
+    if (mrb_type(other) != MRB_TT_DATA || DATA_TYPE(other) != &bitset_type) { return mrb_false_value(); }
+
+    return mrb_bool_value(bitset_equal(bs, get_bitset(mrb, other)));
+}
+
+/*
+ * call-seq:
+ *  bitset == other_bitset -> true or false
+ *  bitset == integer -> true or false
+ *  bitset == bit_string -> true or false
+ *
+ * integer は符号なし整数としてビット列の値と比較する (ビット長は問わない)。
+ * bit_string は Bitset.new(bit_string) と同じ規則で解釈して比較する。
+ * いずれも Bitset オブジェクトへ変換せずに比較する。
+ */
+static mrb_value
+bs_equal(mrb_state *mrb, mrb_value self)
+{
+    mrb_value other;
+    mrb_get_args(mrb, "o", &other);
+    BS_STATS_CALL(mrb, self);
+    struct bitset *bs = get_bitset(mrb, self);
+
+    switch (mrb_type(other)) {
+    case MRB_TT_FIXNUM:
+        return mrb_bool_value(bitset_equal_integer(bs, mrb_fixnum(other)));
+    case MRB_TT_STRING:
+        return mrb_bool_value(bitset_equal_bit_string(bs, RSTRING_PTR(other), RSTRING_LEN(other)));
+    case MRB_TT_DATA:
+        if (DATA_TYPE(other) == &bitset_type) {
+            return mrb_bool_value(bitset_equal(bs, get_bitset(mrb, other)));
+        }
+        /* fall through */
+    default:
+        return mrb_false_value();
+    }
+}
+
+/*
+ * MSB から順に比較する (辞書順)。一方が他方の先頭部分と一致する場合は、短い方が小さい。
+ *
+ * ワードは上位ビットに詰めて格納しているため、
+ * 最初に異なるワードを整数として比較するだけで最初に異なるビットの大小が決まる。
+ */
+static int
+bitset_compare(const struct bitset *a, const struct bitset *b)
+{
+    size_t size1 = bitset_size(a);
+    size_t size2 = bitset_size(b);
+    size_t size = size1 < size2 ? size1 : size2;
+    const uintptr_t *p = bitset_ptr_const(a);
+    const uintptr_t *q = bitset_ptr_const(b);
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++, q ++) {
+        if (*p != *q) { return *p < *q ? -1 : 1; }
+    }
+
+    if (size > 0) {
+        int pad = BS_WORDBITS - size;
+        uintptr_t n1 = *p >> pad;
+        uintptr_t n2 = *q >> pad;
+        if (n1 != n2) { return n1 < n2 ? -1 : 1; }
+    }
+
+    return size1 < size2 ? -1 : (size1 > size2 ? 1 : 0);
+}
+
+static size_t bitset_clz(const struct bitset *bs);
+
+/*
+ * LSB を揃えた符号なし整数として比較する。
+ */
+static int
+bitset_compare_numeric(const struct bitset *a, const struct bitset *b)
+{
+    size_t off1 = bitset_clz(a);
+    size_t off2 = bitset_clz(b);
+    size_t len1 = bitset_size(a) - off1;
+    size_t len2 = bitset_size(b) - off2;
+
+    if (len1 != len2) { return len1 < len2 ? -1 : 1; }
+
+    for (; len1 > 0; ) {
+        int w = len1 < BS_WORDBITS ? len1 : BS_WORDBITS;
+        uintptr_t n1 = bitset_peek(a, off1, w);
+        uintptr_t n2 = bitset_peek(b, off2, w);
+        if (n1 != n2) { return n1 < n2 ? -1 : 1; }
+        off1 += w;
+        off2 += w;
+        len1 -= w;
+    }
+
+    return 0;
+}
+
+/*
+ * call-seq:
+ *  bitset <=> other -> -1, 0, 1 or nil
+ *
+ * MSB から順に辞書順で比較する。
+ */
+static mrb_value
+bs_cmp(mrb_state *mrb, mrb_value self)
+{
+    mrb_value other;
+    mrb_get_args(mrb, "o", &other);
+    BS_STATS_CALL(mrb, self);
+    struct bitset *bs = get_bitset(mrb, self);
+
+    if (mrb_type(other) != MRB_TT_DATA || DATA_TYPE(other) != &bitset_type) { return mrb_nil_value(); }
+
+    return mrb_fixnum_value(bitset_compare(bs, get_bitset(mrb, other)));
+}
+
+/*
+ * call-seq:
+ *  cmp_numeric(other) -> -1, 0 or 1
+ *
+ * LSB を揃えて符号なし整数として比較する。上位の 0 ビットは無視される。
+ */
+static mrb_value
+bs_cmp_numeric(mrb_state *mrb, mrb_value self)
+{
+    const struct bitset *other;
+    mrb_get_args(mrb, "d", &other, &bitset_type);
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_compare_numeric(get_bitset(mrb, self), other));
+}
+
+#ifdef MRUBY_BITSET_FAST_HASH
+static mrb_int
+bitset_hash(const struct bitset *bs)
+{
+    /*
+     * CRC ではなく、乗算と排他的論理和による 64 ビットハッシュ値を算出する。
+     * 最後の攪拌は MurmurHash3 の fmix64 と同じ。
+     */
+
+    size_t size = bitset_size(bs);
+    const uintptr_t *p = bitset_ptr_const(bs);
+    uint64_t h = UINT64_C(0x9e3779b97f4a7c15) ^ size;
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        h = (h ^ *p) * UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 32;
+    }
+
+    if (size > 0) {
+        int pad = BS_WORDBITS - size;
+        h = (h ^ (*p >> pad << pad)) * UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 32;
+    }
+
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+
+    return (mrb_int)h;
+}
+#else
+# if MRB_INT_MAX > INT32_MAX
+typedef uint64_t crc_t;
+#  define CRC_POLY UINT64_C(0x42f0e1eba9ea3693)
+# else
+typedef uint32_t crc_t;
+#  define CRC_POLY UINT32_C(0x1edc6f41)
+# endif
+
+# define CRC_BITS (8 * sizeof(crc_t))
+
+/*
+ * スライシング・バイ・エイト (slicing-by-8) のためのテーブル
+ *
+ * crc_table[k][n] は 1 バイト n の後に k バイトの 0 を続けた時の CRC 値。
+ * 16 KiB (32 ビット CRC の場合は 8 KiB) にもなるため、ソースコードには埋め込まずに
+ * mrb_mruby_bitset_gem_init() で構築する。
+ */
+static crc_t crc_table[8][256];
+
+static void
+crc_table_init(void)
+{
+    if (crc_table[7][1] != 0) { return; }
+
+    for (int i = 0; i < 256; i ++) {
+        crc_t n = (crc_t)i << (CRC_BITS - 8);
+        for (int j = 8; j > 0; j --) {
+            n = (n << 1) ^ ((n >> (CRC_BITS - 1)) ? CRC_POLY : 0);
+        }
+        crc_table[0][i] = n;
+    }
+
+    for (int k = 1; k < 8; k ++) {
+        for (int i = 0; i < 256; i ++) {
+            crc_t n = crc_table[k - 1][i];
+            crc_table[k][i] = (n << 8) ^ crc_table[0][n >> (CRC_BITS - 8)];
+        }
+    }
+}
+
+MRBX_FORCE_INLINE crc_t
+crc_update_bits(crc_t crc, uintptr_t n, int bits)
+{
+    /* n の上位 bits ビットを処理する */
+
+    for (; bits >= 8; bits -= 8, n <<= 8) {
+        crc = (crc << 8) ^ crc_table[0][(uint8_t)((crc >> (CRC_BITS - 8)) ^ (n >> (BS_WORDBITS - 8)))];
+    }
+
+    for (; bits > 0; bits --, n <<= 1) {
+        crc = (crc << 1) ^ ((((crc >> (CRC_BITS - 1)) ^ (n >> (BS_WORDBITS - 1))) & 1) ? CRC_POLY : 0);
+    }
+
+    return crc;
+}
+
+MRBX_FORCE_INLINE crc_t
+crc_update32(crc_t crc, uint32_t n)
+{
+    crc ^= (crc_t)n << (CRC_BITS - 32);
+    crc_t x = crc >> (CRC_BITS - 32);
+    return (crc << 16 << 16) ^
+           crc_table[3][(uint8_t)(x >> 24)] ^ crc_table[2][(uint8_t)(x >> 16)] ^
+           crc_table[1][(uint8_t)(x >>  8)] ^ crc_table[0][(uint8_t)(x      )];
+}
+
+MRBX_FORCE_INLINE crc_t
+crc_update_word(crc_t crc, uintptr_t n)
+{
+# if UINTPTR_MAX > UINT32_MAX
+#  if MRB_INT_MAX > INT32_MAX
+    crc ^= n;
+    return crc_table[7][(uint8_t)(crc >> 56)] ^ crc_table[6][(uint8_t)(crc >> 48)] ^
+           crc_table[5][(uint8_t)(crc >> 40)] ^ crc_table[4][(uint8_t)(crc >> 32)] ^
+           crc_table[3][(uint8_t)(crc >> 24)] ^ crc_table[2][(uint8_t)(crc >> 16)] ^
+           crc_table[1][(uint8_t)(crc >>  8)] ^ crc_table[0][(uint8_t)(crc      )];
+#  else
+    return crc_update32(crc_update32(crc, n >> 32), n);
+#  endif
+# else
+    return crc_update32(crc, n);
+# endif
+}
+
+# if MRB_INT_MAX <= INT32_MAX && defined(__SSE4_2__)
+#  include <nmmintrin.h>
+#  define BITSET_HASH_SSE42 1
+
+/*
+ * SSE4.2 の crc32 命令は CRC-32C (0x1edc6f41) をビット右送りで処理する。
+ * ワードをビット反転して与えると左送りの入力と同じ順序になり、
+ * 得られた内部状態をビット反転すると左送りの内部状態と一致する。
+ */
+static crc_t
+crc_update_words_sse42(crc_t crc, const uintptr_t *p, size_t words)
+{
+#  if UINTPTR_MAX > UINT32_MAX
+    uint64_t r = bitreflect(crc) >> 32;
+    for (; words > 0; words --, p ++) {
+        r = _mm_crc32_u64(r, bitreflect(*p));
+    }
+    return bitreflect(r) >> 32;
+#  else
+    uint32_t r = bitreflect(crc);
+    for (; words > 0; words --, p ++) {
+        r = _mm_crc32_u32(r, bitreflect(*p));
+    }
+    return bitreflect(r);
+#  endif
+}
+# endif
+
+static mrb_int
+bitset_hash(const struct bitset *bs)
+{
+    size_t size = bitset_size(bs);
+    const uintptr_t *p = bitset_ptr_const(bs);
+    crc_t crc = -1;
+
+# ifdef BITSET_HASH_SSE42
+    crc = crc_update_words_sse42(crc, p, size / BS_WORDBITS);
+    p += size / BS_WORDBITS;
+    size %= BS_WORDBITS;
+# else
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        crc = crc_update_word(crc, *p);
+    }
+# endif
+
+    if (size > 0) {
+        int pad = BS_WORDBITS - size;
+        crc = crc_update_bits(crc, *p >> pad << pad, size);
+    }
+
+# ifdef MRB_INT16
+    return ~crc >> 8;
+# else
+    return ~crc;
+# endif
+}
+#endif
+
+static mrb_int
+bitset_hash_cached(struct bitset *bs)
+{
+    /* 借り物の行は行列の側から書き換えられるため、覚えておかない */
+    if (bs->is_borrowed) { return bitset_hash(bs); }
+
+    if (!bs->has_hash) {
+        bs->hash = bitset_hash(bs);
+        bs->has_hash = 1;
+    }
+
+    return bs->hash;
+}
+
+MRB_API mrb_int
+mruby_bitset_hash(mrb_state *mrb, mrb_value bitset)
+{
+    return bitset_hash_cached(get_bitset(mrb, bitset));
+}
+
+/*
+ * 32ビット CRC (0x1edc6f41) あるいは 64ビット CRC (0x42f0e1eba9ea3693) による算出を行う。
+ * ビットは左送り (CRC-32-MPEG-2 や CRC-64-ECMA のように)。0 を後置する (“appends n 0-bits”)。
+ * 初期値 (内部状態の値) は -1 で、出力時に -1 で 排他的論理和を取る。
+ * ワード単位は 8 段テーブル (slicing-by-8) で、端数はバイト単位・ビット単位で処理する。
+ * 32ビット CRC かつ SSE4.2 が有効な場合は、ワード単位の処理に crc32 命令を用いる。
+ * MRB_INT16 の場合は、32ビット CRC 値を算出し、8ビット右シフトして下位16ビットを取り出した値が使われる。
+ *
+ * MRUBY_BITSET_FAST_HASH を定義してビルドした場合は、CRC ではなく乗算による 64 ビットハッシュ値となる。
+ *
+ * 算出した値はオブジェクトにキャッシュされ、ビット列を変更するメソッドによって破棄される。
+ */
+static mrb_value
+bs_hash(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(mruby_bitset_hash(mrb, self));
+}
+
+/*
+ * TODO: bitset_digest/bitset_hexdigest/bitset_bindigest を共通化する
+ */
+
+static struct RString *
+bitset_digest_common(mrb_state *mrb, const struct bitset *bs, int slicesize, int func(int, void *), void *opaque)
+{
+    size_t size = bitset_size(bs);
+    if (size == 0) { return RSTRING(mrb_str_new(mrb, NULL, 0)); }
+
+    const uintptr_t *p = bitset_ptr_const(bs);
+    struct RString *digest = RSTRING(mrb_str_new(mrb, NULL, unit_ceil(size, slicesize)));
+    char *d = RSTR_PTR(digest);
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        uintptr_t n = *p;
+        for (int i = BS_WORDBITS / slicesize; i > 0; i --, d ++, n <<= slicesize) {
+            *d = func(n >> (BS_WORDBITS - slicesize), opaque);
+        }
+    }
+
+    if (size > 0) {
+        int pad = BS_WORDBITS - size;
+        uintptr_t n = *p >> pad << pad;
+        size += pad % slicesize; /* slicesize ビット境界を強制する */
+        for (; size > 0; size -= slicesize, d ++, n <<= slicesize) {
+            *d = func(n >> (BS_WORDBITS - slicesize), opaque);
+        }
+    }
+
+    return digest;
+}
+
+/*
+ * バイト内のビット順を反転する
+ */
+MRBX_FORCE_INLINE uintptr_t
+bitreflect_in_bytes(uintptr_t n)
+{
+#if UINTPTR_MAX > UINT32_MAX
+    n = ((n & 0x0f0f0f0f0f0f0f0fULL) <<  4) | ((n >>  4) & 0x0f0f0f0f0f0f0f0fULL);
+    n = ((n & 0x3333333333333333ULL) <<  2) | ((n >>  2) & 0x3333333333333333ULL);
+    n = ((n & 0x5555555555555555ULL) <<  1) | ((n >>  1) & 0x5555555555555555ULL);
+#else
+    n = ((n & 0x0f0f0f0fUL) <<  4) | ((n >>  4) & 0x0f0f0f0fUL);
+    n = ((n & 0x33333333UL) <<  2) | ((n >>  2) & 0x33333333UL);
+    n = ((n & 0x55555555UL) <<  1) | ((n >>  1) & 0x55555555UL);
+#endif
+    return n;
+}
+
+/*
+ * ビット列をバイト列として書き出す。
+ * lsb_first が真の場合は、各バイトの LSB から順にビットを詰める。
+ * 端数となる最後のバイトの下位ビット (lsb_first の場合は上位ビット) は 0 となる。
+ */
+static struct RString *
+bitset_to_bytes(mrb_state *mrb, const struct bitset *bs, bool lsb_first)
+{
+    size_t size = bitset_size(bs);
+    struct RString *str = RSTRING(mrb_str_new(mrb, NULL, unit_ceil(size, 8)));
+    uint8_t *d = (uint8_t *)RSTR_PTR(str);
+    const uintptr_t *p = bitset_ptr_const(bs);
+
+    if (lsb_first) {
+        for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++, d += sizeof(uintptr_t)) {
+            store_be(d, bitreflect_in_bytes(*p));
+        }
+    } else {
+        for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++, d += sizeof(uintptr_t)) {
+            store_be(d, *p);
+        }
+    }
+
+    if (size > 0) {
+        int pad = BS_WORDBITS - size;
+        uintptr_t n = *p >> pad << pad;
+        if (lsb_first) { n = bitreflect_in_bytes(n); }
+        for (size_t i = unit_ceil(size, 8); i > 0; i --, d ++, n <<= 8) {
+            *d = n >> (BS_WORDBITS - 8);
+        }
+    }
+
+    return str;
+}
+
+/*
+ * バイト列からビット列を読み込む。bitsize がバイト列より長い場合、残りは 0 となる。
+ */
+static void
+bitset_load_from_bytes(mrb_state *mrb, struct bitset *bs, const uint8_t *s, size_t len, size_t bitsize, bool lsb_first)
+{
+    bitset_reserve(mrb, bs, bitsize);
+    bitset_set_size(bs, bitsize);
+
+    uintptr_t *p = bitset_ptr(bs);
+    size_t words = unit_ceil(bitsize, BS_WORDBITS);
+
+    if (len > unit_ceil(bitsize, 8)) { len = unit_ceil(bitsize, 8); }
+
+    for (; len >= sizeof(uintptr_t); len -= sizeof(uintptr_t), s += sizeof(uintptr_t), p ++, words --) {
+        uintptr_t n = load_be(s);
+        *p = lsb_first ? bitreflect_in_bytes(n) : n;
+    }
+
+    if (words > 0) {
+        uintptr_t n = 0;
+        for (size_t i = 0; i < sizeof(uintptr_t); i ++) {
+            n = (n << 8) | (i < len ? s[i] : 0);
+        }
+        *p ++ = lsb_first ? bitreflect_in_bytes(n) : n;
+        words --;
+        memset(p, 0, words * sizeof(uintptr_t));
+    }
+
+    if (bitsize % BS_WORDBITS > 0) {
+        int pad = BS_WORDBITS - bitsize % BS_WORDBITS;
+        p = bitset_ptr(bs) + bitsize / BS_WORDBITS;
+        *p = *p >> pad << pad;
+    }
+}
+
+static bool
+aux_lsb_first_p(mrb_state *mrb, mrb_value opts)
+{
+    if (mrb_nil_p(opts)) { return false; }
+
+    mrb_value order = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "bit_order")));
+
+    if (mrb_nil_p(order) || (mrb_symbol_p(order) && mrb_symbol(order) == mrb_intern_lit(mrb, "msb"))) {
+        return false;
+    } else if (mrb_symbol_p(order) && mrb_symbol(order) == mrb_intern_lit(mrb, "lsb")) {
+        return true;
+    } else {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong bit_order (expect :msb or :lsb, but given %S)",
+                   mrb_inspect(mrb, order));
+        return false;
+    }
+}
+
+/*
+ * call-seq:
+ *  to_bytes(bit_order: :msb) -> string
+ *
+ * ビット列を先頭から 8 ビットずつバイトに詰めた文字列を返す。
+ * bit_order に :lsb を与えると、各バイトの LSB から順に詰める。
+ */
+static mrb_value
+bs_to_bytes(mrb_state *mrb, mrb_value self)
+{
+    mrb_value opts = mrb_nil_value();
+    mrb_get_args(mrb, "|H", &opts);
+    BS_STATS_CALL(mrb, self);
+    bool lsb_first = aux_lsb_first_p(mrb, opts);
+    return mrb_obj_value(bitset_to_bytes(mrb, get_bitset(mrb, self), lsb_first));
+}
+
+/*
+ * call-seq:
+ *  Bitset.from_bytes(string, bitsize = nil, bit_order: :msb) -> new bitset
+ *
+ * to_bytes の逆変換。bitsize を省略した場合は string.bytesize * 8 となる。
+ */
+static mrb_value
+bs_s_from_bytes(mrb_state *mrb, mrb_value klass)
+{
+    mrb_value str, bitsize = mrb_nil_value(), opts = mrb_nil_value();
+    mrb_get_args(mrb, "S|oH", &str, &bitsize, &opts);
+
+    if (mrb_hash_p(bitsize) && mrb_nil_p(opts)) {
+        opts = bitsize;
+        bitsize = mrb_nil_value();
+    }
+
+    bool lsb_first = aux_lsb_first_p(mrb, opts);
+    size_t len = RSTRING_LEN(str);
+    size_t size;
+
+    if (mrb_nil_p(bitsize)) {
+        size = len * 8;
+    } else {
+        mrb_int n = mrb_int(mrb, bitsize);
+        if (n < 0) { mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong negative bit size"); }
+        size = n;
+    }
+
+    struct bitset *bs;
+    mrb_value obj = bitset_new(mrb, mrb_class_ptr(klass), &bs);
+    bs->is_fixed = bitset_fixed_class_p(mrb, mrb_class_ptr(klass));
+    bitset_load_from_bytes(mrb, bs, (const uint8_t *)RSTRING_PTR(str), len, size, lsb_first);
+
+    return obj;
+}
+
+static struct RString *
+bitset_digest(mrb_state *mrb, const struct bitset *bs)
+{
+    return bitset_to_bytes(mrb, bs, false);
+}
+
+MRB_API struct RString *
+mruby_bitset_digest(mrb_state *mrb, mrb_value bitset)
+{
+    return bitset_digest(mrb, get_bitset(mrb, bitset));
+}
+
+static mrb_value
+bs_digest(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_obj_value(mruby_bitset_digest(mrb, self));
+}
+
+static int
+bitset_hexdigest_char(int code, void *opaque)
+{
+    static const char table[] = {
+        '0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+    };
+
+    return table[code];
+}
+
+static struct RString *
+bitset_hexdigest(mrb_state *mrb, const struct bitset *bs)
+{
+    return bitset_digest_common(mrb, bs, 4, bitset_hexdigest_char, NULL);
+}
+
+MRB_API struct RString *
+mruby_bitset_hexdigest(mrb_state *mrb, mrb_value bitset)
+{
+    return bitset_hexdigest(mrb, get_bitset(mrb, bitset));
+}
+
+static mrb_value
+bs_hexdigest(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_obj_value(mruby_bitset_hexdigest(mrb, self));
+}
+
+static struct RString *
+bitset_bindigest(mrb_state *mrb, const struct bitset *bs)
+{
+    size_t size = bitset_size(bs);
+    if (size == 0) { return RSTRING(mrb_str_new(mrb, NULL, 0)); }
+
+    const uintptr_t *head = bitset_ptr_const(bs);
+    const uintptr_t *p = head;
+    const size_t space8  = (size - 1) /  8; /* 8 ビットごとの区切り */
+    const size_t space32 = (size - 1) / 32; /* 32 ビットごとの区切り */
+    struct RString *digest = RSTRING(mrb_str_new(mrb, NULL, size + space8 + space32));
+    char *d = RSTR_PTR(digest);
+
+    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
+        uintptr_t n = *p;
+        for (int i = BS_WORDBITS; i > 0; i --, d ++, n <<= 1) {
+            if (i != BS_WORDBITS) {
+                if (i % 8 == 0) { *d ++ = ' '; }
+                if (i % 32 == 0) { *d ++ = ' '; }
+            }
+            *d = '0' + (n >> (BS_WORDBITS - 1));
+        }
+
+        if (size > 0) {
+            *d ++ = ' ';
+            *d ++ = ' ';
+        }
+    }
+
+    if (size > 0) {
+        int pad = BS_WORDBITS - size;
+        uintptr_t n = *p >> pad << pad;
+
+        for (int i = BS_WORDBITS; i > pad; i --, d ++, n <<= 1) {
+            if (i != BS_WORDBITS) {
+                if (i % 8 == 0) { *d ++ = ' '; }
+                if (i % 32 == 0) { *d ++ = ' '; }
+            }
+            *d = '0' + (n >> (BS_WORDBITS - 1));
+        }
+    }
+
+    return digest;
+}
+
+MRB_API struct RString *
+mruby_bitset_bindigest(mrb_state *mrb, mrb_value bitset)
+{
+    return bitset_bindigest(mrb, get_bitset(mrb, bitset));
+}
+
+static mrb_value
+bs_bindigest(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_obj_value(mruby_bitset_bindigest(mrb, self));
+}
+
+/*
+ * 書き出しの逐次化
+ *
+ * write_hex / write_bin / write_raw / each_hex_chunk は、ワードごとに符号化した文字を固定長の
+ * バッファに溜め、満杯になる度に io.write (またはブロック) へ渡す。ビット長に関わらず、
+ * 使うメモリはバッファと、渡す度に作る同じ大きさの文字列だけとなる。
+ *
+ * 書き出しの途中で io やブロックがビット列を書き換えても壊れないように、ワードは毎回
+ * 位置から読み直し、書き出し始めたビット長を超えた部分は 0 とみなす。
+ */
+
+#define BS_STREAM_BUFSIZE   8192
+
+struct bitset_stream
+{
+    mrb_value target;   /* io またはブロック */
+    bool yield;         /* 真であれば target をブロックとして呼ぶ */
+    char *buf;
+    size_t len;
+    size_t capa;
+    size_t total;       /* 渡し終えたバイト数 */
+};
+
+static void
+bitset_stream_flush(mrb_state *mrb, struct bitset_stream *st)
+{
+    if (st->len == 0) { return; }
+
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value chunk = mrb_str_new(mrb, st->buf, st->len);
+
+    if (st->yield) {
+        mrb_yield(mrb, st->target, chunk);
+    } else {
+        mrb_funcall(mrb, st->target, "write", 1, chunk);
+    }
+
+    mrb_gc_arena_restore(mrb, ai);
+    st->total += st->len;
+    st->len = 0;
+}
+
+static void
+bitset_stream_put(mrb_state *mrb, struct bitset_stream *st, const char *s, size_t n)
+{
+    while (n > 0) {
+        size_t c = st->capa - st->len;
+        if (c > n) { c = n; }
+        memcpy(st->buf + st->len, s, c);
+        st->len += c;
+        s += c;
+        n -= c;
+        if (st->len == st->capa) { bitset_stream_flush(mrb, st); }
+    }
+}
+
+enum bitset_stream_format { BS_STREAM_HEX, BS_STREAM_BIN, BS_STREAM_RAW, BS_STREAM_RAW_LSB };
+
+/*
+ * ビット列を format で符号化しながら st へ書き出す。
+ * 書式は hexdigest / bindigest / to_bytes と同じ。
+ */
+static void
+bitset_stream_write(mrb_state *mrb, const struct bitset *bs, enum bitset_stream_format format, struct bitset_stream *st)
+{
+    static const char hex[] = "0123456789abcdef";
+    /* 1 ワードの 2 進表記は区切りを含めても 2 * BS_WORDBITS 文字に収まる */
+    char tmp[2 * BS_WORDBITS];
+    size_t size = bitset_size(bs);
+    size_t words = unit_ceil(size, BS_WORDBITS);
+
+    for (size_t j = 0; j < words; j ++) {
+        uintptr_t n = aux_word_at(bitset_ptr_const(bs), bitset_size(bs) < size ? bitset_size(bs) : size, j);
+        size_t base = j * BS_WORDBITS;
+        int c = size - base < BS_WORDBITS ? (int)(size - base) : BS_WORDBITS;
+        char *d = tmp;
+
+        switch (format) {
+        case BS_STREAM_HEX:
+            for (int i = unit_ceil(c, 4); i > 0; i --, n <<= 4) {
+                *d ++ = hex[n >> (BS_WORDBITS - 4)];
+            }
+            break;
+        case BS_STREAM_BIN:
+            for (int i = 0; i < c; i ++, n <<= 1) {
+                size_t k = base + i;
+                if (k > 0 && k % 8 == 0) {
+                    *d ++ = ' ';
+                    if (k % 32 == 0) { *d ++ = ' '; }
+                }
+                *d ++ = '0' + (n >> (BS_WORDBITS - 1));
+            }
+            break;
+        default:
+            if (format == BS_STREAM_RAW_LSB) { n = bitreflect_in_bytes(n); }
+            for (int i = unit_ceil(c, 8); i > 0; i --, n <<= 8) {
+                *d ++ = n >> (BS_WORDBITS - 8);
+            }
+            break;
+        }
+
+        bitset_stream_put(mrb, st, tmp, d - tmp);
+    }
+
+    bitset_stream_flush(mrb, st);
+}
+
+static mrb_value
+aux_stream_to_io(mrb_state *mrb, mrb_value self, mrb_value io, enum bitset_stream_format format)
+{
+    const struct bitset *bs = get_bitset(mrb, self);
+    mrb_value buf = mrb_str_new(mrb, NULL, BS_STREAM_BUFSIZE);
+    struct bitset_stream st = { io, false, RSTRING_PTR(buf), 0, BS_STREAM_BUFSIZE, 0 };
+
+    bitset_stream_write(mrb, bs, format, &st);
+
+    return mrb_fixnum_value(st.total);
+}
+
+/*
+ * call-seq:
+ *  write_hex(io) -> integer
+ *  write_bin(io) -> integer
+ *  write_raw(io, bit_order: :msb) -> integer
+ *
+ * hexdigest / bindigest / to_bytes と同じ内容を、全体の文字列を作らずに io.write で少しずつ書き出す。
+ * 書き出したバイト数を返す。
+ */
+static mrb_value
+bs_write_hex(mrb_state *mrb, mrb_value self)
+{
+    mrb_value io;
+    mrb_get_args(mrb, "o", &io);
+    BS_STATS_CALL(mrb, self);
+    return aux_stream_to_io(mrb, self, io, BS_STREAM_HEX);
+}
+
+static mrb_value
+bs_write_bin(mrb_state *mrb, mrb_value self)
+{
+    mrb_value io;
+    mrb_get_args(mrb, "o", &io);
+    BS_STATS_CALL(mrb, self);
+    return aux_stream_to_io(mrb, self, io, BS_STREAM_BIN);
+}
+
+static mrb_value
+bs_write_raw(mrb_state *mrb, mrb_value self)
+{
+    mrb_value io, opts = mrb_nil_value();
+    mrb_get_args(mrb, "o|H", &io, &opts);
+    BS_STATS_CALL(mrb, self);
+    bool lsb_first = aux_lsb_first_p(mrb, opts);
+    return aux_stream_to_io(mrb, self, io, lsb_first ? BS_STREAM_RAW_LSB : BS_STREAM_RAW);
+}
+
+/*
+ * call-seq:
+ *  each_hex_chunk(bytes = 8192) { |chunk| ... } -> self
+ *  each_hex_chunk(bytes = 8192) -> enumerator
+ *
+ * hexdigest を bytes 文字ずつに区切って順に渡す。最後の区切りは短くなることがある。
+ */
+static mrb_value
+bs_each_hex_chunk(mrb_state *mrb, mrb_value self)
+{
+    mrb_int bytes = BS_STREAM_BUFSIZE;
+    mrb_value block = mrb_nil_value();
+    mrb_get_args(mrb, "|i&", &bytes, &block);
+    BS_STATS_CALL(mrb, self);
+
+    if (bytes < 1) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong chunk size - %S", mrb_fixnum_value(bytes));
+    }
+
+    if (mrb_nil_p(block)) {
+        return mrb_funcall(mrb, self, "to_enum", 2,
+                           mrb_symbol_value(mrb_intern_lit(mrb, "each_hex_chunk")),
+                           mrb_fixnum_value(bytes));
+    }
+
+    const struct bitset *bs = get_bitset(mrb, self);
+    mrb_value buf = mrb_str_new(mrb, NULL, bytes);
+    struct bitset_stream st = { block, true, RSTRING_PTR(buf), 0, bytes, 0 };
+
+    bitset_stream_write(mrb, bs, BS_STREAM_HEX, &st);
+
+    return self;
+}
+
+/*
+ * Bitset::Allocator
+ *
+ * ビット列を資源の使用状況 (1 が使用中、0 が空き) とみなして、連続した空きを割り当てる。
+ * BS_ALLOC_SUPERBITS ビットごとの区画 (スーパーブロック) について、空きの数と
+ * 先頭・末尾・区画内で最長の空きの長さを要約として持つ。
+ * 探索は要約だけを見て、要求を満たさない区画のワードには触れずに読み飛ばす。
+ * 要約は割り当てと解放の度に、書き換えた区画の分だけ作り直す。
+ */
+
+#define BS_ALLOC_SUPERWORDS 64
+#define BS_ALLOC_SUPERBITS  (BS_ALLOC_SUPERWORDS * BS_WORDBITS)
+
+enum bitset_alloc_policy { BS_ALLOC_FIRST_FIT, BS_ALLOC_NEXT_FIT, BS_ALLOC_BEST_FIT };
+
+static const char *const bitset_alloc_policy_names[] = { "first_fit", "next_fit", "best_fit" };
+
+struct bitset_super
+{
+    uint32_t free;                  /* 空きビットの数 */
+    uint32_t head;                  /* 区画の先頭から続く空きの長さ */
+    uint32_t tail;                  /* 区画の末尾まで続く空きの長さ */
+    uint32_t max;                   /* 区画内で最長の空きの長さ */
+};
+
+struct bitset_allocator
+{
+    struct bitset bits;
+    struct bitset_super *summary;
+    size_t nsuper;
+    size_t used;                    /* 使用中のビットの数 */
+    size_t cursor;                  /* next_fit の探索開始位置 */
+    enum bitset_alloc_policy policy;
+};
+
+static void
+bitset_allocator_free(mrb_state *mrb, void *ptr)
+{
+    if (ptr) {
+        struct bitset_allocator *p = (struct bitset_allocator *)ptr;
+        if (!p->bits.is_embed && p->bits.ptr) {
+            mrb_free(mrb, p->bits.ptr);
+        }
+        mrb_free(mrb, p->summary);
+        memset(p, 0, sizeof(*p));
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type bitset_allocator_type = { "Bitset::Allocator@mruby-bitset", bitset_allocator_free };
+
+static struct bitset_allocator *
+get_allocator(mrb_state *mrb, mrb_value self)
+{
+    struct bitset_allocator *p = (struct bitset_allocator *)mrb_data_get_ptr(mrb, self, &bitset_allocator_type);
+
+    if (!p) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "not initialized - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    return p;
+}
+
+static struct bitset_allocator *
+get_allocator_for_modify(mrb_state *mrb, mrb_value self)
+{
+    mrbx_obj_modify(mrb, self);
+    return get_allocator(mrb, self);
+}
+
+static inline size_t
+bitset_super_bits(const struct bitset_allocator *a, size_t sb)
+{
+    size_t rest = bitset_size(&a->bits) - sb * BS_ALLOC_SUPERBITS;
+    return rest < BS_ALLOC_SUPERBITS ? rest : BS_ALLOC_SUPERBITS;
+}
+
+/*
+ * 区画 sb の要約を作り直す。
+ */
+static void
+bitset_alloc_summarize(struct bitset_allocator *a, size_t sb)
+{
+    size_t bits = bitset_super_bits(a, sb);
+    const uintptr_t *p = bitset_ptr_const(&a->bits) + sb * BS_ALLOC_SUPERWORDS;
+    size_t run = 0, head = 0, max = 0, used = 0;
+    bool closed = false;
+
+    for (; bits > 0; p ++) {
+        int n = bits < BS_WORDBITS ? bits : BS_WORDBITS;
+        uintptr_t w = *p & ~getmask(BS_WORDBITS - n);
+        bits -= n;
+
+        if (w == 0) {
+            run += n;
+            continue;
+        }
+
+        used += popcount(w);
+
+        while (n > 0) {
+            int z = count_nlz(w);
+            if (z >= n) { run += n; break; }
+
+            run += z;
+            if (!closed) { head = run; closed = true; }
+            if (run > max) { max = run; }
+            run = 0;
+            w <<= z;
+            n -= z;
+
+            int o = count_nlz(~w);
+            if (o >= n) { break; }
+            w <<= o;
+            n -= o;
+        }
+    }
+
+    if (!closed) { head = run; }
+    if (run > max) { max = run; }
+
+    struct bitset_super *s = &a->summary[sb];
+    s->free = bitset_super_bits(a, sb) - used;
+    s->head = head;
+    s->tail = run;
+    s->max = max;
+}
+
+/*
+ * [index, index + width) を bit で埋めて、掛かった区画の要約を作り直す。
+ */
+static void
+bitset_alloc_mark(struct bitset_allocator *a, size_t index, size_t width, bool bit)
+{
+    bitset_fill_range(&a->bits, index, width, bit);
+
+    size_t last = (index + width - 1) / BS_ALLOC_SUPERBITS;
+    for (size_t sb = index / BS_ALLOC_SUPERBITS; sb <= last; sb ++) {
+        bitset_alloc_summarize(a, sb);
+    }
+
+    if (bit) {
+        a->used += width;
+    } else {
+        a->used -= width;
+    }
+}
+
+/*
+ * [pos, limit) の中で始まる、長さ k 以上の空きを先頭から探す。
+ * 見つからなければ SIZE_MAX を返し、limit まで続いていた空きの長さを *run に入れる。
+ */
+static size_t
+bitset_alloc_scan(const struct bitset *bs, size_t pos, size_t limit, size_t k, size_t *run)
+{
+    size_t size = bitset_size(bs);
+    *run = 0;
+
+    while (pos < limit) {
+        size_t z = bitset_next_within(bs, pos, limit, true);
+        if (z == SIZE_MAX || k > size - z) { break; }
+
+        size_t o = bitset_next_within(bs, z, z + k, false);
+        if (o == SIZE_MAX) { return z; }
+        if (o >= limit) { *run = limit - z; break; }
+        pos = o;
+    }
+
+    return SIZE_MAX;
+}
+
+/*
+ * from 以降で始まる、長さ k 以上の最初の空きの位置を返す。
+ */
+static size_t
+bitset_alloc_first_fit(const struct bitset_allocator *a, size_t from, size_t k)
+{
+    const struct bitset *bs = &a->bits;
+    size_t size = bitset_size(bs);
+    if (from >= size || k > size - from) { return SIZE_MAX; }
+
+    size_t sb = from / BS_ALLOC_SUPERBITS;
+    size_t run = 0;     /* 直前の区画の末尾から続いている空きの長さ */
+    size_t found;
+
+    if (from % BS_ALLOC_SUPERBITS > 0) {
+        /* 区画の途中から始める場合は、その区画だけ直接走査する */
+        found = bitset_alloc_scan(bs, from, sb * BS_ALLOC_SUPERBITS + bitset_super_bits(a, sb), k, &run);
+        if (found != SIZE_MAX) { return found; }
+        sb ++;
+    }
+
+    for (; sb < a->nsuper; sb ++) {
+        const struct bitset_super *s = &a->summary[sb];
+        size_t start = sb * BS_ALLOC_SUPERBITS;
+        size_t bits = bitset_super_bits(a, sb);
+
+        if (run + s->head >= k) { return start - run; }
+
+        if (s->head == bits) {
+            run += bits;
+            continue;
+        }
+
+        if (s->max >= k) {
+            found = bitset_alloc_scan(bs, start, start + bits, k, &run);
+            if (found != SIZE_MAX) { return found; }
+        }
+
+        run = s->tail;
+    }
+
+    return SIZE_MAX;
+}
+
+/*
+ * 長さ k 以上の空きのうち、最も短いものの位置を返す。同じ長さであれば前にあるものを選ぶ。
+ */
+static size_t
+bitset_alloc_best_fit(const struct bitset_allocator *a, size_t k)
+{
+    const struct bitset *bs = &a->bits;
+    size_t best = SIZE_MAX, bestlen = SIZE_MAX;
+    size_t run = 0;
+
+#define BEST_FIT_CANDIDATE(POS, LEN)                                        \
+    do {                                                                    \
+        if ((LEN) >= k && (LEN) < bestlen) {                                \
+            best = (POS);                                                   \
+            bestlen = (LEN);                                                \
+            if (bestlen == k) { return best; }                              \
+        }                                                                   \
+    } while (0)                                                             \
+
+    for (size_t sb = 0; sb < a->nsuper; sb ++) {
+        const struct bitset_super *s = &a->summary[sb];
+        size_t start = sb * BS_ALLOC_SUPERBITS;
+        size_t bits = bitset_super_bits(a, sb);
+
+        if (s->head == bits) {
+            run += bits;
+            continue;
+        }
+
+        BEST_FIT_CANDIDATE(start - run, run + s->head);
+
+        if (s->max >= k) {
+            /* 先頭と末尾の空きを除いた、区画の内側にある空きを調べる */
+            size_t pos = start + s->head;
+            size_t limit = start + bits - s->tail;
+
+            while (pos < limit) {
+                size_t z = bitset_next_within(bs, pos, limit, true);
+                if (z == SIZE_MAX) { break; }
+                size_t o = bitset_next_within(bs, z, limit, false);
+                if (o == SIZE_MAX) { o = limit; }
+                BEST_FIT_CANDIDATE(z, o - z);
+                pos = o;
+            }
+        }
+
+        run = s->tail;
+    }
+
+    BEST_FIT_CANDIDATE(bitset_size(bs) - run, run);
+
+#undef BEST_FIT_CANDIDATE
+
+    return best;
+}
+
+static size_t
+bitset_alloc_search(struct bitset_allocator *a, size_t k)
+{
+    size_t found;
+
+    switch (a->policy) {
+    case BS_ALLOC_NEXT_FIT:
+        found = bitset_alloc_first_fit(a, a->cursor, k);
+        if (found == SIZE_MAX && a->cursor > 0) {
+            found = bitset_alloc_first_fit(a, 0, k);
+        }
+        return found;
+    case BS_ALLOC_BEST_FIT:
+        return bitset_alloc_best_fit(a, k);
+    case BS_ALLOC_FIRST_FIT:
+    default:
+        return bitset_alloc_first_fit(a, 0, k);
+    }
+}
+
+static size_t
+bitset_alloc_largest_free_run(const struct bitset_allocator *a)
+{
+    size_t run = 0, max = 0;
+
+    for (size_t sb = 0; sb < a->nsuper; sb ++) {
+        const struct bitset_super *s = &a->summary[sb];
+        size_t bits = bitset_super_bits(a, sb);
+
+        if (s->head == bits) {
+            run += bits;
+            continue;
+        }
+
+        if (run + s->head > max) { max = run + s->head; }
+        if (s->max > max) { max = s->max; }
+        run = s->tail;
+    }
+
+    return run > max ? run : max;
+}
+
+static enum bitset_alloc_policy
+aux_alloc_policy(mrb_state *mrb, mrb_value policy)
+{
+    if (mrb_symbol_p(policy)) {
+        for (int i = 0; i < (int)(sizeof(bitset_alloc_policy_names) / sizeof(bitset_alloc_policy_names[0])); i ++) {
+            if (mrb_symbol(policy) == mrb_intern_cstr(mrb, bitset_alloc_policy_names[i])) {
+                return (enum bitset_alloc_policy)i;
+            }
+        }
+    }
+
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "wrong policy (expect :first_fit, :next_fit or :best_fit, but given %S)",
+               mrb_inspect(mrb, policy));
+    return BS_ALLOC_FIRST_FIT;
+}
+
+/*
+ * [offset, offset + k) がビット長の内側であることを確かめる。
+ */
+static void
+aux_alloc_check_range(mrb_state *mrb, const struct bitset_allocator *a, mrb_int offset, mrb_int k)
+{
+    if (k < 1) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong run length (expect 1 or more, but given %S)",
+                   mrb_fixnum_value(k));
+    }
+
+    if (offset < 0 || (size_t)offset > bitset_size(&a->bits) || (size_t)k > bitset_size(&a->bits) - offset) {
+        mrb_raisef(mrb, E_INDEX_ERROR,
+                   "out of range (%S, %S for 0...%S)",
+                   mrb_fixnum_value(offset), mrb_fixnum_value(k),
+                   mrb_fixnum_value(bitset_size(&a->bits)));
+    }
+}
+
+static void
+bitset_allocator_init(mrb_state *mrb, mrb_value self, size_t size, enum bitset_alloc_policy policy)
+{
+    if (DATA_PTR(self)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "wrong re-initializing - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    mrbx_obj_modify(mrb, self);
+
+    struct bitset_allocator *a = mrb_calloc(mrb, 1, sizeof(struct bitset_allocator));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset_allocator));
+    mrb_data_init(self, a, &bitset_allocator_type);
+    a->bits.is_embed = 1;
+    a->policy = policy;
+    a->nsuper = unit_ceil(size, BS_ALLOC_SUPERBITS);
+
+    if (a->nsuper > 0) {
+        a->summary = mrb_calloc(mrb, a->nsuper, sizeof(struct bitset_super));
+        BS_STATS_ALLOC(mrb, a->nsuper * sizeof(struct bitset_super));
+    }
+
+    bitset_grow(mrb, &a->bits, size);
+}
+
+/*
+ * call-seq:
+ *  Bitset::Allocator.new(size, policy: :first_fit) -> new allocator
+ *
+ * size ビットの全てが空いている状態で作成する。
+ *
+ * [policy] :first_fit, :next_fit, :best_fit
+ */
+static mrb_value
+bs_allocator_init(mrb_state *mrb, mrb_value self)
+{
+    mrb_int size;
+    mrb_value opts = mrb_nil_value();
+    mrb_get_args(mrb, "i|H", &size, &opts);
+    BS_STATS_CALL(mrb, self);
+
+    if (size < 0) { mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong negative bit size"); }
+
+    enum bitset_alloc_policy policy = BS_ALLOC_FIRST_FIT;
+    if (!mrb_nil_p(opts)) {
+        mrb_value v = mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "policy")));
+        if (!mrb_nil_p(v)) { policy = aux_alloc_policy(mrb, v); }
+    }
+
+    bitset_allocator_init(mrb, self, size, policy);
+
+    struct bitset_allocator *a = get_allocator(mrb, self);
+    for (size_t sb = 0; sb < a->nsuper; sb ++) {
+        bitset_alloc_summarize(a, sb);
+    }
+
+    return self;
+}
+
+static mrb_value
+bs_allocator_init_copy(mrb_state *mrb, mrb_value self)
+{
+    mrb_value origv;
+    mrb_get_args(mrb, "o", &origv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_allocator *orig = get_allocator(mrb, origv);
+
+    bitset_allocator_init(mrb, self, 0, orig->policy);
+
+    struct bitset_allocator *a = get_allocator(mrb, self);
+    bitset_copy(mrb, &a->bits, &orig->bits);
+    a->nsuper = orig->nsuper;
+    a->used = orig->used;
+    a->cursor = orig->cursor;
+
+    if (a->nsuper > 0) {
+        a->summary = mrb_calloc(mrb, a->nsuper, sizeof(struct bitset_super));
+        BS_STATS_ALLOC(mrb, a->nsuper * sizeof(struct bitset_super));
+        memcpy(a->summary, orig->summary, a->nsuper * sizeof(struct bitset_super));
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  alloc(k) -> offset or nil
+ *
+ * 連続した k ビットの空きを探して使用中にし、その先頭位置を返す。
+ * 空きが見つからなければ nil を返す。
+ */
+static mrb_value
+bs_allocator_alloc(mrb_state *mrb, mrb_value self)
+{
+    mrb_int k;
+    mrb_get_args(mrb, "i", &k);
+    BS_STATS_CALL(mrb, self);
+    struct bitset_allocator *a = get_allocator_for_modify(mrb, self);
+
+    if (k < 1) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong run length (expect 1 or more, but given %S)",
+                   mrb_fixnum_value(k));
+    }
+
+    size_t offset = bitset_alloc_search(a, k);
+    if (offset == SIZE_MAX) { return mrb_nil_value(); }
+
+    bitset_alloc_mark(a, offset, k, true);
+    a->cursor = offset + k < bitset_size(&a->bits) ? offset + k : 0;
+
+    return mrb_fixnum_value(offset);
+}
+
+/*
+ * call-seq:
+ *  free(offset, k = 1) -> self
+ *
+ * alloc で得た [offset, offset + k) を空きに戻す。
+ * 範囲に空いているビットが含まれる場合は ArgumentError を起こす。
+ */
+static mrb_value
+bs_allocator_free(mrb_state *mrb, mrb_value self)
+{
+    mrb_int offset, k = 1;
+    mrb_get_args(mrb, "i|i", &offset, &k);
+    BS_STATS_CALL(mrb, self);
+    struct bitset_allocator *a = get_allocator_for_modify(mrb, self);
+
+    aux_alloc_check_range(mrb, a, offset, k);
+
+    if (bitset_popcount_range(&a->bits, offset, k) != (size_t)k) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "not allocated (%S, %S)",
+                   mrb_fixnum_value(offset), mrb_fixnum_value(k));
+    }
+
+    bitset_alloc_mark(a, offset, k, false);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  allocated?(offset, k = 1) -> true or false
+ *
+ * [offset, offset + k) が全て使用中であれば真を返す。
+ */
+static mrb_value
+bs_allocator_allocated_p(mrb_state *mrb, mrb_value self)
+{
+    mrb_int offset, k = 1;
+    mrb_get_args(mrb, "i|i", &offset, &k);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_allocator *a = get_allocator(mrb, self);
+
+    aux_alloc_check_range(mrb, a, offset, k);
+
+    return mrb_bool_value(bitset_popcount_range(&a->bits, offset, k) == (size_t)k);
+}
+
+static mrb_value
+bs_allocator_largest_free_run(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_alloc_largest_free_run(get_allocator(mrb, self)));
+}
+
+static mrb_value
+bs_allocator_size(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_size(&get_allocator(mrb, self)->bits));
+}
+
+static mrb_value
+bs_allocator_used_count(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(get_allocator(mrb, self)->used);
+}
+
+static mrb_value
+bs_allocator_free_count(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_allocator *a = get_allocator(mrb, self);
+    return mrb_fixnum_value(bitset_size(&a->bits) - a->used);
+}
+
+static mrb_value
+bs_allocator_policy(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_allocator *a = get_allocator(mrb, self);
+    return mrb_symbol_value(mrb_intern_cstr(mrb, bitset_alloc_policy_names[a->policy]));
+}
+
+static mrb_value
+bs_allocator_set_policy(mrb_state *mrb, mrb_value self)
+{
+    mrb_value policy;
+    mrb_get_args(mrb, "o", &policy);
+    BS_STATS_CALL(mrb, self);
+    get_allocator_for_modify(mrb, self)->policy = aux_alloc_policy(mrb, policy);
+    return policy;
+}
+
+/*
+ * call-seq:
+ *  to_bitset -> new bitset
+ *
+ * 使用状況を Bitset として複製する。使用中のビットが 1 となる。
+ */
+static mrb_value
+bs_allocator_to_bitset(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_allocator *a = get_allocator(mrb, self);
+    struct bitset *dest;
+    mrb_value obj = bitset_new(mrb, NULL, &dest);
+    bitset_copy(mrb, dest, &a->bits);
+    return obj;
+}
+
+/*
+ * Bitset::Bloom
+ *
+ * ビット列をブルームフィルタとして用いる。ビット数と (二重ハッシュで用いる) ハッシュ関数の数は、
+ * 構築時に想定する要素数と偽陽性率から決める。
+ * 要素は 64 ビットハッシュ値 h1 と、それを攪拌し直した h2 から h1 + i * h2 (i = 0...k) の位置に対応付ける。
+ */
+
+#define BS_BLOOM_HASHES_MAX 64
+#define BS_BLOOM_BITSIZE_MAX ((size_t)MRB_INT_MAX < SIZE_MAX / 2 ? (size_t)MRB_INT_MAX : SIZE_MAX / 2)
+#define BS_LN2 0.69314718055994530942  /* M_LN2 は -std=c11 では定義されない */
+
+struct bitset_bloom
+{
+    struct bitset bits;
+    int hashes;                     /* ハッシュ関数の数 (k) */
+};
+
+static void
+bitset_bloom_free(mrb_state *mrb, void *ptr)
+{
+    if (ptr) {
+        struct bitset_bloom *p = (struct bitset_bloom *)ptr;
+        if (!p->bits.is_embed && p->bits.ptr) {
+            mrb_free(mrb, p->bits.ptr);
+        }
+        memset(p, 0, sizeof(*p));
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type bitset_bloom_type = { "Bitset::Bloom@mruby-bitset", bitset_bloom_free };
+
+static struct bitset_bloom *
+get_bloom(mrb_state *mrb, mrb_value self)
+{
+    struct bitset_bloom *p = (struct bitset_bloom *)mrb_data_get_ptr(mrb, self, &bitset_bloom_type);
+
+    if (!p) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "not initialized - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    return p;
+}
+
+static struct bitset_bloom *
+get_bloom_for_modify(mrb_state *mrb, mrb_value self)
+{
+    mrbx_obj_modify(mrb, self);
+    return get_bloom(mrb, self);
+}
+
+MRBX_FORCE_INLINE uint64_t
+bloom_fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * バイト列の 64 ビットハッシュ値。8 バイトずつリトルエンディアンの整数として取り込み、
+ * 乗算と排他的論理和で混ぜる。最後の攪拌は MurmurHash3 の fmix64 と同じ。
+ * 結果はバイト順やワード長に依存しないため、to_bytes で書き出したフィルタは他の環境でも使える。
+ */
+static uint64_t
+bloom_hash64(const uint8_t *s, size_t len, uint64_t seed)
+{
+    uint64_t h = seed ^ ((uint64_t)len * UINT64_C(0x9e3779b97f4a7c15));
+    uint64_t n;
+
+    for (; len >= 8; len -= 8, s += 8) {
+        n = 0;
+        for (int i = 7; i >= 0; i --) { n = (n << 8) | s[i]; }
+        h = (h ^ (n * UINT64_C(0x87c37b91114253d5))) * UINT64_C(0x4cf5ad432745937f);
+        h ^= h >> 31;
+    }
+
+    n = 0;
+    for (int i = len - 1; i >= 0; i --) { n = (n << 8) | s[i]; }
+    h = (h ^ (n * UINT64_C(0x87c37b91114253d5))) * UINT64_C(0x4cf5ad432745937f);
+
+    return bloom_fmix64(h);
+}
+
+/*
+ * 文字列はバイト列を、シンボルは名前を、整数は 64 ビットのリトルエンディアンとしたバイト列をハッシュする。
+ * それ以外のオブジェクトは #hash の戻り値を整数としてハッシュする (プロセスをまたいで同じ値になるとは限らない)。
+ */
+static uint64_t
+aux_bloom_hash(mrb_state *mrb, mrb_value obj)
+{
+    uint8_t buf[8];
+    int64_t n;
+
+    switch (mrb_type(obj)) {
+    case MRB_TT_STRING:
+        return bloom_hash64((const uint8_t *)RSTRING_PTR(obj), RSTRING_LEN(obj), 0);
+    case MRB_TT_SYMBOL:
+        {
+            mrb_int len;
+            const char *name = mrb_sym2name_len(mrb, mrb_symbol(obj), &len);
+            return bloom_hash64((const uint8_t *)name, len, 0);
+        }
+    case MRB_TT_FIXNUM:
+        n = mrb_fixnum(obj);
+        break;
+    default:
+        obj = mrb_funcall(mrb, obj, "hash", 0);
+        if (!mrb_fixnum_p(obj)) {
+            mrb_raisef(mrb, E_TYPE_ERROR,
+                       "wrong hash value (expect Integer, but given %S)",
+                       mrb_inspect(mrb, obj));
+        }
+        n = mrb_fixnum(obj);
+        break;
+    }
+
+    for (int i = 0; i < 8; i ++) { buf[i] = (uint8_t)((uint64_t)n >> (8 * i)); }
+
+    return bloom_hash64(buf, sizeof(buf), UINT64_C(0x6a09e667f3bcc909));
+}
+
+/*
+ * obj に対応するビット位置を pos に書き込み、そのワードを先読みする。
+ */
+static void
+bitset_bloom_positions(mrb_state *mrb, const struct bitset_bloom *bf, mrb_value obj, size_t *pos)
+{
+    uint64_t h1 = aux_bloom_hash(mrb, obj);
+    uint64_t h2 = bloom_fmix64(h1 ^ UINT64_C(0x9e3779b97f4a7c15)) | 1;
+    uint64_t m = bitset_size(&bf->bits);
+    const uintptr_t *p = bitset_ptr_const(&bf->bits);
+
+    for (int i = 0; i < bf->hashes; i ++, h1 += h2) {
+        pos[i] = h1 % m;
+        BS_PREFETCH(p + pos[i] / BS_WORDBITS, 1);
+    }
+}
+
+static void
+bitset_bloom_add(mrb_state *mrb, struct bitset_bloom *bf, mrb_value obj)
+{
+    size_t pos[BS_BLOOM_HASHES_MAX];
+    bitset_bloom_positions(mrb, bf, obj, pos);
+
+    uintptr_t *p = bitset_ptr(&bf->bits);
+    for (int i = 0; i < bf->hashes; i ++) {
+        p[pos[i] / BS_WORDBITS] |= BS_INDEX_MASK(pos[i]);
+    }
+}
+
+static bool
+bitset_bloom_include(mrb_state *mrb, const struct bitset_bloom *bf, mrb_value obj)
+{
+    size_t pos[BS_BLOOM_HASHES_MAX];
+    bitset_bloom_positions(mrb, bf, obj, pos);
+
+    for (int i = 0; i < bf->hashes; i ++) {
+        if (!bitset_test(&bf->bits, pos[i])) { return false; }
+    }
+
+    return true;
+}
+
+static struct bitset_bloom *
+bitset_bloom_init(mrb_state *mrb, mrb_value self, size_t bitsize, mrb_int hashes)
+{
+    if (DATA_PTR(self)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "wrong re-initializing - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    if (bitsize < 1) { mrb_raise(mrb, E_ARGUMENT_ERROR, "bit size must be 1 or more"); }
+
+    if (hashes < 1 || hashes > BS_BLOOM_HASHES_MAX) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "wrong number of hashes (expect 1..%S, but given %S)",
+                   mrb_fixnum_value(BS_BLOOM_HASHES_MAX), mrb_fixnum_value(hashes));
+    }
+
+    mrbx_obj_modify(mrb, self);
+
+    struct bitset_bloom *bf = mrb_calloc(mrb, 1, sizeof(struct bitset_bloom));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset_bloom));
+    mrb_data_init(self, bf, &bitset_bloom_type);
+    bf->bits.is_embed = 1;
+    bf->hashes = hashes;
+    bitset_grow(mrb, &bf->bits, bitsize);
+
+    return bf;
+}
+
+/*
+ * call-seq:
+ *  Bitset::Bloom.new(expected_items, fp_rate = 0.01) -> new bloom filter
+ *
+ * expected_items 個の要素を加えた時に偽陽性率が fp_rate となるように、
+ * ビット数 m = ceil(-n * log(p) / log(2) ** 2) とハッシュ関数の数 k = round(m / n * log(2)) を決める。
+ */
+static mrb_value
+bs_bloom_init(mrb_state *mrb, mrb_value self)
+{
+    mrb_int items;
+    mrb_float rate = 0.01;
+    mrb_get_args(mrb, "i|f", &items, &rate);
+    BS_STATS_CALL(mrb, self);
+
+    if (items < 1) { mrb_raise(mrb, E_ARGUMENT_ERROR, "expected items must be 1 or more"); }
+    if (!(rate > 0 && rate < 1)) { mrb_raise(mrb, E_ARGUMENT_ERROR, "fp rate must be in (0, 1)"); }
+
+    double m = ceil(-(double)items * log(rate) / (BS_LN2 * BS_LN2));
+    double k = floor(m / items * BS_LN2 + 0.5);
+
+    if (m > (double)BS_BLOOM_BITSIZE_MAX) { mrb_raise(mrb, E_ARGUMENT_ERROR, "too large bloom filter"); }
+    if (k < 1) { k = 1; }
+    if (k > BS_BLOOM_HASHES_MAX) { k = BS_BLOOM_HASHES_MAX; }
+
+    bitset_bloom_init(mrb, self, (size_t)m, (mrb_int)k);
+
+    return self;
+}
+
+static mrb_value
+bs_bloom_init_copy(mrb_state *mrb, mrb_value self)
+{
+    mrb_value origv;
+    mrb_get_args(mrb, "o", &origv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_bloom *orig = get_bloom(mrb, origv);
+
+    struct bitset_bloom *bf = bitset_bloom_init(mrb, self, 1, orig->hashes);
+    bitset_copy(mrb, &bf->bits, &orig->bits);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  Bitset::Bloom.from_bytes(string, hashes, bitsize = string.bytesize * 8) -> new bloom filter
+ *
+ * to_bytes で書き出したビット列と、ハッシュ関数の数からフィルタを復元する。
+ */
+static mrb_value
+bs_bloom_s_from_bytes(mrb_state *mrb, mrb_value klass)
+{
+    mrb_value str;
+    mrb_int hashes, bitsize = -1;
+    mrb_get_args(mrb, "Si|i", &str, &hashes, &bitsize);
+
+    size_t len = RSTRING_LEN(str);
+    if (bitsize < 0) { bitsize = len * 8; }
+    if ((size_t)bitsize > len * 8) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "too short string (%S bytes for %S bits)",
+                   mrb_fixnum_value(len), mrb_fixnum_value(bitsize));
+    }
+
+    mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, mrb_class_ptr(klass)));
+    struct bitset_bloom *bf = bitset_bloom_init(mrb, obj, bitsize, hashes);
+    bitset_load_from_bytes(mrb, &bf->bits, (const uint8_t *)RSTRING_PTR(str), len, bitsize, false);
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  add(obj) -> self
+ *  self << obj -> self
+ */
+static mrb_value
+bs_bloom_add(mrb_state *mrb, mrb_value self)
+{
+    mrb_value obj;
+    mrb_get_args(mrb, "o", &obj);
+    BS_STATS_CALL(mrb, self);
+    bitset_bloom_add(mrb, get_bloom_for_modify(mrb, self), obj);
+    return self;
+}
+
+/*
+ * call-seq:
+ *  add_all(array) -> self
+ *
+ * 配列の全ての要素を加える。要素ごとにメソッドを呼び出すよりも速い。
+ */
+static mrb_value
+bs_bloom_add_all(mrb_state *mrb, mrb_value self)
+{
+    mrb_value ary;
+    mrb_get_args(mrb, "A", &ary);
+    BS_STATS_CALL(mrb, self);
+    struct bitset_bloom *bf = get_bloom_for_modify(mrb, self);
+
+    for (mrb_int i = 0; i < RARRAY_LEN(ary); i ++) {
+        bitset_bloom_add(mrb, bf, RARRAY_PTR(ary)[i]);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  include?(obj) -> true or false
+ *
+ * 偽であれば obj は確実に加えられていない。真であっても偽陽性の場合がある。
+ */
+static mrb_value
+bs_bloom_include_p(mrb_state *mrb, mrb_value self)
+{
+    mrb_value obj;
+    mrb_get_args(mrb, "o", &obj);
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(bitset_bloom_include(mrb, get_bloom(mrb, self), obj));
+}
+
+/*
+ * call-seq:
+ *  include_all?(array) -> true or false
+ *
+ * 配列の全ての要素について include? が真であれば真。
+ */
+static mrb_value
+bs_bloom_include_all_p(mrb_state *mrb, mrb_value self)
+{
+    mrb_value ary;
+    mrb_get_args(mrb, "A", &ary);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_bloom *bf = get_bloom(mrb, self);
+
+    for (mrb_int i = 0; i < RARRAY_LEN(ary); i ++) {
+        if (!bitset_bloom_include(mrb, bf, RARRAY_PTR(ary)[i])) { return mrb_false_value(); }
+    }
+
+    return mrb_true_value();
+}
+
+/*
+ * ビット数とハッシュ関数の数が同じフィルタ同士を、ワード単位で operator により合成した新しいフィルタを返す。
+ */
+static mrb_value
+bitset_bloom_combine(mrb_state *mrb, mrb_value self, operator_f *operator)
+{
+    mrb_value otherv;
+    mrb_get_args(mrb, "o", &otherv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_bloom *bf = get_bloom(mrb, self);
+    const struct bitset_bloom *other = get_bloom(mrb, otherv);
+
+    if (bitset_size(&bf->bits) != bitset_size(&other->bits) || bf->hashes != other->hashes) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "incompatible bloom filters (%S bits and %S hashes for %S bits and %S hashes)",
+                   mrb_fixnum_value(bitset_size(&other->bits)), mrb_fixnum_value(other->hashes),
+                   mrb_fixnum_value(bitset_size(&bf->bits)), mrb_fixnum_value(bf->hashes));
+    }
+
+    mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, mrb_obj_class(mrb, self)));
+    struct bitset_bloom *dest = bitset_bloom_init(mrb, obj, 1, bf->hashes);
+    bitset_copy(mrb, &dest->bits, &bf->bits);
+
+    uintptr_t *p = bitset_ptr(&dest->bits);
+    const uintptr_t *q = bitset_ptr_const(&other->bits);
+    for (size_t i = unit_ceil(bitset_size(&dest->bits), BS_WORDBITS); i > 0; i --, p ++, q ++) {
+        *p = operator(*p, *q);
+    }
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  union(other) -> new bloom filter
+ *  self | other -> new bloom filter
+ *  intersect(other) -> new bloom filter
+ *  self & other -> new bloom filter
+ *
+ * union はどちらかに加えた要素を、intersect は両方に加えた要素を含むフィルタを返す。
+ * intersect の偽陽性率は、両方に加えた要素だけで作ったフィルタよりも高くなる。
+ */
+static mrb_value
+bs_bloom_union(mrb_state *mrb, mrb_value self)
+{
+    return bitset_bloom_combine(mrb, self, operator_or);
+}
+
+static mrb_value
+bs_bloom_intersect(mrb_state *mrb, mrb_value self)
+{
+    return bitset_bloom_combine(mrb, self, operator_and);
+}
+
+static mrb_value
+bs_bloom_bitsize(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_size(&get_bloom(mrb, self)->bits));
+}
+
+static mrb_value
+bs_bloom_hashes(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(get_bloom(mrb, self)->hashes);
+}
+
+static mrb_value
+bs_bloom_popcount(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(bitset_popcount_scan(&get_bloom(mrb, self)->bits));
+}
+
+static mrb_value
+bs_bloom_clear(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    struct bitset_bloom *bf = get_bloom_for_modify(mrb, self);
+    memset(bitset_ptr(&bf->bits), 0, unit_ceil(bitset_size(&bf->bits), BS_WORDBITS) * sizeof(uintptr_t));
+    return self;
+}
+
+/*
+ * call-seq:
+ *  to_bytes -> string
+ *
+ * ビット列をそのままバイト列として書き出す。Bitset::Bloom.from_bytes で復元できる。
+ */
+static mrb_value
+bs_bloom_to_bytes(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_obj_value(bitset_to_bytes(mrb, &get_bloom(mrb, self)->bits, false));
+}
+
+static mrb_value
+bs_bloom_to_bitset(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    struct bitset *dest;
+    mrb_value obj = bitset_new(mrb, NULL, &dest);
+    bitset_copy(mrb, dest, &get_bloom(mrb, self)->bits);
+    return obj;
+}
+
+/*
+ * Bitset::SlicedIndex
+ *
+ * 非負整数の列を、値のビットごとのビット列 (スライス) に分けて持つビットスライス索引。
+ * 行 r の値のビット i は、スライス i のビット r となる。
+ * ワード j の全てのスライスを連続して並べるため (words[j * nslices + i])、比較は
+ * 1 ワード分の行について全てのスライスを上位から辿るだけで済み、途中のビット列を作らない。
+ * 範囲・等値の比較は O'Neil と Quass の方法、上位 k 件の選択は O'Neil と Rinfret の方法による。
+ */
+
+struct bitset_sliced
+{
+    size_t rows;
+    int nslices;
+    uintptr_t *words;
+};
+
+enum bitset_sliced_cmp { BS_SLICED_EQ, BS_SLICED_NE, BS_SLICED_LT, BS_SLICED_LE, BS_SLICED_GT, BS_SLICED_GE };
+
+static void
+bitset_sliced_free(mrb_state *mrb, void *ptr)
+{
+    if (ptr) {
+        struct bitset_sliced *p = (struct bitset_sliced *)ptr;
+        mrb_free(mrb, p->words);
+        memset(p, 0, sizeof(*p));
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type bitset_sliced_type = { "Bitset::SlicedIndex@mruby-bitset", bitset_sliced_free };
+
+static struct bitset_sliced *
+get_sliced(mrb_state *mrb, mrb_value self)
+{
+    struct bitset_sliced *p = (struct bitset_sliced *)mrb_data_get_ptr(mrb, self, &bitset_sliced_type);
+
+    if (!p) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "not initialized - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    return p;
+}
+
+static inline size_t
+bitset_sliced_words(const struct bitset_sliced *bsi)
+{
+    return unit_ceil(bsi->rows, BS_WORDBITS);
+}
+
+/*
+ * ワード j の有効な行のマスク。末尾のワードでは行数を超えた部分が 0 となる。
+ */
+static inline uintptr_t
+bitset_sliced_live(const struct bitset_sliced *bsi, size_t j)
+{
+    size_t rest = bsi->rows - j * BS_WORDBITS;
+    return rest < BS_WORDBITS ? ~getmask(BS_WORDBITS - rest) : (uintptr_t)-1;
+}
+
+/*
+ * ワード j の行について、値と c を比べた結果を lt / eq / gt に振り分ける。
+ * c は 0 以上 2 ** nslices 未満であること。
+ */
+MRBX_FORCE_INLINE void
+bitset_sliced_compare_word(const uintptr_t *w, int nslices, uint64_t c, uintptr_t *lt, uintptr_t *eq, uintptr_t *gt)
+{
+    uintptr_t l = 0, e = (uintptr_t)-1, g = 0;
+
+    for (int i = nslices - 1; i >= 0; i --) {
+        uintptr_t s = w[i];
+        if ((c >> i) & 1) {
+            l |= e & ~s;
+            e &= s;
+        } else {
+            g |= e & s;
+            e &= ~s;
+        }
+    }
+
+    *lt = l;
+    *eq = e;
+    *gt = g;
+}
+
+static void
+bitset_sliced_check_value(mrb_state *mrb, const struct bitset_sliced *bsi, mrb_int value)
+{
+    if (value < 0 || (bsi->nslices < 63 && (uint64_t)value >> bsi->nslices)) {
+        mrb_raisef(mrb, E_RANGE_ERROR,
+                   "value out of range (%S for %S bits)",
+                   mrb_fixnum_value(value), mrb_fixnum_value(bsi->nslices));
+    }
+}
+
+static void
+bitset_sliced_put(struct bitset_sliced *bsi, size_t row, uint64_t value)
+{
+    uintptr_t *w = bsi->words + row / BS_WORDBITS * bsi->nslices;
+    uintptr_t m = BS_INDEX_MASK(row);
+
+    for (int i = 0; i < bsi->nslices; i ++) {
+        if ((value >> i) & 1) {
+            w[i] |= m;
+        } else {
+            w[i] &= ~m;
+        }
+    }
+}
+
+static uint64_t
+bitset_sliced_get(const struct bitset_sliced *bsi, size_t row)
+{
+    const uintptr_t *w = bsi->words + row / BS_WORDBITS * bsi->nslices;
+    uintptr_t m = BS_INDEX_MASK(row);
+    uint64_t value = 0;
+
+    for (int i = bsi->nslices - 1; i >= 0; i --) {
+        value = (value << 1) | ((w[i] & m) != 0);
+    }
+
+    return value;
+}
+
+/*
+ * rows ビットの結果用の Bitset を作り、そのワード列を *p に返す。
+ */
+static mrb_value
+bitset_sliced_result(mrb_state *mrb, const struct bitset_sliced *bsi, uintptr_t **p)
+{
+    struct bitset *bs;
+    mrb_value obj = bitset_new(mrb, NULL, &bs);
+    bitset_grow(mrb, bs, bsi->rows);
+    *p = bitset_ptr(bs);
+    return obj;
+}
+
+/*
+ * rows 行 nslices スライスの、全ての値が 0 の索引として self を初期化する。
+ */
+static struct bitset_sliced *
+bitset_sliced_init(mrb_state *mrb, mrb_value self, size_t rows, int nslices)
+{
+    if (DATA_PTR(self)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "wrong re-initializing - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    mrbx_obj_modify(mrb, self);
+
+    struct bitset_sliced *bsi = mrb_calloc(mrb, 1, sizeof(struct bitset_sliced));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset_sliced));
+    mrb_data_init(self, bsi, &bitset_sliced_type);
+    bsi->nslices = nslices;
+
+    if (rows > 0) {
+        bsi->words = mrb_calloc(mrb, unit_ceil(rows, BS_WORDBITS) * nslices, sizeof(uintptr_t));
+        BS_STATS_ALLOC(mrb, unit_ceil(rows, BS_WORDBITS) * nslices * sizeof(uintptr_t));
+    }
+    bsi->rows = rows;
+
+    return bsi;
+}
+
+/*
+ * call-seq:
+ *  Bitset::SlicedIndex.new(values, bits = nil) -> new sliced index
+ *
+ * values は 0 以上の整数の配列。bits を省略した場合は最大値を表すのに必要なビット数となる。
+ */
+static mrb_value
+bs_sliced_init(mrb_state *mrb, mrb_value self)
+{
+    mrb_value ary, bitsv = mrb_nil_value();
+    mrb_get_args(mrb, "A|o", &ary, &bitsv);
+    BS_STATS_CALL(mrb, self);
+
+    if (DATA_PTR(self)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "wrong re-initializing - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    const mrb_value *p = RARRAY_PTR(ary);
+    size_t rows = RARRAY_LEN(ary);
+    mrb_int max = 0;
+
+    for (size_t r = 0; r < rows; r ++) {
+        if (!mrb_fixnum_p(p[r])) {
+            mrb_raisef(mrb, E_TYPE_ERROR,
+                       "wrong value type (expect Integer, but given %S)",
+                       mrb_inspect(mrb, p[r]));
+        }
+        if (mrb_fixnum(p[r]) < 0) {
+            mrb_raisef(mrb, E_RANGE_ERROR, "negative value - %S", p[r]);
+        }
+        if (mrb_fixnum(p[r]) > max) { max = mrb_fixnum(p[r]); }
+    }
+
+    int nslices;
+    if (mrb_nil_p(bitsv)) {
+        for (nslices = 1; nslices < MRB_INT_BIT - 1 && (max >> nslices) > 0; nslices ++) { }
+    } else {
+        mrb_int bits = mrb_int(mrb, bitsv);
+        if (bits < 1 || bits > MRB_INT_BIT - 1) {
+            mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                       "wrong bits (expect 1..%S, but given %S)",
+                       mrb_fixnum_value(MRB_INT_BIT - 1), bitsv);
+        }
+        nslices = bits;
+    }
+
+    struct bitset_sliced *bsi = bitset_sliced_init(mrb, self, rows, nslices);
+
+    for (size_t r = 0; r < rows; r ++) {
+        bitset_sliced_check_value(mrb, bsi, mrb_fixnum(p[r]));
+        bitset_sliced_put(bsi, r, mrb_fixnum(p[r]));
+    }
+
+    return self;
+}
+
+static mrb_value
+bs_sliced_init_copy(mrb_state *mrb, mrb_value self)
+{
+    mrb_value origv;
+    mrb_get_args(mrb, "o", &origv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sliced *orig = get_sliced(mrb, origv);
+
+    struct bitset_sliced *bsi = bitset_sliced_init(mrb, self, orig->rows, orig->nslices);
+    if (bsi->words) {
+        memcpy(bsi->words, orig->words, bitset_sliced_words(bsi) * bsi->nslices * sizeof(uintptr_t));
+    }
+
+    return self;
+}
+
+static size_t
+aux_sliced_row(mrb_state *mrb, const struct bitset_sliced *bsi, mrb_int row)
+{
+    mrb_int r = row < 0 ? row + (mrb_int)bsi->rows : row;
+
+    if (r < 0 || (size_t)r >= bsi->rows) {
+        mrb_raisef(mrb, E_INDEX_ERROR,
+                   "row out of range (%S for %S rows)",
+                   mrb_fixnum_value(row), mrb_fixnum_value(bsi->rows));
+    }
+
+    return r;
+}
+
+static mrb_value
+bs_sliced_aref(mrb_state *mrb, mrb_value self)
+{
+    mrb_int row;
+    mrb_get_args(mrb, "i", &row);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sliced *bsi = get_sliced(mrb, self);
+    return mrb_fixnum_value(bitset_sliced_get(bsi, aux_sliced_row(mrb, bsi, row)));
+}
+
+static mrb_value
+bs_sliced_aset(mrb_state *mrb, mrb_value self)
+{
+    mrb_int row, value;
+    mrb_get_args(mrb, "ii", &row, &value);
+    BS_STATS_CALL(mrb, self);
+    mrbx_obj_modify(mrb, self);
+    struct bitset_sliced *bsi = get_sliced(mrb, self);
+    size_t r = aux_sliced_row(mrb, bsi, row);
+    bitset_sliced_check_value(mrb, bsi, value);
+    bitset_sliced_put(bsi, r, value);
+    return mrb_fixnum_value(value);
+}
+
+static mrb_value
+bs_sliced_size(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(get_sliced(mrb, self)->rows);
+}
+
+static mrb_value
+bs_sliced_slices(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(get_sliced(mrb, self)->nslices);
+}
+
+static mrb_value
+bs_sliced_to_a(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sliced *bsi = get_sliced(mrb, self);
+    mrb_value ary = mrb_ary_new_capa(mrb, bsi->rows);
+
+    for (size_t r = 0; r < bsi->rows; r ++) {
+        mrb_ary_push(mrb, ary, mrb_fixnum_value(bitset_sliced_get(bsi, r)));
+    }
+
+    return ary;
+}
+
+/*
+ * 値と c を比べて、op を満たす行に 1 を立てたワード列を p に書き出す。
+ * 全てのワードについて、スライスを上位から 1 回ずつ読むだけとなる。
+ */
+static void
+bitset_sliced_compare(const struct bitset_sliced *bsi, enum bitset_sliced_cmp op, mrb_int c, uintptr_t *p)
+{
+    /* c が値の範囲外であれば、全ての行が c より大きいか小さい */
+    int outside = c < 0 ? 1 : (bsi->nslices < 63 && (uint64_t)c >> bsi->nslices) ? -1 : 0;
+    size_t words = bitset_sliced_words(bsi);
+    const uintptr_t *w = bsi->words;
+
+    for (size_t j = 0; j < words; j ++, w += bsi->nslices) {
+        uintptr_t lt, eq, gt, n;
+
+        if (outside == 0) {
+            bitset_sliced_compare_word(w, bsi->nslices, c, &lt, &eq, &gt);
+        } else {
+            lt = outside < 0 ? (uintptr_t)-1 : 0;
+            eq = 0;
+            gt = outside > 0 ? (uintptr_t)-1 : 0;
+        }
+
+        switch (op) {
+        case BS_SLICED_EQ:  n = eq; break;
+        case BS_SLICED_NE:  n = lt | gt; break;
+        case BS_SLICED_LT:  n = lt; break;
+        case BS_SLICED_LE:  n = lt | eq; break;
+        case BS_SLICED_GT:  n = gt; break;
+        default:            n = gt | eq; break;
+        }
+
+        p[j] = n & bitset_sliced_live(bsi, j);
+    }
+}
+
+static mrb_value
+aux_sliced_compare(mrb_state *mrb, mrb_value self, enum bitset_sliced_cmp op)
+{
+    mrb_int c;
+    mrb_get_args(mrb, "i", &c);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sliced *bsi = get_sliced(mrb, self);
+    uintptr_t *p;
+    mrb_value obj = bitset_sliced_result(mrb, bsi, &p);
+    bitset_sliced_compare(bsi, op, c, p);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  eq(value) -> bitset
+ *  ne(value) -> bitset
+ *  lt(value) -> bitset
+ *  le(value) -> bitset
+ *  gt(value) -> bitset
+ *  ge(value) -> bitset
+ *
+ * 条件を満たす行に 1 を立てた、行数と同じビット長の Bitset を返す。
+ */
+static mrb_value
+bs_sliced_eq(mrb_state *mrb, mrb_value self)
+{
+    return aux_sliced_compare(mrb, self, BS_SLICED_EQ);
+}
+
+static mrb_value
+bs_sliced_ne(mrb_state *mrb, mrb_value self)
+{
+    return aux_sliced_compare(mrb, self, BS_SLICED_NE);
+}
+
+static mrb_value
+bs_sliced_lt(mrb_state *mrb, mrb_value self)
+{
+    return aux_sliced_compare(mrb, self, BS_SLICED_LT);
+}
+
+static mrb_value
+bs_sliced_le(mrb_state *mrb, mrb_value self)
+{
+    return aux_sliced_compare(mrb, self, BS_SLICED_LE);
+}
+
+static mrb_value
+bs_sliced_gt(mrb_state *mrb, mrb_value self)
+{
+    return aux_sliced_compare(mrb, self, BS_SLICED_GT);
+}
+
+static mrb_value
+bs_sliced_ge(mrb_state *mrb, mrb_value self)
+{
+    return aux_sliced_compare(mrb, self, BS_SLICED_GE);
+}
+
+/*
+ * 値が [lo, hi] に収まる行に 1 を立てたワード列を p に書き出す。
+ * 二つの比較を同じワードの繰り返しの中で行う。
+ */
+static void
+bitset_sliced_between(const struct bitset_sliced *bsi, mrb_int lo, mrb_int hi, uintptr_t *p)
+{
+    size_t words = bitset_sliced_words(bsi);
+    uint64_t top = (UINT64_C(1) << bsi->nslices) - 1;
+
+    if (lo < 0) { lo = 0; }
+    if (hi < lo || (uint64_t)lo > top) {
+        memset(p, 0, words * sizeof(uintptr_t));
+        return;
+    }
+
+    uint64_t ulo = lo, uhi = (uint64_t)hi > top ? top : (uint64_t)hi;
+    const uintptr_t *w = bsi->words;
+
+    for (size_t j = 0; j < words; j ++, w += bsi->nslices) {
+        uintptr_t lt1 = 0, eq1 = (uintptr_t)-1, lt2 = 0, eq2 = (uintptr_t)-1;
+
+        for (int i = bsi->nslices - 1; i >= 0; i --) {
+            uintptr_t s = w[i];
+            if ((ulo >> i) & 1) { lt1 |= eq1 & ~s; eq1 &= s; } else { eq1 &= ~s; }
+            if ((uhi >> i) & 1) { lt2 |= eq2 & ~s; eq2 &= s; } else { eq2 &= ~s; }
+        }
+
+        p[j] = ~lt1 & (lt2 | eq2) & bitset_sliced_live(bsi, j);
+    }
+}
+
+/*
+ * call-seq:
+ *  between(min, max) -> bitset
+ *
+ * 値が [min, max] に収まる行に 1 を立てた Bitset を返す。
+ */
+static mrb_value
+bs_sliced_between(mrb_state *mrb, mrb_value self)
+{
+    mrb_int lo, hi;
+    mrb_get_args(mrb, "ii", &lo, &hi);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sliced *bsi = get_sliced(mrb, self);
+    uintptr_t *p;
+    mrb_value obj = bitset_sliced_result(mrb, bsi, &p);
+    bitset_sliced_between(bsi, lo, hi, p);
+    return obj;
+}
+
+static const struct bitset *
+aux_sliced_filter(mrb_state *mrb, mrb_value filter, size_t *nwords)
+{
+    if (mrb_nil_p(filter)) { return NULL; }
+
+    const struct bitset *fbs = get_bitset(mrb, filter);
+    *nwords = unit_ceil(bitset_size(fbs), BS_WORDBITS);
+    return fbs;
+}
+
+/*
+ * call-seq:
+ *  sum(filter = nil) -> integer
+ *
+ * filter (Bitset) の 1 が立っている行の値の合計を返す。filter を省略した場合は全ての行となる。
+ * スライスごとに (スライス & filter) の 1 を数え、2 ** i を掛けて足し合わせる。
+ */
+static mrb_value
+bs_sliced_sum(mrb_state *mrb, mrb_value self)
+{
+    mrb_value filter = mrb_nil_value();
+    mrb_get_args(mrb, "|o", &filter);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sliced *bsi = get_sliced(mrb, self);
+    size_t fwords = 0;
+    const struct bitset *fbs = aux_sliced_filter(mrb, filter, &fwords);
+
+    uint64_t counts[64] = { 0 };
+    size_t words = bitset_sliced_words(bsi);
+    const uintptr_t *w = bsi->words;
+
+    for (size_t j = 0; j < words; j ++, w += bsi->nslices) {
+        uintptr_t m = bitset_sliced_live(bsi, j);
+        if (fbs) { m &= j < fwords ? bitset_word_live(fbs, j) : 0; }
+        if (!m) { continue; }
+
+        for (int i = 0; i < bsi->nslices; i ++) {
+            counts[i] += popcount(w[i] & m);
+        }
+    }
+
+    uint64_t sum = 0;
+    bool overflow = false;
+    for (int i = 0; i < bsi->nslices; i ++) {
+        if (counts[i] > (UINT64_MAX - sum) >> i) { overflow = true; break; }
+        sum += counts[i] << i;
+    }
+
+    if (overflow || sum > (uint64_t)MRB_INT_MAX) {
+        double d = 0;
+        for (int i = 0; i < bsi->nslices; i ++) { d += ldexp((double)counts[i], i); }
+        return mrb_float_value(mrb, d);
+    }
+
+    return mrb_fixnum_value((mrb_int)sum);
+}
+
+/*
+ * 値の大きい順に k 行 (0 < k < rows) を選んで g に書き出す。e は作業用で、どちらも rows ビット分のワード列。
+ * 上位のスライスから、確定した行 (g) と候補の行 (e) を絞り込む。
+ * 候補を絞った時の行数は書き出さずに数えるだけなので、スライスごとにワード列を 2 回読む。
+ */
+static void
+bitset_sliced_top_k(const struct bitset_sliced *bsi, size_t k, uintptr_t *g, uintptr_t *e)
+{
+    size_t words = bitset_sliced_words(bsi);
+    size_t count_g = 0;
+
+    for (size_t j = 0; j < words; j ++) {
+        g[j] = 0;
+        e[j] = bitset_sliced_live(bsi, j);
+    }
+
+    for (int i = bsi->nslices - 1; i >= 0; i --) {
+        const uintptr_t *s = bsi->words + i;
+        size_t n = 0;
+
+        for (size_t j = 0; j < words; j ++) {
+            n += popcount(g[j] | (e[j] & s[j * bsi->nslices]));
+        }
+
+        if (n > k) {
+            for (size_t j = 0; j < words; j ++) { e[j] &= s[j * bsi->nslices]; }
+        } else {
+            for (size_t j = 0; j < words; j ++) {
+                uintptr_t x = e[j] & s[j * bsi->nslices];
+                g[j] |= x;
+                e[j] &= ~x;
+            }
+            count_g = n;
+            if (n == k) { return; }
+        }
+    }
+
+    /* 残りは同じ値の候補の先頭から選ぶ */
+    size_t need = k - count_g;
+    for (size_t j = 0; j < words && need > 0; j ++) {
+        uintptr_t x = e[j];
+        while (x && need > 0) {
+            uintptr_t m = BS_INDEX_MASK(count_nlz(x));
+            g[j] |= m;
+            x &= ~m;
+            need --;
+        }
+    }
+}
+
+/*
+ * call-seq:
+ *  top_k(k) -> bitset
+ *
+ * 値の大きい順に k 行を選んで 1 を立てた Bitset を返す。同じ値の行は先頭に近いものを選ぶ。
+ */
+static mrb_value
+bs_sliced_top_k(mrb_state *mrb, mrb_value self)
+{
+    mrb_int k;
+    mrb_get_args(mrb, "i", &k);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sliced *bsi = get_sliced(mrb, self);
+    uintptr_t *g;
+    mrb_value obj = bitset_sliced_result(mrb, bsi, &g);
+
+    if (k <= 0) {
+        return obj;
+    } else if ((size_t)k >= bsi->rows) {
+        for (size_t j = 0; j < bitset_sliced_words(bsi); j ++) {
+            g[j] = bitset_sliced_live(bsi, j);
+        }
+    } else {
+        mrb_value tmp = mrb_str_new(mrb, NULL, bitset_sliced_words(bsi) * sizeof(uintptr_t));
+        bitset_sliced_top_k(bsi, k, g, (uintptr_t *)RSTRING_PTR(tmp));
+    }
+
+    return obj;
+}
+
+/*
+ * Bitset::Matrix
+ *
+ * rows × cols の真偽値の行列。各行は stride ワードのビット列 (Bitset と同じく MSB が 0 列目) として、
+ * 行の順に隙間なく並べる。行列の大きさは変わらないため、row が返す Bitset::Fixed は行のワード列を
+ * 複製せずにそのまま借りる。
+ */
+
+struct bitset_matrix
+{
+    size_t rows;
+    size_t cols;
+    size_t stride;          /* 1 行のワード数 */
+    uintptr_t *words;
+};
+
+#define BS_MATRIX_RUSSIAN 8 /* Four Russians の表を作る行の数; 表は 2 ** 8 行となる */
+
+static void
+bitset_matrix_free(mrb_state *mrb, void *ptr)
+{
+    if (ptr) {
+        struct bitset_matrix *p = (struct bitset_matrix *)ptr;
+        mrb_free(mrb, p->words);
+        memset(p, 0, sizeof(*p));
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type bitset_matrix_type = { "Bitset::Matrix@mruby-bitset", bitset_matrix_free };
+
+static struct bitset_matrix *
+get_matrix(mrb_state *mrb, mrb_value self)
+{
+    struct bitset_matrix *p = (struct bitset_matrix *)mrb_data_get_ptr(mrb, self, &bitset_matrix_type);
+
+    if (!p) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "not initialized - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    return p;
+}
+
+static struct bitset_matrix *
+bitset_matrix_init(mrb_state *mrb, mrb_value self, size_t rows, size_t cols)
+{
+    if (DATA_PTR(self)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "wrong re-initializing - %S",
+                   mrb_any_to_s(mrb, self));
     }
-    return count;
-#else
-# if UINTPTR_MAX > UINT32_MAX
-    //n = ( n       & 0x1111111111111111ULL) +
-    //    ((n >> 1) & 0x1111111111111111ULL) +
-    //    ((n >> 2) & 0x1111111111111111ULL) +
-    //    ((n >> 3) & 0x1111111111111111ULL);
-    n = (n & 0x5555555555555555ULL) + ((n >>  1) & 0x5555555555555555ULL);
-    n = (n & 0x3333333333333333ULL) + ((n >>  2) & 0x3333333333333333ULL);
-    n = (n + (n >> 4)) & 0x0f0f0f0f0f0f0f0fULL; /* 4 + 4 = 8 が最大なので、加算前のビットマスクは不要 */
-    n += n >>  8; /* 以降は 0..64 に収まるため、ビットマスクは不要 */
-    n += n >> 16;
-    n += n >> 32;
-# else
-    n = (n & 0x55555555UL) + ((n >>  1) & 0x55555555UL);
-    n = (n & 0x33333333UL) + ((n >>  2) & 0x33333333UL);
-    n = (n + (n >> 4)) & 0x0f0f0f0fUL; /* 4 + 4 = 8 が最大なので、加算前のビットマスクは不要 */
-    n += n >>  8; /* 以降は 0..32 に収まるため、ビットマスクは不要 */
-    n += n >> 16;
-# endif
-    return n & 0xff;
-#endif
+
+    size_t stride = unit_ceil(cols, BS_WORDBITS);
+    if (stride > 0 && rows > SIZE_MAX / sizeof(uintptr_t) / stride) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "matrix too large");
+    }
+
+    mrbx_obj_modify(mrb, self);
+
+    struct bitset_matrix *m = mrb_calloc(mrb, 1, sizeof(struct bitset_matrix));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset_matrix));
+    mrb_data_init(self, m, &bitset_matrix_type);
+
+    if (rows > 0 && stride > 0) {
+        m->words = mrb_calloc(mrb, rows * stride, sizeof(uintptr_t));
+        BS_STATS_ALLOC(mrb, rows * stride * sizeof(uintptr_t));
+    }
+
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = stride;
+
+    return m;
 }
 
-static int
-bitset_popcount(const struct bitset *bs)
+static mrb_value
+bitset_matrix_new(mrb_state *mrb, struct RClass *klass, size_t rows, size_t cols, struct bitset_matrix **mp)
 {
-    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
-    size_t size = bitset_size(bs);
-    size_t cnt = 0;
+    mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, klass));
+    *mp = bitset_matrix_init(mrb, obj, rows, cols);
+    return obj;
+}
 
-    for (int i = size / BS_WORDBITS; i > 0; i --, p ++) {
-        cnt += popcount(*p);
+static inline uintptr_t *
+bitset_matrix_row(const struct bitset_matrix *m, size_t row)
+{
+    return m->words + row * m->stride;
+}
+
+/*
+ * BS_WORDBITS × BS_WORDBITS の正方行列 a (a[i] が i 行目) をその場で転置する。
+ * 半分の大きさの右上と左下のブロックをマスクを使って入れ替え、次は 1/4 の大きさのブロックを
+ * 入れ替える、と繰り返す。ワードの読み書きは log2(BS_WORDBITS) 回の BS_WORDBITS ワード分で済む。
+ */
+static void
+bitset_transpose_block(uintptr_t *a)
+{
+    uintptr_t m = (uintptr_t)-1 >> (BS_WORDBITS / 2);
+
+    for (int j = BS_WORDBITS / 2; j != 0; j >>= 1, m ^= m << j) {
+        for (int k = 0; k < BS_WORDBITS; k = (k + j + 1) & ~j) {
+            uintptr_t t = (a[k] ^ (a[k + j] >> j)) & m;
+            a[k] ^= t;
+            a[k + j] ^= t << j;
+        }
     }
+}
 
-    size %= BS_WORDBITS;
-    if (size > 0) {
-        cnt += popcount(*p >> (BS_WORDBITS - size));
+/*
+ * src の転置を dest (src->cols × src->rows) に書き出す。
+ * BS_WORDBITS 行 × 1 ワードのブロックごとに取り出し、転置したものを dest の 1 ワードの列に書き戻す。
+ */
+static void
+bitset_matrix_transpose(const struct bitset_matrix *src, struct bitset_matrix *dest)
+{
+    uintptr_t block[BS_WORDBITS];
+
+    for (size_t bi = 0; bi < dest->stride; bi ++) {
+        for (size_t bj = 0; bj < src->stride; bj ++) {
+            for (size_t t = 0; t < BS_WORDBITS; t ++) {
+                size_t r = bi * BS_WORDBITS + t;
+                block[t] = r < src->rows ? bitset_matrix_row(src, r)[bj] : 0;
+            }
+
+            bitset_transpose_block(block);
+
+            for (size_t t = 0; t < BS_WORDBITS; t ++) {
+                size_t r = bj * BS_WORDBITS + t;
+                if (r >= dest->rows) { break; }
+                bitset_matrix_row(dest, r)[bi] = block[t];
+            }
+        }
     }
+}
 
-    return cnt;
+/*
+ * 論理積と論理和による行列の積 c = a · b を求める (Four Russians)。
+ * b の BS_MATRIX_RUSSIAN 行ごとに、その全ての組み合わせの論理和を表 (2 ** BS_MATRIX_RUSSIAN 行) にしておき、
+ * a の各行からは該当する 8 列をそのまま表の添え字として 1 行分の論理和を取る。
+ * table は 2 ** BS_MATRIX_RUSSIAN × b->stride ワードの作業領域。
+ */
+static void
+bitset_matrix_multiply(const struct bitset_matrix *a, const struct bitset_matrix *b, struct bitset_matrix *c, uintptr_t *table)
+{
+    const size_t stride = b->stride;
+    const size_t entries = (size_t)1 << BS_MATRIX_RUSSIAN;
+
+    memset(table, 0, stride * sizeof(uintptr_t));
+
+    for (size_t k = 0; k < a->cols; k += BS_MATRIX_RUSSIAN) {
+        /* 添え字の MSB 側が k 行目となる (a の列の並びに合わせる) */
+        for (size_t v = 1; v < entries; v ++) {
+            size_t r = k + BS_MATRIX_RUSSIAN - 1 - count_ntz(v);
+            uintptr_t *dst = table + v * stride;
+            const uintptr_t *prev = table + (v & (v - 1)) * stride;
+
+            if (r < b->rows) {
+                const uintptr_t *row = bitset_matrix_row(b, r);
+                for (size_t j = 0; j < stride; j ++) { dst[j] = prev[j] | row[j]; }
+            } else {
+                memcpy(dst, prev, stride * sizeof(uintptr_t));
+            }
+        }
+
+        size_t word = k / BS_WORDBITS;
+        int shift = BS_WORDBITS - BS_MATRIX_RUSSIAN - k % BS_WORDBITS;
+
+        for (size_t i = 0; i < a->rows; i ++) {
+            size_t v = (bitset_matrix_row(a, i)[word] >> shift) & (entries - 1);
+            if (v == 0) { continue; }
+
+            const uintptr_t *src = table + v * stride;
+            uintptr_t *dst = bitset_matrix_row(c, i);
+            for (size_t j = 0; j < stride; j ++) { dst[j] |= src[j]; }
+        }
+    }
 }
 
-MRB_API int
-mruby_bitset_popcount(mrb_state *mrb, mrb_value bitset)
+static size_t
+aux_matrix_index(mrb_state *mrb, mrb_int index, size_t size)
 {
-    return bitset_popcount(get_bitset(mrb, bitset));
+    mrb_int i = index < 0 ? index + (mrb_int)size : index;
+
+    if (i < 0 || (size_t)i >= size) {
+        mrb_raisef(mrb, E_INDEX_ERROR,
+                   "index out of range (%S for %S)",
+                   mrb_fixnum_value(index), mrb_fixnum_value(size));
+    }
+
+    return i;
 }
 
+/*
+ * call-seq:
+ *  Bitset::Matrix.new(rows, cols) -> new matrix
+ *
+ * 全ての要素が 0 の行列を作成する。
+ */
 static mrb_value
-bs_popcount(mrb_state *mrb, mrb_value self)
+bs_matrix_init(mrb_state *mrb, mrb_value self)
 {
-    mrb_get_args(mrb, "");
-    return mrb_fixnum_value(mruby_bitset_popcount(mrb, self));
+    mrb_int rows, cols;
+    mrb_get_args(mrb, "ii", &rows, &cols);
+    BS_STATS_CALL(mrb, self);
+
+    if (rows < 0 || cols < 0) { mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong negative size"); }
+
+    bitset_matrix_init(mrb, self, rows, cols);
+
+    return self;
 }
 
-static int
-count_nlz(uintptr_t n)
+static mrb_value
+bs_matrix_init_copy(mrb_state *mrb, mrb_value self)
 {
-    /*
-     * ゆくゆくは __builtin_clz() / __builtin_clzll() を使うかもしれない
-     * https://gcc.gnu.org/onlinedocs/gcc/Other-Builtins.html
-     */
+    mrb_value origv;
+    mrb_get_args(mrb, "o", &origv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_matrix *orig = get_matrix(mrb, origv);
 
-#if UINTPTR_MAX > UINT32_MAX
-    n |= n >> 32;
-#endif
-    n |= n >> 16;
-    n |= n >>  8;
-    n |= n >>  4;
-    n |= n >>  2;
-    n |= n >>  1;
-    return popcount(~n);
+    struct bitset_matrix *m = bitset_matrix_init(mrb, self, orig->rows, orig->cols);
+    if (m->words) {
+        memcpy(m->words, orig->words, m->rows * m->stride * sizeof(uintptr_t));
+    }
+
+    return self;
 }
 
-static size_t
-bitset_clz(const struct bitset *bs)
+/*
+ * call-seq:
+ *  Bitset::Matrix.from_rows(bitsets, cols = nil) -> new matrix
+ *
+ * Bitset の配列を行とする行列を作成する。cols を省略した場合は、最も長い行のビット長となる。
+ */
+static mrb_value
+bs_matrix_s_from_rows(mrb_state *mrb, mrb_value klass)
 {
-    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
-    size_t size = bitset_size(bs);
-    size_t cnt = 0;
+    mrb_value ary, colsv = mrb_nil_value();
+    mrb_get_args(mrb, "A|o", &ary, &colsv);
+    BS_STATS_CALL(mrb, klass);
+
+    const mrb_value *p = RARRAY_PTR(ary);
+    size_t rows = RARRAY_LEN(ary);
+    size_t cols = 0;
+
+    if (mrb_nil_p(colsv)) {
+        for (size_t i = 0; i < rows; i ++) {
+            size_t size = bitset_size(get_bitset(mrb, p[i]));
+            if (size > cols) { cols = size; }
+        }
+    } else {
+        mrb_int n = mrb_int(mrb, colsv);
+        if (n < 0) { mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong negative size"); }
+        cols = n;
+
+        for (size_t i = 0; i < rows; i ++) {
+            if (bitset_size(get_bitset(mrb, p[i])) > cols) {
+                mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                           "row too long (%S bits for %S columns)",
+                           mrb_fixnum_value(bitset_size(get_bitset(mrb, p[i]))),
+                           mrb_fixnum_value(cols));
+            }
+        }
+    }
 
-    for (int i = size / BS_WORDBITS; i > 0; i --, p ++) {
-        if (*p) {
-            return cnt + count_nlz(*p);
+    struct bitset_matrix *m;
+    mrb_value obj = bitset_matrix_new(mrb, mrb_class_ptr(klass), rows, cols, &m);
+
+    for (size_t i = 0; i < rows; i ++) {
+        const struct bitset *bs = get_bitset(mrb, p[i]);
+        uintptr_t *dst = bitset_matrix_row(m, i);
+        size_t words = unit_ceil(bitset_size(bs), BS_WORDBITS);
+
+        for (size_t j = 0; j < words; j ++) {
+            dst[j] = bitset_word_live(bs, j);
         }
+    }
 
-        cnt += BS_WORDBITS;
+    return obj;
+}
+
+static mrb_value
+bs_matrix_rows(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(get_matrix(mrb, self)->rows);
+}
+
+static mrb_value
+bs_matrix_cols(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(get_matrix(mrb, self)->cols);
+}
+
+static mrb_value
+bs_matrix_aref(mrb_state *mrb, mrb_value self)
+{
+    mrb_int row, col;
+    mrb_get_args(mrb, "ii", &row, &col);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_matrix *m = get_matrix(mrb, self);
+    size_t c = aux_matrix_index(mrb, col, m->cols);
+    const uintptr_t *p = bitset_matrix_row(m, aux_matrix_index(mrb, row, m->rows));
+    return mrb_fixnum_value((p[c / BS_WORDBITS] & BS_INDEX_MASK(c)) ? 1 : 0);
+}
+
+static mrb_value
+bs_matrix_aset(mrb_state *mrb, mrb_value self)
+{
+    mrb_int row, col;
+    mrb_value bit;
+    mrb_get_args(mrb, "iio", &row, &col, &bit);
+    BS_STATS_CALL(mrb, self);
+    mrbx_obj_modify(mrb, self);
+    struct bitset_matrix *m = get_matrix(mrb, self);
+    size_t c = aux_matrix_index(mrb, col, m->cols);
+    uintptr_t *p = bitset_matrix_row(m, aux_matrix_index(mrb, row, m->rows));
+
+    if (aux_make_bits(mrb, bit) & 1) {
+        p[c / BS_WORDBITS] |= BS_INDEX_MASK(c);
+    } else {
+        p[c / BS_WORDBITS] &= ~BS_INDEX_MASK(c);
     }
 
-    size %= BS_WORDBITS;
-    if (size > 0) {
-        uintptr_t sh = BS_WORDBITS - size;
-        uintptr_t nn = *p >> sh << sh;
-        if (nn) {
-            cnt += count_nlz(nn);
-        } else {
-            cnt += size;
+    return bit;
+}
+
+/*
+ * call-seq:
+ *  row(index) -> bitset
+ *
+ * index 行目を、行列のワード列をそのまま使う Bitset::Fixed として返す。
+ * 返したビット列を書き換えると行列の行が変わり、行列を書き換えると返したビット列も変わる。
+ * 返したビット列が生きている間は、行列も解放されない。
+ * 行列の側から書き換わるため、返したビット列では track! と summarize! は使えない。
+ */
+static mrb_value
+bs_matrix_row(mrb_state *mrb, mrb_value self)
+{
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+    struct bitset_matrix *m = get_matrix(mrb, self);
+    size_t row = aux_matrix_index(mrb, index, m->rows);
+
+    struct bitset *bs;
+    mrb_value view = bitset_new(mrb, mrb_class_get_under(mrb, mrb_class_get(mrb, "Bitset"), "Fixed"), &bs);
+    bs->is_embed = 0;
+    bs->is_fixed = 1;
+    bs->is_borrowed = 1;
+    bs->ptr = bitset_matrix_row(m, row);
+    bs->total_len = m->cols;
+    bs->capacity = m->stride;
+
+    mrb_iv_set(mrb, view, mrb_intern_lit(mrb, "matrix"), self);
+    if (mrbx_frozen_p(self)) { MRB_SET_FROZEN_FLAG(mrb_basic_ptr(view)); }
+
+    return view;
+}
+
+/*
+ * call-seq:
+ *  to_a -> array of bitsets
+ *
+ * 各行を複製した Bitset の配列を返す。
+ */
+static mrb_value
+bs_matrix_to_a(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_matrix *m = get_matrix(mrb, self);
+    mrb_value ary = mrb_ary_new_capa(mrb, m->rows);
+    int ai = mrb_gc_arena_save(mrb);
+
+    for (size_t i = 0; i < m->rows; i ++) {
+        struct bitset *bs;
+        mrb_value row = bitset_new(mrb, NULL, &bs);
+        bitset_grow(mrb, bs, m->cols);
+        if (m->stride > 0) {
+            memcpy(bitset_ptr(bs), bitset_matrix_row(m, i), m->stride * sizeof(uintptr_t));
         }
+        mrb_ary_push(mrb, ary, row);
+        mrb_gc_arena_restore(mrb, ai);
+    }
+
+    return ary;
+}
+
+/*
+ * call-seq:
+ *  transpose -> new matrix
+ */
+static mrb_value
+bs_matrix_transpose(mrb_state *mrb, mrb_value self)
+{
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_matrix *src = get_matrix(mrb, self);
+    struct bitset_matrix *dest;
+    mrb_value obj = bitset_matrix_new(mrb, mrb_obj_class(mrb, self), src->cols, src->rows, &dest);
+    bitset_matrix_transpose(src, dest);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  multiply(other) -> new matrix
+ *  self * other -> new matrix
+ *
+ * 論理積と論理和による行列の積を返す。self の列数と other の行数は等しくなければならない。
+ * 隣接行列であれば、2 歩で到達できる組を表す行列となる。
+ */
+static mrb_value
+bs_matrix_multiply(mrb_state *mrb, mrb_value self)
+{
+    mrb_value otherv;
+    mrb_get_args(mrb, "o", &otherv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_matrix *a = get_matrix(mrb, self);
+    const struct bitset_matrix *b = get_matrix(mrb, otherv);
+
+    if (a->cols != b->rows) {
+        mrb_raisef(mrb, E_ARGUMENT_ERROR,
+                   "matrix size mismatch (%S columns for %S rows)",
+                   mrb_fixnum_value(a->cols), mrb_fixnum_value(b->rows));
+    }
+
+    struct bitset_matrix *c;
+    mrb_value obj = bitset_matrix_new(mrb, mrb_obj_class(mrb, self), a->rows, b->cols, &c);
+
+    if (a->rows > 0 && a->cols > 0 && b->stride > 0) {
+        size_t bytes = ((size_t)1 << BS_MATRIX_RUSSIAN) * b->stride * sizeof(uintptr_t);
+        uintptr_t *table = mrb_malloc(mrb, bytes);
+        BS_STATS_ALLOC(mrb, bytes);
+        bitset_matrix_multiply(a, b, c, table);
+        mrb_free(mrb, table);
+    }
+
+    return obj;
+}
+
+/*
+ * Bitset::Sparse
+ *
+ * 0 ではないワードだけを、ワード番号をキーとする開番地法のハッシュ表に持つビット集合。
+ * 2 ** 62 のような巨大な位置にビットを立てても、使うメモリは 1 ビットの立っているワードの数に比例する。
+ * 負の位置は 2 の補数として 64 ビットの符号なし整数に読み替えるため、-1 は 2 ** 64 - 1 の位置になる。
+ * 衝突は線形探索で解決し、削除は後ろのスロットを詰め直す (墓標を残さない) ため、表には常に
+ * 0 ではないワードしか残らない。
+ */
+
+#define BS_SPARSE_EMPTY     UINT64_MAX
+#define BS_SPARSE_MINCAPA   8
+
+struct bitset_sparse_entry
+{
+    uint64_t key;           /* ワード番号; BS_SPARSE_EMPTY であれば空き */
+    uintptr_t word;
+};
+
+struct bitset_sparse
+{
+    size_t capa;            /* スロット数 (0 か 2 のべき) */
+    size_t count;           /* 使用中のスロット数 */
+    int shift;              /* 64 - log2(capa) */
+    size_t popcount;
+    struct bitset_sparse_entry *slots;
+};
+
+static void
+bitset_sparse_free(mrb_state *mrb, void *ptr)
+{
+    if (ptr) {
+        struct bitset_sparse *p = (struct bitset_sparse *)ptr;
+        mrb_free(mrb, p->slots);
+        memset(p, 0, sizeof(*p));
+        mrb_free(mrb, p);
+    }
+}
+
+static const mrb_data_type bitset_sparse_type = { "Bitset::Sparse@mruby-bitset", bitset_sparse_free };
+
+static struct bitset_sparse *
+get_sparse(mrb_state *mrb, mrb_value self)
+{
+    struct bitset_sparse *p = (struct bitset_sparse *)mrb_data_get_ptr(mrb, self, &bitset_sparse_type);
+
+    if (!p) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "not initialized - %S",
+                   mrb_any_to_s(mrb, self));
+    }
+
+    return p;
+}
+
+static struct bitset_sparse *
+bitset_sparse_init(mrb_state *mrb, mrb_value self)
+{
+    if (DATA_PTR(self)) {
+        mrb_raisef(mrb, E_RUNTIME_ERROR,
+                   "wrong re-initializing - %S",
+                   mrb_any_to_s(mrb, self));
     }
 
-    return cnt;
+    mrbx_obj_modify(mrb, self);
+
+    struct bitset_sparse *sp = mrb_calloc(mrb, 1, sizeof(struct bitset_sparse));
+    BS_STATS_ALLOC(mrb, sizeof(struct bitset_sparse));
+    mrb_data_init(self, sp, &bitset_sparse_type);
+
+    return sp;
 }
 
 static mrb_value
-bs_clz(mrb_state *mrb, mrb_value self)
+bitset_sparse_new(mrb_state *mrb, struct RClass *klass, struct bitset_sparse **spp)
 {
-    mrb_get_args(mrb, "");
-    return mrb_fixnum_value(bitset_clz(get_bitset(mrb, self)));
+    mrb_value obj = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, klass));
+    *spp = bitset_sparse_init(mrb, obj);
+    return obj;
 }
 
-static int
-count_ntz(uintptr_t n)
+/* フィボナッチ・ハッシュ */
+static inline size_t
+bitset_sparse_home(const struct bitset_sparse *sp, uint64_t key)
 {
-    /*
-     * ゆくゆくは __builtin_ctz() / __builtin_ctzll() を使うかもしれない
-     * https://gcc.gnu.org/onlinedocs/gcc/Other-Builtins.html
-     */
-
-    return popcount((n & -n) - 1);
+    return (size_t)((key * UINT64_C(0x9e3779b97f4a7c15)) >> sp->shift);
 }
 
+/*
+ * key のスロットを返す。なければ SIZE_MAX を返す。
+ */
 static size_t
-bitset_ctz(const struct bitset *bs)
+bitset_sparse_find(const struct bitset_sparse *sp, uint64_t key)
 {
-    size_t size = bitset_size(bs);
-    const uintptr_t *head = bs->is_embed ? bs->ary : bs->ptr;
-    const uintptr_t *p = head + unit_ceil(size, BS_WORDBITS) - 1;
-    size_t cnt = 0;
-    size_t rest = size % BS_WORDBITS;
+    if (sp->count == 0) { return SIZE_MAX; }
 
-    if (rest > 0) {
-        uintptr_t sh = BS_WORDBITS - rest;
-        uintptr_t nn = *p >> sh;
-        if (nn) {
-            return count_ntz(nn);
-        } else {
-            cnt += rest;
-        }
-        size -= rest;
-        p --;
+    size_t mask = sp->capa - 1;
+
+    for (size_t i = bitset_sparse_home(sp, key); ; i = (i + 1) & mask) {
+        if (sp->slots[i].key == key) { return i; }
+        if (sp->slots[i].key == BS_SPARSE_EMPTY) { return SIZE_MAX; }
     }
+}
 
-    for (; p >= head; p --) {
-        if (*p) {
-            cnt += count_ntz(*p);
-            break;
-        }
+static void
+bitset_sparse_place(struct bitset_sparse *sp, uint64_t key, uintptr_t word)
+{
+    size_t mask = sp->capa - 1;
+    size_t i = bitset_sparse_home(sp, key);
 
-        cnt += BS_WORDBITS;
+    while (sp->slots[i].key != BS_SPARSE_EMPTY) {
+        i = (i + 1) & mask;
     }
 
-    return cnt;
+    sp->slots[i].key = key;
+    sp->slots[i].word = word;
+    sp->count ++;
 }
 
-static mrb_value
-bs_ctz(mrb_state *mrb, mrb_value self)
+static void
+bitset_sparse_rehash(mrb_state *mrb, struct bitset_sparse *sp, size_t capa)
 {
-    mrb_get_args(mrb, "");
-    return mrb_fixnum_value(bitset_ctz(get_bitset(mrb, self)));
+    struct bitset_sparse_entry *old = sp->slots;
+    size_t oldcapa = sp->capa;
+    struct bitset_sparse_entry *slots = mrb_malloc(mrb, capa * sizeof(struct bitset_sparse_entry));
+    BS_STATS_ALLOC(mrb, capa * sizeof(struct bitset_sparse_entry));
+
+    for (size_t i = 0; i < capa; i ++) {
+        slots[i].key = BS_SPARSE_EMPTY;
+    }
+
+    int shift = 64;
+    for (size_t n = capa; n > 1; n >>= 1) { shift --; }
+
+    sp->slots = slots;
+    sp->capa = capa;
+    sp->shift = shift;
+    sp->count = 0;
+
+    for (size_t i = 0; i < oldcapa; i ++) {
+        if (old[i].key != BS_SPARSE_EMPTY) {
+            bitset_sparse_place(sp, old[i].key, old[i].word);
+        }
+    }
+
+    mrb_free(mrb, old);
 }
 
-static int
-fold_parity(uintptr_t n)
+/*
+ * 使用率が 3/4 を超えないように、あらかじめ広げておく。
+ */
+static void
+bitset_sparse_reserve(mrb_state *mrb, struct bitset_sparse *sp, size_t count)
 {
-#if UINTPTR_MAX > UINT32_MAX
-    n ^= n >> 32;
-#endif
-    n ^= n >> 16;
-    n ^= n >>  8;
-    n ^= n >>  4;
-    n ^= n >>  2;
-    n ^= n >>  1;
-    return n & 1;
+    if (count * 4 <= sp->capa * 3) { return; }
+
+    size_t capa = sp->capa < BS_SPARSE_MINCAPA ? BS_SPARSE_MINCAPA : sp->capa;
+    while (count * 4 > capa * 3) { capa *= 2; }
+
+    bitset_sparse_rehash(mrb, sp, capa);
 }
 
-static int
-bitset_parity(const struct bitset *bs)
+/*
+ * スロット i を空け、後ろに続く探索列を詰め直す。
+ */
+static void
+bitset_sparse_remove(struct bitset_sparse *sp, size_t i)
 {
-    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
-    size_t size = bitset_size(bs);
-    uintptr_t total = 0;
+    size_t mask = sp->capa - 1;
 
-    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
-        total ^= *p;
-    }
+    for (size_t j = (i + 1) & mask; sp->slots[j].key != BS_SPARSE_EMPTY; j = (j + 1) & mask) {
+        size_t home = bitset_sparse_home(sp, sp->slots[j].key);
 
-    if (size > 0) {
-        /* 下位ビットを無効化するために右シフト */
-        total ^= *p >> (BS_WORDBITS - size);
+        /* home が (i, j] の外にあれば、j のエントリは i に移せる */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            sp->slots[i] = sp->slots[j];
+            i = j;
+        }
     }
 
-    return fold_parity(total);
+    sp->slots[i].key = BS_SPARSE_EMPTY;
+    sp->count --;
 }
 
-static mrb_value
-bs_parity(mrb_state *mrb, mrb_value self)
+static uintptr_t
+bitset_sparse_get(const struct bitset_sparse *sp, uint64_t key)
 {
-    mrb_get_args(mrb, "");
-    return mrb_fixnum_value(bitset_parity(get_bitset(mrb, self)));
+    size_t i = bitset_sparse_find(sp, key);
+    return i == SIZE_MAX ? 0 : sp->slots[i].word;
 }
 
-static bool
-bitset_all(const struct bitset *bs)
+/*
+ * key のワードを word に置き換える。word が 0 であれば取り除く。
+ */
+static void
+bitset_sparse_put(mrb_state *mrb, struct bitset_sparse *sp, uint64_t key, uintptr_t word)
 {
-    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
-    size_t size = bitset_size(bs);
+    size_t i = bitset_sparse_find(sp, key);
 
-    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
-        if (~*p) { return false; }
+    if (i != SIZE_MAX) {
+        sp->popcount += popcount(word) - popcount(sp->slots[i].word);
+        if (word == 0) {
+            bitset_sparse_remove(sp, i);
+        } else {
+            sp->slots[i].word = word;
+        }
+    } else if (word != 0) {
+        bitset_sparse_reserve(mrb, sp, sp->count + 1);
+        bitset_sparse_place(sp, key, word);
+        sp->popcount += popcount(word);
     }
+}
 
-    if (size > 0) {
-        if (~((intptr_t)*p >> (BS_WORDBITS - size))) {
-            return false;
-        }
+static void
+bitset_sparse_copy(mrb_state *mrb, struct bitset_sparse *dest, const struct bitset_sparse *src)
+{
+    if (src->capa > 0) {
+        dest->slots = mrb_malloc(mrb, src->capa * sizeof(struct bitset_sparse_entry));
+        BS_STATS_ALLOC(mrb, src->capa * sizeof(struct bitset_sparse_entry));
+        memcpy(dest->slots, src->slots, src->capa * sizeof(struct bitset_sparse_entry));
     }
 
-    return true;
+    dest->capa = src->capa;
+    dest->count = src->count;
+    dest->shift = src->shift;
+    dest->popcount = src->popcount;
 }
 
 static mrb_value
-bs_all(mrb_state *mrb, mrb_value self)
+bs_sparse_init(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
-    return mrb_bool_value(bitset_all(get_bitset(mrb, self)));
+    BS_STATS_CALL(mrb, self);
+    bitset_sparse_init(mrb, self);
+    return self;
 }
 
-static bool
-bitset_any(const struct bitset *bs)
+static mrb_value
+bs_sparse_init_copy(mrb_state *mrb, mrb_value self)
 {
-    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
-    size_t size = bitset_size(bs);
+    mrb_value origv;
+    mrb_get_args(mrb, "o", &origv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sparse *orig = get_sparse(mrb, origv);
+    bitset_sparse_copy(mrb, bitset_sparse_init(mrb, self), orig);
+    return self;
+}
 
-    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
-        if (*p) { return true; }
-    }
+/*
+ * call-seq:
+ *  sparse[index] -> 0 or 1
+ */
+static mrb_value
+bs_sparse_aref(mrb_state *mrb, mrb_value self)
+{
+    mrb_int index;
+    mrb_get_args(mrb, "i", &index);
+    BS_STATS_CALL(mrb, self);
+    /*
+     * 負の位置は 2 の補数として uint64_t に読み替える。
+     * 符号付き 64 ビットのハッシュ値をそのまま位置として使えるようにするため。
+     */
+    uint64_t i = (uint64_t)index;
+    uintptr_t word = bitset_sparse_get(get_sparse(mrb, self), i / BS_WORDBITS);
+    return mrb_fixnum_value((word & BS_INDEX_MASK(i)) ? 1 : 0);
+}
 
-    if (size > 0) {
-        if ((*p >> (BS_WORDBITS - size)) > 0) {
-            return true;
-        }
+/*
+ * call-seq:
+ *  sparse[index] = bit
+ */
+static mrb_value
+bs_sparse_aset(mrb_state *mrb, mrb_value self)
+{
+    mrb_int index;
+    mrb_value bit;
+    mrb_get_args(mrb, "io", &index, &bit);
+    BS_STATS_CALL(mrb, self);
+    mrbx_obj_modify(mrb, self);
+    struct bitset_sparse *sp = get_sparse(mrb, self);
+    uint64_t i = (uint64_t)index;
+    uintptr_t word = bitset_sparse_get(sp, i / BS_WORDBITS);
+
+    if (aux_make_bits(mrb, bit) & 1) {
+        word |= BS_INDEX_MASK(i);
+    } else {
+        word &= ~BS_INDEX_MASK(i);
     }
 
-    return false;
+    bitset_sparse_put(mrb, sp, i / BS_WORDBITS, word);
+
+    return bit;
 }
 
 static mrb_value
-bs_any(mrb_state *mrb, mrb_value self)
+bs_sparse_popcount(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
-    return mrb_bool_value(bitset_any(get_bitset(mrb, self)));
+    BS_STATS_CALL(mrb, self);
+    return mrb_fixnum_value(get_sparse(mrb, self)->popcount);
 }
 
-static bool
-bitset_none(const struct bitset *bs)
+static mrb_value
+bs_sparse_empty_p(mrb_state *mrb, mrb_value self)
 {
-    const uintptr_t *p = bs->is_embed ? bs->ary : bs->ptr;
-    size_t size = bitset_size(bs);
-
-    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
-        if (*p) { return false; }
-    }
-
-    if (size > 0) {
-        if ((*p >> (BS_WORDBITS - size)) > 0) {
-            return false;
-        }
-    }
-
-    return true;
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    return mrb_bool_value(get_sparse(mrb, self)->count == 0);
 }
 
 static mrb_value
-bs_none(mrb_state *mrb, mrb_value self)
+bs_sparse_clear(mrb_state *mrb, mrb_value self)
 {
     mrb_get_args(mrb, "");
-    return mrb_bool_value(bitset_none(get_bitset(mrb, self)));
+    BS_STATS_CALL(mrb, self);
+    mrbx_obj_modify(mrb, self);
+    struct bitset_sparse *sp = get_sparse(mrb, self);
+    mrb_free(mrb, sp->slots);
+    memset(sp, 0, sizeof(*sp));
+    return self;
 }
 
-static bool
-bitset_equal(const struct bitset *a, const struct bitset *b)
+enum bitset_sparse_op { BS_SPARSE_OR, BS_SPARSE_AND, BS_SPARSE_XOR, BS_SPARSE_ANDNOT };
+
+/*
+ * a と b の論理演算の結果を dest (空であること) に書き出す。
+ * 論理積は小さい方の表だけを辿って大きい方を引き、それ以外は一方の表を複製してから
+ * 他方 (論理和と排他的論理和では小さい方) の表を辿って反映する。
+ */
+static void
+bitset_sparse_operate(mrb_state *mrb, struct bitset_sparse *dest, const struct bitset_sparse *a, const struct bitset_sparse *b, enum bitset_sparse_op op)
 {
-    size_t size = bitset_size(a);
-    if (size != bitset_size(b)) { return false; }
+    if (op == BS_SPARSE_AND || (op == BS_SPARSE_ANDNOT && a->count <= b->count)) {
+        if (op == BS_SPARSE_AND && a->count > b->count) {
+            const struct bitset_sparse *t = a; a = b; b = t;
+        }
 
-    const uintptr_t *p = bitset_ptr_const(a);
-    const uintptr_t *q = bitset_ptr_const(b);
+        for (size_t i = 0; i < a->capa; i ++) {
+            const struct bitset_sparse_entry *e = &a->slots[i];
+            if (e->key == BS_SPARSE_EMPTY) { continue; }
+            uintptr_t w = bitset_sparse_get(b, e->key);
+            bitset_sparse_put(mrb, dest, e->key, op == BS_SPARSE_AND ? e->word & w : e->word & ~w);
+        }
 
-    /* TODO: memcmp を使う */
+        return;
+    }
 
-    for (size_t i = size / BS_WORDBITS; i > 0; i --, p ++, q ++) {
-        if (*p != *q) { return false; }
+    if (op != BS_SPARSE_ANDNOT && a->count < b->count) {
+        const struct bitset_sparse *t = a; a = b; b = t;
     }
 
-    size %= BS_WORDBITS;
+    bitset_sparse_copy(mrb, dest, a);
+    bitset_sparse_reserve(mrb, dest, dest->count + (op == BS_SPARSE_ANDNOT ? 0 : b->count));
 
-    if (size > 0) {
-        size_t pad = BS_WORDBITS - size;
-        if ((*p >> pad) != (*q >> pad)) { return false; }
+    for (size_t i = 0; i < b->capa; i ++) {
+        const struct bitset_sparse_entry *e = &b->slots[i];
+        if (e->key == BS_SPARSE_EMPTY) { continue; }
+        uintptr_t w = bitset_sparse_get(dest, e->key);
+
+        switch (op) {
+        case BS_SPARSE_OR:  w |= e->word; break;
+        case BS_SPARSE_XOR: w ^= e->word; break;
+        default:            w &= ~e->word; break;
+        }
+
+        bitset_sparse_put(mrb, dest, e->key, w);
     }
+}
 
-    return true;
+static mrb_value
+aux_sparse_operate(mrb_state *mrb, mrb_value self, enum bitset_sparse_op op)
+{
+    mrb_value otherv;
+    mrb_get_args(mrb, "o", &otherv);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sparse *a = get_sparse(mrb, self);
+    const struct bitset_sparse *b = get_sparse(mrb, otherv);
+    struct bitset_sparse *dest;
+    mrb_value obj = bitset_sparse_new(mrb, mrb_obj_class(mrb, self), &dest);
+    bitset_sparse_operate(mrb, dest, a, b, op);
+    return obj;
 }
 
+/*
+ * call-seq:
+ *  sparse | other -> new sparse
+ *  sparse & other -> new sparse
+ *  sparse ^ other -> new sparse
+ *  sparse - other -> new sparse
+ */
 static mrb_value
-bs_eql(mrb_state *mrb, mrb_value self)
+bs_sparse_or(mrb_state *mrb, mrb_value self)
 {
-    mrb_value other;
-    mrb_get_args(mrb, "o", &other);
-    return mrb_bool_value(bitset_equal(get_bitset(mrb, self), get_bitset(mrb, other)));
+    return aux_sparse_operate(mrb, self, BS_SPARSE_OR);
 }
 
-static mrb_int
-bitset_hash(const struct bitset *bs)
+static mrb_value
+bs_sparse_and(mrb_state *mrb, mrb_value self)
 {
-    /*
-     * テーブルは utils/mkcrctbl.rb で算出したもの
-     */
-#if MRB_INT_MAX > INT32_MAX
-    static const uint64_t table[] = {
-        UINT64_C(0x0000000000000000), UINT64_C(0x42f0e1eba9ea3693),
-        UINT64_C(0x85e1c3d753d46d26), UINT64_C(0xc711223cfa3e5bb5),
-        UINT64_C(0x493366450e42ecdf), UINT64_C(0x0bc387aea7a8da4c),
-        UINT64_C(0xccd2a5925d9681f9), UINT64_C(0x8e224479f47cb76a),
-        UINT64_C(0x9266cc8a1c85d9be), UINT64_C(0xd0962d61b56fef2d),
-        UINT64_C(0x17870f5d4f51b498), UINT64_C(0x5577eeb6e6bb820b),
-        UINT64_C(0xdb55aacf12c73561), UINT64_C(0x99a54b24bb2d03f2),
-        UINT64_C(0x5eb4691841135847), UINT64_C(0x1c4488f3e8f96ed4)
-    };
+    return aux_sparse_operate(mrb, self, BS_SPARSE_AND);
+}
 
-    uint64_t crc = -1;
-#else
-    static const uint32_t table[] = {
-        UINT32_C(0x00000000), UINT32_C(0x1edc6f41),
-        UINT32_C(0x3db8de82), UINT32_C(0x2364b1c3),
-        UINT32_C(0x7b71bd04), UINT32_C(0x65add245),
-        UINT32_C(0x46c96386), UINT32_C(0x58150cc7),
-        UINT32_C(0xf6e37a08), UINT32_C(0xe83f1549),
-        UINT32_C(0xcb5ba48a), UINT32_C(0xd587cbcb),
-        UINT32_C(0x8d92c70c), UINT32_C(0x934ea84d),
-        UINT32_C(0xb02a198e), UINT32_C(0xaef676cf)
-    };
+static mrb_value
+bs_sparse_xor(mrb_state *mrb, mrb_value self)
+{
+    return aux_sparse_operate(mrb, self, BS_SPARSE_XOR);
+}
 
-    uint32_t crc = -1;
-#endif
+static mrb_value
+bs_sparse_andnot(mrb_state *mrb, mrb_value self)
+{
+    return aux_sparse_operate(mrb, self, BS_SPARSE_ANDNOT);
+}
 
-    size_t size = bitset_size(bs);
-    const uintptr_t *p = bitset_ptr_const(bs);
+static int
+aux_sparse_entry_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const struct bitset_sparse_entry *)a)->key;
+    uint64_t y = ((const struct bitset_sparse_entry *)b)->key;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
 
-    /*
-     * NOTE: CRC 算出部分を共通化したほうが良さげ
-     */
+/*
+ * 使用中のスロットだけをワード番号の順に並べ替えた一時的な配列を作る。
+ * 戻り値はその配列を保持する文字列オブジェクトで、使い終わるまで GC から守ること。
+ */
+static mrb_value
+aux_sparse_sorted(mrb_state *mrb, const struct bitset_sparse *sp, const struct bitset_sparse_entry **entp)
+{
+    mrb_value tmp = mrb_str_new(mrb, NULL, sp->count * sizeof(struct bitset_sparse_entry));
+    struct bitset_sparse_entry *ent = (struct bitset_sparse_entry *)RSTRING_PTR(tmp);
+    size_t n = 0;
 
-    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
-        uintptr_t n = *p;
-        for (int i = BS_WORDBITS / 4; i > 0; i --, n <<= 4) {
-            crc = (crc << 4) ^ table[0x0f & ((uint8_t)(crc >> (sizeof(crc) * 8 - 4)) ^ (uint8_t)(n >> (BS_WORDBITS - 4)))];
-        }
+    for (size_t i = 0; i < sp->capa; i ++) {
+        if (sp->slots[i].key != BS_SPARSE_EMPTY) { ent[n ++] = sp->slots[i]; }
     }
 
-    if (size > 0) {
-        int pad = BS_WORDBITS - size;
-        uintptr_t n = *p >> pad << pad;
-        for (; size >= 4; size -= 4, n <<= 4) {
-            crc = (crc << 4) ^ table[0x0f & ((uint8_t)(crc >> (sizeof(crc) * 8 - 4)) ^ (uint8_t)(n >> (BS_WORDBITS - 4)))];
-        }
-        if (size > 0) {
-            crc = (crc << size) ^ table[0x0f & ((uint8_t)(crc >> (sizeof(crc) * 8 - size)) ^ (uint8_t)(n >> (BS_WORDBITS - size)))];
-        }
-    }
+    qsort(ent, n, sizeof(*ent), aux_sparse_entry_cmp);
+    *entp = ent;
 
-#ifdef MRB_INT16
-    return ~crc >> 8;
-#else
-    return ~crc;
-#endif
+    return tmp;
 }
 
-MRB_API mrb_int
-mruby_bitset_hash(mrb_state *mrb, mrb_value bitset)
+/*
+ * call-seq:
+ *  to_indices -> array
+ *
+ * 1 が立っている位置を昇順に並べた配列を返す。
+ * 使用中のスロットだけをワード番号の順に並べ替えてから、各ワードの 1 を数え上げる。
+ * 負の位置は 2 の補数として扱うため、正の位置すべての後ろに並ぶ。
+ */
+static mrb_value
+bs_sparse_to_indices(mrb_state *mrb, mrb_value self)
 {
-    return bitset_hash(get_bitset(mrb, bitset));
+    mrb_get_args(mrb, "");
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sparse *sp = get_sparse(mrb, self);
+    mrb_value ary = mrb_ary_new_capa(mrb, sp->popcount);
+
+    if (sp->count == 0) { return ary; }
+
+    const struct bitset_sparse_entry *ent;
+    size_t n = sp->count;
+    aux_sparse_sorted(mrb, sp, &ent);
+
+    for (size_t i = 0; i < n; i ++) {
+        uint64_t base = ent[i].key * BS_WORDBITS;
+        for (uintptr_t w = ent[i].word; w != 0; ) {
+            int k = count_nlz(w);
+            mrb_ary_push(mrb, ary, mrb_fixnum_value((mrb_int)(base + k)));
+            w &= ~BS_INDEX_MASK(k);
+        }
+    }
+
+    return ary;
 }
 
 /*
- * 32ビット CRC (0x1edc6f41) あるいは 64ビット CRC (0x42f0e1eba9ea3693) による算出を行う。
- * ビットは左送り (CRC-32-MPEG-2 や CRC-64-ECMA のように)。0 を後置する (“appends n 0-bits”)。
- * 初期値 (内部状態の値) は -1 で、出力時に -1 で 排他的論理和を取る。
- * 1 段ハーフバイトテーブルによるアルゴリズムを用いる。
- * MRB_INT16 の場合は、32ビット CRC 値を算出し、8ビット右シフトして下位16ビットを取り出した値が使われる。
+ * call-seq:
+ *  each { |index| ... } -> self
+ *  each -> enumerator
+ *
+ * 1 が立っている位置を to_indices と同じ順に渡す。
+ * 配列は作らず、呼び出した時点のスロットを並べ替えた写しを辿る。
+ * そのためブロックの中で self を書き換えても、辿る位置は変わらない。
  */
 static mrb_value
-bs_hash(mrb_state *mrb, mrb_value self)
+bs_sparse_each(mrb_state *mrb, mrb_value self)
 {
-    mrb_get_args(mrb, "");
-    return mrb_fixnum_value(mruby_bitset_hash(mrb, self));
+    mrb_value block = mrb_nil_value();
+    mrb_get_args(mrb, "&", &block);
+    BS_STATS_CALL(mrb, self);
+
+    if (mrb_nil_p(block)) {
+        return mrb_funcall(mrb, self, "to_enum", 1, mrb_symbol_value(mrb_intern_lit(mrb, "each")));
+    }
+
+    const struct bitset_sparse *sp = get_sparse(mrb, self);
+
+    if (sp->count == 0) { return self; }
+
+    const struct bitset_sparse_entry *ent;
+    size_t n = sp->count;
+    aux_sparse_sorted(mrb, sp, &ent);
+    int ai = mrb_gc_arena_save(mrb);
+
+    for (size_t i = 0; i < n; i ++) {
+        uint64_t base = ent[i].key * BS_WORDBITS;
+        for (uintptr_t w = ent[i].word; w != 0; ) {
+            int k = count_nlz(w);
+            w &= ~BS_INDEX_MASK(k);
+            mrb_yield(mrb, block, mrb_fixnum_value((mrb_int)(base + k)));
+            mrb_gc_arena_restore(mrb, ai);
+        }
+    }
+
+    return self;
 }
 
 /*
- * TODO: bitset_digest/bitset_hexdigest/bitset_bindigest を共通化する
+ * call-seq:
+ *  to_bitset(from, size) -> bitset
+ *
+ * [from, from + size) の範囲を、先頭を from とする size ビットの Bitset として返す。
+ * 範囲のワード数が表の使用数より少なければ範囲のワードを一つずつ引き、そうでなければ表を辿る。
  */
-
-static struct RString *
-bitset_digest_common(mrb_state *mrb, const struct bitset *bs, int slicesize, int func(int, void *), void *opaque)
+static mrb_value
+bs_sparse_to_bitset(mrb_state *mrb, mrb_value self)
 {
-    size_t size = bitset_size(bs);
-    if (size == 0) { return RSTRING(mrb_str_new(mrb, NULL, 0)); }
+    mrb_int from, size;
+    mrb_get_args(mrb, "ii", &from, &size);
+    BS_STATS_CALL(mrb, self);
+    const struct bitset_sparse *sp = get_sparse(mrb, self);
+    uint64_t start = (uint64_t)from;
+    if (size < 0) { mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong negative bit size"); }
+    if (size > 0 && (uint64_t)size - 1 > UINT64_MAX - start) {
+        mrb_raise(mrb, E_RANGE_ERROR, "range exceeds 64-bit positions");
+    }
 
-    const uintptr_t *p = bitset_ptr_const(bs);
-    struct RString *digest = RSTRING(mrb_str_new(mrb, NULL, unit_ceil(size, slicesize)));
-    char *d = RSTR_PTR(digest);
+    struct bitset *dest;
+    mrb_value obj = bitset_new(mrb, NULL, &dest);
+    bitset_grow(mrb, dest, size);
+    uintptr_t *p = bitset_ptr(dest);
 
-    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
-        uintptr_t n = *p;
-        for (int i = BS_WORDBITS / slicesize; i > 0; i --, d ++, n <<= slicesize) {
-            *d = func(n >> (BS_WORDBITS - slicesize), opaque);
+    if (size == 0 || sp->count == 0) { return obj; }
+
+    uint64_t stop = start + (uint64_t)(size - 1);    /* 範囲の最後の位置; start + size は桁あふれしうる */
+    uint64_t first = start / BS_WORDBITS;
+    uint64_t last = stop / BS_WORDBITS;
+
+    for (size_t i = 0; ; i ++) {
+        const struct bitset_sparse_entry *e;
+        struct bitset_sparse_entry probe;
+
+        if (last - first < sp->count) {
+            if (i > last - first) { break; }
+            probe.key = first + i;
+            probe.word = bitset_sparse_get(sp, probe.key);
+            e = &probe;
+        } else {
+            if (i >= sp->capa) { break; }
+            e = &sp->slots[i];
+            if (e->key == BS_SPARSE_EMPTY || e->key < first || e->key > last) { continue; }
         }
-    }
 
-    if (size > 0) {
-        int pad = BS_WORDBITS - size;
-        uintptr_t n = *p >> pad << pad;
-        size += pad % slicesize; /* slicesize ビット境界を強制する */
-        for (; size > 0; size -= slicesize, d ++, n <<= slicesize) {
-            *d = func(n >> (BS_WORDBITS - slicesize), opaque);
+        uint64_t base = e->key * BS_WORDBITS;
+        for (uintptr_t w = e->word; w != 0; ) {
+            int k = count_nlz(w);
+            w &= ~BS_INDEX_MASK(k);
+            if (base + k < start || base + k > stop) { continue; }
+            size_t j = base + k - start;
+            p[j / BS_WORDBITS] |= BS_INDEX_MASK(j);
         }
     }
 
-    return digest;
+    return obj;
 }
 
-static int
-bitset_digest_char(int code, void *opaque)
+#ifdef MRUBY_BITSET_STATS
+/*
+ * 呼び出し回数はビット長によって振り分ける。
+ * embed: BS_EMBEDBITS 以下, small: 64 Kibit 以下, medium: 16 Mibit 以下, large: それ以上
+ */
+enum { BS_STATS_BUCKETS = 4 };
+
+struct bitset_stats_call
 {
-    return code;
-}
+    mrb_sym mid;
+    uint64_t count[BS_STATS_BUCKETS];
+};
 
-static struct RString *
-bitset_digest(mrb_state *mrb, const struct bitset *bs)
+struct bitset_stats
 {
-    return bitset_digest_common(mrb, bs, 8, bitset_digest_char, NULL);
+    uint64_t alloc, alloc_bytes;
+    uint64_t realloc, realloc_bytes;
+    uint64_t promote, demote;
+    uint64_t slide, slide_bits;
+
+    size_t ncalls, capacity;
+    struct bitset_stats_call *calls;
+};
+
+static void
+bitset_stats_free(mrb_state *mrb, void *ptr)
+{
+    if (ptr) {
+        struct bitset_stats *p = (struct bitset_stats *)ptr;
+        mrb_free(mrb, p->calls);
+        mrb_free(mrb, p);
+    }
 }
 
-MRB_API struct RString *
-mruby_bitset_digest(mrb_state *mrb, mrb_value bitset)
+static const mrb_data_type bitset_stats_type = { "stats@mruby-bitset", bitset_stats_free };
+
+/*
+ * Bitset クラスの (ruby からは見えない) インスタンス変数に保持している。
+ */
+static struct bitset_stats *
+bitset_stats_get(mrb_state *mrb)
 {
-    return bitset_digest(mrb, get_bitset(mrb, bitset));
+    struct RClass *klass = mrb_class_get(mrb, "Bitset");
+    mrb_value obj = mrb_iv_get(mrb, mrb_obj_value(klass), mrb_intern_lit(mrb, "bitset_stats"));
+
+    if (mrb_type(obj) != MRB_TT_DATA || DATA_TYPE(obj) != &bitset_stats_type) { return NULL; }
+
+    return (struct bitset_stats *)DATA_PTR(obj);
 }
 
-static mrb_value
-bs_digest(mrb_state *mrb, mrb_value self)
+static void
+bitset_stats_init(mrb_state *mrb, struct RClass *klass)
 {
-    mrb_get_args(mrb, "");
-    return mrb_obj_value(mruby_bitset_digest(mrb, self));
+    struct RData *obj = mrb_data_object_alloc(mrb, mrb->object_class, NULL, &bitset_stats_type);
+    obj->data = mrb_calloc(mrb, 1, sizeof(struct bitset_stats));
+    mrb_iv_set(mrb, mrb_obj_value(klass), mrb_intern_lit(mrb, "bitset_stats"), mrb_obj_value(obj));
 }
 
-static int
-bitset_hexdigest_char(int code, void *opaque)
+static void
+bitset_stats_alloc(mrb_state *mrb, size_t bytes)
 {
-    static const char table[] = {
-        '0', '1', '2', '3', '4', '5', '6', '7',
-        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
-    };
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (st) { st->alloc ++; st->alloc_bytes += bytes; }
+}
 
-    return table[code];
+static void
+bitset_stats_realloc(mrb_state *mrb, size_t bytes)
+{
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (st) { st->realloc ++; st->realloc_bytes += bytes; }
 }
 
-static struct RString *
-bitset_hexdigest(mrb_state *mrb, const struct bitset *bs)
+static void
+bitset_stats_promote(mrb_state *mrb)
 {
-    return bitset_digest_common(mrb, bs, 4, bitset_hexdigest_char, NULL);
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (st) { st->promote ++; }
 }
 
-MRB_API struct RString *
-mruby_bitset_hexdigest(mrb_state *mrb, mrb_value bitset)
+static void
+bitset_stats_demote(mrb_state *mrb)
 {
-    return bitset_hexdigest(mrb, get_bitset(mrb, bitset));
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (st) { st->demote ++; }
 }
 
-static mrb_value
-bs_hexdigest(mrb_state *mrb, mrb_value self)
+static void
+bitset_stats_slide(mrb_state *mrb, size_t bits)
 {
-    mrb_get_args(mrb, "");
-    return mrb_obj_value(mruby_bitset_hexdigest(mrb, self));
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (st) { st->slide ++; st->slide_bits += bits; }
 }
 
-static struct RString *
-bitset_bindigest(mrb_state *mrb, const struct bitset *bs)
+/*
+ * 呼び出されているメソッド名 (別名であればその名前) ごとに数える。
+ */
+static void
+bitset_stats_call(mrb_state *mrb, mrb_value self)
 {
-    size_t size = bitset_size(bs);
-    if (size == 0) { return RSTRING(mrb_str_new(mrb, NULL, 0)); }
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (!st) { return; }
 
-    const uintptr_t *head = bitset_ptr_const(bs);
-    const uintptr_t *p = head;
-    const size_t space8  = (size - 1) /  8; /* 8 ビットごとの区切り */
-    const size_t space32 = (size - 1) / 32; /* 32 ビットごとの区切り */
-    struct RString *digest = RSTRING(mrb_str_new(mrb, NULL, size + space8 + space32));
-    char *d = RSTR_PTR(digest);
+    size_t size = 0;
+    if (mrb_type(self) == MRB_TT_DATA && DATA_TYPE(self) == &bitset_type && DATA_PTR(self)) {
+        size = bitset_size((const struct bitset *)DATA_PTR(self));
+    }
 
-    for (; size >= BS_WORDBITS; size -= BS_WORDBITS, p ++) {
-        uintptr_t n = *p;
-        for (int i = BS_WORDBITS; i > 0; i --, d ++, n <<= 1) {
-            if (i != BS_WORDBITS) {
-                if (i % 8 == 0) { *d ++ = ' '; }
-                if (i % 32 == 0) { *d ++ = ' '; }
-            }
-            *d = '0' + (n >> (BS_WORDBITS - 1));
+    int bucket = size <= BS_EMBEDBITS ? 0 :
+                 size <= ((size_t)1 << 16) ? 1 :
+                 size <= ((size_t)1 << 24) ? 2 : 3;
+
+    mrb_sym mid = mrb->c->ci->mid;
+    struct bitset_stats_call *p = st->calls;
+    struct bitset_stats_call *end = p + st->ncalls;
+    for (; p < end && p->mid != mid; p ++) { }
+
+    if (p == end) {
+        if (st->ncalls >= st->capacity) {
+            size_t capa = st->capacity < 16 ? 16 : st->capacity * 2;
+            st->calls = mrb_realloc(mrb, st->calls, capa * sizeof(*st->calls));
+            st->capacity = capa;
+            p = st->calls + st->ncalls;
         }
 
-        if (size > 0) {
-            *d ++ = ' ';
-            *d ++ = ' ';
-        }
+        memset(p, 0, sizeof(*p));
+        p->mid = mid;
+        st->ncalls ++;
     }
 
-    if (size > 0) {
-        int pad = BS_WORDBITS - size;
-        uintptr_t n = *p >> pad << pad;
+    p->count[bucket] ++;
+}
+#endif /* MRUBY_BITSET_STATS */
 
-        for (int i = BS_WORDBITS; i > pad; i --, d ++, n <<= 1) {
-            if (i != BS_WORDBITS) {
-                if (i % 8 == 0) { *d ++ = ' '; }
-                if (i % 32 == 0) { *d ++ = ' '; }
-            }
-            *d = '0' + (n >> (BS_WORDBITS - 1));
+/*
+ * call-seq:
+ *  Bitset.stats -> hash or nil
+ *
+ * MRUBY_BITSET_STATS を定義してビルドした場合、計数した結果をハッシュで返す。
+ * そうでなければ nil を返す。
+ */
+static mrb_value
+bs_s_stats(mrb_state *mrb, mrb_value klass)
+{
+    mrb_get_args(mrb, "");
+
+#ifdef MRUBY_BITSET_STATS
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (!st) { return mrb_nil_value(); }
+
+    static const char *const bucket_names[BS_STATS_BUCKETS] = { "embed", "small", "medium", "large" };
+    mrb_value hash = mrb_hash_new(mrb);
+
+#define STATS_SET(H, NAME, VALUE)                                           \
+    mrb_hash_set(mrb, H,                                                    \
+                 mrb_symbol_value(mrb_intern_lit(mrb, NAME)),               \
+                 mrb_fixnum_value((mrb_int)(VALUE)))                        \
+
+    STATS_SET(hash, "alloc", st->alloc);
+    STATS_SET(hash, "alloc_bytes", st->alloc_bytes);
+    STATS_SET(hash, "realloc", st->realloc);
+    STATS_SET(hash, "realloc_bytes", st->realloc_bytes);
+    STATS_SET(hash, "promote", st->promote);
+    STATS_SET(hash, "demote", st->demote);
+    STATS_SET(hash, "slide", st->slide);
+    STATS_SET(hash, "slide_bits", st->slide_bits);
+
+    mrb_value calls = mrb_hash_new_capa(mrb, st->ncalls);
+    for (size_t i = 0; i < st->ncalls; i ++) {
+        mrb_value counts = mrb_hash_new_capa(mrb, BS_STATS_BUCKETS);
+        for (int j = 0; j < BS_STATS_BUCKETS; j ++) {
+            mrb_hash_set(mrb, counts,
+                         mrb_symbol_value(mrb_intern_cstr(mrb, bucket_names[j])),
+                         mrb_fixnum_value((mrb_int)st->calls[i].count[j]));
         }
+        mrb_hash_set(mrb, calls, mrb_symbol_value(st->calls[i].mid), counts);
     }
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "calls")), calls);
 
-    return digest;
-}
+#undef STATS_SET
 
-MRB_API struct RString *
-mruby_bitset_bindigest(mrb_state *mrb, mrb_value bitset)
-{
-    return bitset_bindigest(mrb, get_bitset(mrb, bitset));
+    return hash;
+#else
+    return mrb_nil_value();
+#endif
 }
 
+/*
+ * call-seq:
+ *  Bitset.reset_stats -> nil
+ *
+ * 計数した結果を全て 0 に戻す。
+ */
 static mrb_value
-bs_bindigest(mrb_state *mrb, mrb_value self)
+bs_s_reset_stats(mrb_state *mrb, mrb_value klass)
 {
     mrb_get_args(mrb, "");
-    return mrb_obj_value(mruby_bitset_bindigest(mrb, self));
+
+#ifdef MRUBY_BITSET_STATS
+    struct bitset_stats *st = bitset_stats_get(mrb);
+    if (st) {
+        struct bitset_stats_call *calls = st->calls;
+        size_t capacity = st->capacity;
+        memset(st, 0, sizeof(*st));
+        st->calls = calls;
+        st->capacity = capacity;
+    }
+#endif
+
+    return mrb_nil_value();
 }
 
 void
 mrb_mruby_bitset_gem_init(mrb_state *mrb)
 {
+#ifndef MRUBY_BITSET_FAST_HASH
+    crc_table_init();
+#endif
+    bitset_pbits_init();
+
     struct RClass *bs = mrb_define_class(mrb, "Bitset", mrb->object_class);
     mrb_include_module(mrb, bs, mrb_module_get(mrb, "Enumerable"));
 
@@ -1990,6 +8450,12 @@ mrb_mruby_bitset_gem_init(mrb_state *mrb)
 
     MRB_SET_INSTANCE_TT(bs, MRB_TT_DATA);
 
+#ifdef MRUBY_BITSET_STATS
+    bitset_stats_init(mrb, bs);
+#endif
+    mrb_define_class_method(mrb, bs, "stats", bs_s_stats, MRB_ARGS_NONE());          /* MRUBY_BITSET_STATS による計数結果 */
+    mrb_define_class_method(mrb, bs, "reset_stats", bs_s_reset_stats, MRB_ARGS_NONE());
+
     mrb_define_method(mrb, bs, "initialize", bs_init, MRB_ARGS_ANY());
     mrb_define_method(mrb, bs, "initialize_copy", bs_init_copy, MRB_ARGS_ANY());
     mrb_define_method(mrb, bs, "size", bs_size, MRB_ARGS_NONE());
@@ -2003,10 +8469,32 @@ mrb_mruby_bitset_gem_init(mrb_state *mrb)
 
     mrb_define_method(mrb, bs, "aref", bs_aref, MRB_ARGS_ARG(1, 1));
     mrb_define_method(mrb, bs, "aset", bs_aset, MRB_ARGS_ARG(2, 2));
+    mrb_define_method(mrb, bs, "test?", bs_test_p, MRB_ARGS_REQ(1));                /* 1 ビットの取得; 真偽値を返す */
+    mrb_define_method(mrb, bs, "set!", bs_set_bang, MRB_ARGS_REQ(1));               /* 1 ビットを 1 にする */
+    mrb_define_method(mrb, bs, "reset!", bs_reset_bang, MRB_ARGS_REQ(1));           /* 1 ビットを 0 にする */
+    mrb_define_method(mrb, bs, "toggle!", bs_toggle_bang, MRB_ARGS_REQ(1));         /* 1 ビットを反転する */
+    mrb_define_method(mrb, bs, "test_and_set!", bs_test_and_set_bang, MRB_ARGS_REQ(1));     /* 1 ビットを 1 にして、以前の値を返す */
+    mrb_define_method(mrb, bs, "test_and_reset!", bs_test_and_reset_bang, MRB_ARGS_REQ(1)); /* 1 ビットを 0 にして、以前の値を返す */
+    mrb_define_method(mrb, bs, "set_indices!", bs_set_indices_bang, MRB_ARGS_ARG(1, 1));    /* 添字の配列が示す位置に 1 を立てる */
+    mrb_define_method(mrb, bs, "to_indices", bs_to_indices, MRB_ARGS_NONE());       /* 1 が立っている位置の配列を返す */
+    mrb_define_method(mrb, bs, "set_many!", bs_set_many_bang, MRB_ARGS_ARG(1, 2));  /* 添字の配列が示す位置をまとめて設定する */
+    mrb_define_method(mrb, bs, "toggle_many!", bs_toggle_many_bang, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, bs, "values_at", bs_values_at, MRB_ARGS_ARG(1, 1));      /* 添字の配列が示す位置をまとめて取得する */
+    mrb_define_class_method(mrb, bs, "from_indices", bs_s_from_indices, MRB_ARGS_ARG(1, 2));
 
     mrb_define_method(mrb, bs, "popcount", bs_popcount, MRB_ARGS_ANY());            /* 1 の数を取得する; POPCNT */
+    mrb_define_method(mrb, bs, "track!", bs_track_bang, MRB_ARGS_NONE());           /* 1 の数を常に追跡する */
+    mrb_define_method(mrb, bs, "untrack!", bs_untrack_bang, MRB_ARGS_NONE());
+    mrb_define_method(mrb, bs, "tracked?", bs_tracked_p, MRB_ARGS_NONE());
+    mrb_define_method(mrb, bs, "summarize!", bs_summarize_bang, MRB_ARGS_NONE());   /* 0 ではないワードの階層的な要約を持つ */
+    mrb_define_method(mrb, bs, "unsummarize!", bs_unsummarize_bang, MRB_ARGS_NONE());
+    mrb_define_method(mrb, bs, "summarized?", bs_summarized_p, MRB_ARGS_NONE());
     mrb_define_method(mrb, bs, "clz", bs_clz, MRB_ARGS_ANY());                      /* MSB から連続する 0 ビットを数える; Number of Leading Zero */
     mrb_define_method(mrb, bs, "ctz", bs_ctz, MRB_ARGS_ANY());                      /* LSB から連続する 0 ビットを数える; Number of Trailing Zero */
+    mrb_define_method(mrb, bs, "next_one", bs_next_one, MRB_ARGS_OPT(1));           /* 指定位置以降で最初の 1 ビットの位置 */
+    mrb_define_method(mrb, bs, "next_zero", bs_next_zero, MRB_ARGS_OPT(1));         /* 指定位置以降で最初の 0 ビットの位置 */
+    mrb_define_method(mrb, bs, "prev_one", bs_prev_one, MRB_ARGS_OPT(1));           /* 指定位置以前で最後の 1 ビットの位置 */
+    mrb_define_method(mrb, bs, "prev_zero", bs_prev_zero, MRB_ARGS_OPT(1));         /* 指定位置以前で最後の 0 ビットの位置 */
     mrb_define_method(mrb, bs, "parity", bs_parity, MRB_ARGS_ANY());                /* 1 ビットパリティを求める */
     mrb_define_method(mrb, bs, "all?", bs_all, MRB_ARGS_ANY());                     /* 全てが 1 であれば真 */
     mrb_define_method(mrb, bs, "any?", bs_any, MRB_ARGS_ANY());                     /* どこかが 1 であれば真 */
@@ -2018,6 +8506,15 @@ mrb_mruby_bitset_gem_init(mrb_state *mrb)
     mrb_define_method(mrb, bs, "flip!", bs_flip_bang, MRB_ARGS_ANY());
     mrb_define_method(mrb, bs, "minus", bs_minus, MRB_ARGS_ANY());                  /* ニの補数表現 */
     mrb_define_method(mrb, bs, "minus!", bs_minus_bang, MRB_ARGS_ANY());
+    mrb_define_method(mrb, bs, "add!", bs_add_bang, MRB_ARGS_ARG(1, 1));            /* 固定幅の符号なし整数として足す */
+    mrb_define_method(mrb, bs, "sub!", bs_sub_bang, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, bs, "inc!", bs_inc_bang, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, bs, "dec!", bs_dec_bang, MRB_ARGS_OPT(1));
+    mrb_define_method(mrb, bs, "extract", bs_extract, MRB_ARGS_REQ(1));              /* mask の位置のビットを詰める (pext) */
+    mrb_define_method(mrb, bs, "deposit", bs_deposit, MRB_ARGS_REQ(2));              /* mask の位置へビットを配る (pdep) */
+    mrb_define_method(mrb, bs, "deposit!", bs_deposit_bang, MRB_ARGS_REQ(2));
+    mrb_define_class_method(mrb, bs, "interleave", bs_s_interleave, MRB_ARGS_ANY());  /* 1 ビットずつ交互に並べる (Morton 順序) */
+    mrb_define_method(mrb, bs, "deinterleave", bs_deinterleave, MRB_ARGS_REQ(1));
     mrb_define_method(mrb, bs, "msb_or", bs_msb_or, MRB_ARGS_ANY());
     mrb_define_method(mrb, bs, "lsb_or", bs_lsb_or, MRB_ARGS_ANY());
     mrb_define_method(mrb, bs, "msb_nor", bs_msb_nor, MRB_ARGS_ANY());
@@ -2031,12 +8528,118 @@ mrb_mruby_bitset_gem_init(mrb_state *mrb)
     mrb_define_method(mrb, bs, "msb_xnor", bs_msb_xnor, MRB_ARGS_ANY());
     mrb_define_method(mrb, bs, "lsb_xnor", bs_lsb_xnor, MRB_ARGS_ANY());
 
+    struct RClass *expr = mrb_define_class_under(mrb, bs, "Expr", mrb->object_class);
+    mrb_define_class_method(mrb, expr, "evaluate", bs_expr_s_evaluate, MRB_ARGS_REQ(3)); /* 後置記法の命令列をワードのブロックごとに一度で評価する */
+
     mrb_define_method(mrb, bs, "eql?", bs_eql, MRB_ARGS_ANY());
+    mrb_define_method(mrb, bs, "==", bs_equal, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bs, "<=>", bs_cmp, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bs, "cmp_numeric", bs_cmp_numeric, MRB_ARGS_REQ(1));
     mrb_define_method(mrb, bs, "hash", bs_hash, MRB_ARGS_ANY());
 
     mrb_define_method(mrb, bs, "digest", bs_digest, MRB_ARGS_ANY());
+    mrb_define_method(mrb, bs, "to_bytes", bs_to_bytes, MRB_ARGS_OPT(1));
+    mrb_define_class_method(mrb, bs, "from_bytes", bs_s_from_bytes, MRB_ARGS_ARG(1, 2));
     mrb_define_method(mrb, bs, "hexdigest", bs_hexdigest, MRB_ARGS_ANY());
     mrb_define_method(mrb, bs, "bindigest", bs_bindigest, MRB_ARGS_ANY());
+    mrb_define_method(mrb, bs, "write_hex", bs_write_hex, MRB_ARGS_REQ(1));               /* 固定長のバッファで少しずつ書き出す */
+    mrb_define_method(mrb, bs, "write_bin", bs_write_bin, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bs, "write_raw", bs_write_raw, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, bs, "each_hex_chunk", bs_each_hex_chunk, MRB_ARGS_OPT(1));
+
+    struct RClass *fixed = mrb_define_class_under(mrb, bs, "Fixed", bs);
+    MRB_SET_INSTANCE_TT(fixed, MRB_TT_DATA);
+    mrb_define_method(mrb, fixed, "initialize", bs_fixed_init, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, fixed, "aset", bs_fixed_aset, MRB_ARGS_ARG(2, 2));        /* 1 ビットの書き込みは範囲の確認とマスクのみ */
+    mrb_define_method(mrb, fixed, "[]=", bs_fixed_aset, MRB_ARGS_ARG(2, 2));
+
+    struct RClass *alloc = mrb_define_class_under(mrb, bs, "Allocator", mrb->object_class);
+    MRB_SET_INSTANCE_TT(alloc, MRB_TT_DATA);
+    mrb_define_method(mrb, alloc, "initialize", bs_allocator_init, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, alloc, "initialize_copy", bs_allocator_init_copy, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, alloc, "alloc", bs_allocator_alloc, MRB_ARGS_REQ(1));               /* 連続した空きを割り当てる */
+    mrb_define_method(mrb, alloc, "free", bs_allocator_free, MRB_ARGS_ARG(1, 1));              /* 割り当てた範囲を空きに戻す */
+    mrb_define_method(mrb, alloc, "allocated?", bs_allocator_allocated_p, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, alloc, "largest_free_run", bs_allocator_largest_free_run, MRB_ARGS_NONE()); /* 最長の空きの長さ */
+    mrb_define_method(mrb, alloc, "size", bs_allocator_size, MRB_ARGS_NONE());
+    mrb_define_method(mrb, alloc, "used_count", bs_allocator_used_count, MRB_ARGS_NONE());
+    mrb_define_method(mrb, alloc, "free_count", bs_allocator_free_count, MRB_ARGS_NONE());
+    mrb_define_method(mrb, alloc, "policy", bs_allocator_policy, MRB_ARGS_NONE());
+    mrb_define_method(mrb, alloc, "policy=", bs_allocator_set_policy, MRB_ARGS_REQ(1));      /* :first_fit, :next_fit, :best_fit */
+    mrb_define_method(mrb, alloc, "to_bitset", bs_allocator_to_bitset, MRB_ARGS_NONE());
+
+    struct RClass *bloom = mrb_define_class_under(mrb, bs, "Bloom", mrb->object_class);
+    MRB_SET_INSTANCE_TT(bloom, MRB_TT_DATA);
+    mrb_define_class_method(mrb, bloom, "from_bytes", bs_bloom_s_from_bytes, MRB_ARGS_ARG(2, 1));
+    mrb_define_method(mrb, bloom, "initialize", bs_bloom_init, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, bloom, "initialize_copy", bs_bloom_init_copy, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "add", bs_bloom_add, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "<<", bs_bloom_add, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "add_all", bs_bloom_add_all, MRB_ARGS_REQ(1));               /* 配列の全ての要素を加える */
+    mrb_define_method(mrb, bloom, "include?", bs_bloom_include_p, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "include_all?", bs_bloom_include_all_p, MRB_ARGS_REQ(1));    /* 配列の全ての要素が含まれていれば真 */
+    mrb_define_method(mrb, bloom, "union", bs_bloom_union, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "|", bs_bloom_union, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "intersect", bs_bloom_intersect, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "&", bs_bloom_intersect, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, bloom, "bitsize", bs_bloom_bitsize, MRB_ARGS_NONE());
+    mrb_define_method(mrb, bloom, "hashes", bs_bloom_hashes, MRB_ARGS_NONE());
+    mrb_define_method(mrb, bloom, "popcount", bs_bloom_popcount, MRB_ARGS_NONE());
+    mrb_define_method(mrb, bloom, "clear", bs_bloom_clear, MRB_ARGS_NONE());
+    mrb_define_method(mrb, bloom, "to_bytes", bs_bloom_to_bytes, MRB_ARGS_NONE());            /* ビット列をそのまま書き出す */
+    mrb_define_method(mrb, bloom, "to_bitset", bs_bloom_to_bitset, MRB_ARGS_NONE());
+
+    struct RClass *sliced = mrb_define_class_under(mrb, bs, "SlicedIndex", mrb->object_class);
+    MRB_SET_INSTANCE_TT(sliced, MRB_TT_DATA);
+    mrb_define_method(mrb, sliced, "initialize", bs_sliced_init, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, sliced, "initialize_copy", bs_sliced_init_copy, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "[]", bs_sliced_aref, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "[]=", bs_sliced_aset, MRB_ARGS_REQ(2));
+    mrb_define_method(mrb, sliced, "size", bs_sliced_size, MRB_ARGS_NONE());                /* 行数 */
+    mrb_define_method(mrb, sliced, "slices", bs_sliced_slices, MRB_ARGS_NONE());            /* スライスの数 (値のビット数) */
+    mrb_define_method(mrb, sliced, "to_a", bs_sliced_to_a, MRB_ARGS_NONE());
+    mrb_define_method(mrb, sliced, "eq", bs_sliced_eq, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "ne", bs_sliced_ne, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "lt", bs_sliced_lt, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "le", bs_sliced_le, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "gt", bs_sliced_gt, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "ge", bs_sliced_ge, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sliced, "between", bs_sliced_between, MRB_ARGS_REQ(2));          /* 値が [min, max] に収まる行 */
+    mrb_define_method(mrb, sliced, "sum", bs_sliced_sum, MRB_ARGS_OPT(1));                  /* filter の行の値の合計 */
+    mrb_define_method(mrb, sliced, "top_k", bs_sliced_top_k, MRB_ARGS_REQ(1));              /* 値の大きい順に k 行 */
+
+    struct RClass *matrix = mrb_define_class_under(mrb, bs, "Matrix", mrb->object_class);
+    MRB_SET_INSTANCE_TT(matrix, MRB_TT_DATA);
+    mrb_define_class_method(mrb, matrix, "from_rows", bs_matrix_s_from_rows, MRB_ARGS_ARG(1, 1));
+    mrb_define_method(mrb, matrix, "initialize", bs_matrix_init, MRB_ARGS_REQ(2));
+    mrb_define_method(mrb, matrix, "initialize_copy", bs_matrix_init_copy, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, matrix, "rows", bs_matrix_rows, MRB_ARGS_NONE());
+    mrb_define_method(mrb, matrix, "cols", bs_matrix_cols, MRB_ARGS_NONE());
+    mrb_define_method(mrb, matrix, "[]", bs_matrix_aref, MRB_ARGS_REQ(2));
+    mrb_define_method(mrb, matrix, "[]=", bs_matrix_aset, MRB_ARGS_REQ(3));
+    mrb_define_method(mrb, matrix, "row", bs_matrix_row, MRB_ARGS_REQ(1));                  /* 行を複製せずに Bitset::Fixed として返す */
+    mrb_define_method(mrb, matrix, "to_a", bs_matrix_to_a, MRB_ARGS_NONE());
+    mrb_define_method(mrb, matrix, "transpose", bs_matrix_transpose, MRB_ARGS_NONE());      /* ワード幅の正方ブロックごとに転置 */
+    mrb_define_method(mrb, matrix, "multiply", bs_matrix_multiply, MRB_ARGS_REQ(1));        /* Four Russians による論理積・論理和の積 */
+    mrb_define_method(mrb, matrix, "*", bs_matrix_multiply, MRB_ARGS_REQ(1));
+
+    struct RClass *sparse = mrb_define_class_under(mrb, bs, "Sparse", mrb->object_class);
+    MRB_SET_INSTANCE_TT(sparse, MRB_TT_DATA);
+    mrb_include_module(mrb, sparse, mrb_module_get(mrb, "Enumerable"));
+    mrb_define_method(mrb, sparse, "initialize", bs_sparse_init, MRB_ARGS_NONE());
+    mrb_define_method(mrb, sparse, "initialize_copy", bs_sparse_init_copy, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sparse, "[]", bs_sparse_aref, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sparse, "[]=", bs_sparse_aset, MRB_ARGS_REQ(2));
+    mrb_define_method(mrb, sparse, "popcount", bs_sparse_popcount, MRB_ARGS_NONE());
+    mrb_define_method(mrb, sparse, "empty?", bs_sparse_empty_p, MRB_ARGS_NONE());
+    mrb_define_method(mrb, sparse, "clear", bs_sparse_clear, MRB_ARGS_NONE());
+    mrb_define_method(mrb, sparse, "|", bs_sparse_or, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sparse, "&", bs_sparse_and, MRB_ARGS_REQ(1));                   /* 小さい方の表だけを辿る */
+    mrb_define_method(mrb, sparse, "^", bs_sparse_xor, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sparse, "-", bs_sparse_andnot, MRB_ARGS_REQ(1));
+    mrb_define_method(mrb, sparse, "to_indices", bs_sparse_to_indices, MRB_ARGS_NONE());   /* 昇順 */
+    mrb_define_method(mrb, sparse, "each", bs_sparse_each, MRB_ARGS_BLOCK());             /* to_indices の配列を作らずに辿る */
+    mrb_define_method(mrb, sparse, "to_bitset", bs_sparse_to_bitset, MRB_ARGS_REQ(2));     /* [from, from + size) を Bitset にする */
 }
 
 void
@@ -2068,3 +8671,132 @@ mruby_bitset_aset(mrb_state *mrb, mrb_value bitset, intptr_t index, int width, u
 {
     bitset_aset(mrb, bitset, index, width, bits, bitwidth);
 }
+
+void
+mruby_bitset_aset_bitset(mrb_state *mrb, mrb_value bitset, intptr_t index, int width, mrb_value bits, int bitwidth)
+{
+    bitset_aset_bitset(mrb, bitset, index, width, get_bitset(mrb, bits), bitwidth);
+}
+
+void
+mruby_bitset_resize(mrb_state *mrb, mrb_value bitset, size_t bitsize)
+{
+    bitset_resize(mrb, get_bitset_for_modify(mrb, bitset), bitsize);
+}
+
+size_t
+mruby_bitset_capacity(mrb_state *mrb, mrb_value bitset)
+{
+    return bitset_capacity(get_bitset(mrb, bitset));
+}
+
+void
+mruby_bitset_flip(mrb_state *mrb, mrb_value bitset)
+{
+    flip_bitset(mrb, get_bitset_for_modify(mrb, bitset));
+}
+
+void
+mruby_bitset_reverse(mrb_state *mrb, mrb_value bitset)
+{
+    bitset_bitreflect(mrb, get_bitset_for_modify(mrb, bitset), NULL);
+}
+
+void
+mruby_bitset_borrow(mrb_state *mrb, mrb_value bitset, struct mruby_bitset_borrowed *borrowed)
+{
+    struct bitset *bs = get_bitset(mrb, bitset);
+    borrowed->words = bitset_ptr(bs);
+    borrowed->size = bitset_size(bs);
+    borrowed->bit_order = MRUBY_BITSET_MSB_FIRST;
+}
+
+void
+mruby_bitset_borrow_for_modify(mrb_state *mrb, mrb_value bitset, struct mruby_bitset_borrowed *borrowed)
+{
+    get_bitset_for_modify(mrb, bitset);
+    mruby_bitset_borrow(mrb, bitset, borrowed);
+}
+
+void
+mruby_bitset_modified(mrb_state *mrb, mrb_value bitset)
+{
+    struct bitset *bs = get_bitset_for_modify(mrb, bitset);
+
+    if (bs->is_tracked) {
+        bs->popcount = bitset_popcount_scan(bs);
+    }
+
+    bitset_summary_rebuild(mrb, bs);
+}
+
+void
+mruby_bitset_read_range(mrb_state *mrb, mrb_value bitset, size_t index, size_t width, uintptr_t *dest)
+{
+    bitset_read_range(get_bitset(mrb, bitset), index, width, dest);
+}
+
+void
+mruby_bitset_write_range(mrb_state *mrb, mrb_value bitset, size_t index, size_t width, const uintptr_t *src)
+{
+    bitset_write_range(mrb, get_bitset_for_modify(mrb, bitset), index, width, src);
+}
+
+static void
+aux_operate_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b, operator_f *operator)
+{
+    const struct bitset *bs1 = get_bitset(mrb, a);
+    const struct bitset *bs2 = get_bitset(mrb, b);
+    bitset_operate_into(mrb, get_bitset_for_modify(mrb, dest), bs1, bs2, operator);
+}
+
+void
+mruby_bitset_or_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b)
+{
+    aux_operate_into(mrb, dest, a, b, operator_or);
+}
+
+void
+mruby_bitset_nor_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b)
+{
+    aux_operate_into(mrb, dest, a, b, operator_nor);
+}
+
+void
+mruby_bitset_and_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b)
+{
+    aux_operate_into(mrb, dest, a, b, operator_and);
+}
+
+void
+mruby_bitset_nand_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b)
+{
+    aux_operate_into(mrb, dest, a, b, operator_nand);
+}
+
+void
+mruby_bitset_xor_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b)
+{
+    aux_operate_into(mrb, dest, a, b, operator_xor);
+}
+
+void
+mruby_bitset_xnor_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b)
+{
+    aux_operate_into(mrb, dest, a, b, operator_xnor);
+}
+
+void
+mruby_bitset_andnot_into(mrb_state *mrb, mrb_value dest, mrb_value a, mrb_value b)
+{
+    aux_operate_into(mrb, dest, a, b, operator_andnot);
+}
+
+void
+mruby_bitset_flip_into(mrb_state *mrb, mrb_value dest, mrb_value src)
+{
+    /* 長さ 0 のビット列との nor は ~src となる */
+    struct bitset empty = { 0 };
+    empty.is_embed = 1;
+    bitset_operate_into(mrb, get_bitset_for_modify(mrb, dest), get_bitset(mrb, src), &empty, operator_nor);
+}
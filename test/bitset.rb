@@ -19,6 +19,542 @@ assert "aset and aref" do
   assert_equal 0, bs[1]
 end
 
+assert "aset with a different bit width" do
+  s = "10" * 50
+  bs = Bitset.new(s)
+  bs.aset(60, 2, 9, 0x1ff)
+  assert_equal Bitset.new(s[0, 60] + "1" * 9 + s[62..-1]), bs
+  bs = Bitset.new(s)
+  bs.aset(5, 30, 1, 1)
+  assert_equal Bitset.new(s[0, 5] + "1" + s[35..-1]), bs
+  bs = Bitset.new("101")
+  bs.aset(6, 2, 3, 7)
+  assert_equal Bitset.new("101000111"), bs
+end
+
+assert "aset with a bitset" do
+  bs = Bitset.new("00000000")
+  bs[2, 3] = Bitset.new("111")
+  assert_equal Bitset.new("00111000"), bs
+
+  # 伸ばす・縮める
+  bs = Bitset.new("10000001")
+  bs[1, 1] = Bitset.new("111")
+  assert_equal Bitset.new("1111000001"), bs
+  bs[1, 5] = Bitset.new("0")
+  assert_equal Bitset.new("100001"), bs
+  s = "10" * 50
+  t = s[0, 3] + "1" * 80 + s[73..-1]
+  bs = Bitset.new(s)
+  bs[3, 70] = Bitset.new("1" * 80)
+  assert_equal Bitset.new(t), bs
+  bs.aset(0, 90, 0, Bitset.new("1"))
+  assert_equal Bitset.new(t[90..-1]), bs
+
+  # 末尾を超えた位置は 0 で埋めてから書き込む
+  bs = Bitset.new("101")
+  bs[6, 2] = Bitset.new("11")
+  assert_equal Bitset.new("10100011"), bs
+
+  # 短い bitset は 0 で補う
+  bs = Bitset.new("10110")
+  bs.aset(1, 3, 3, Bitset.new("1"))
+  assert_equal Bitset.new("11000"), bs
+
+  # 自分自身を書き込む
+  bs = Bitset.new("1100")
+  bs[2, 2] = bs
+  assert_equal Bitset.new("111100"), bs
+  bs = Bitset.new("1100")
+  bs[0, 0] = bs
+  assert_equal Bitset.new("11001100"), bs
+
+  fixed = Bitset::Fixed.new(8)
+  fixed[2, 3] = Bitset.new("111")
+  assert_equal Bitset.new("00111000"), fixed
+  assert_equal 3, fixed.popcount
+  assert_raise(TypeError) { fixed[2, 3] = Bitset.new("11") }
+  assert_raise(IndexError) { fixed[7, 2] = Bitset.new("11") }
+  assert_equal 8, fixed.size
+end
+
+assert "hash" do
+  a = Bitset.new("10110011 0101")
+  b = Bitset.new("10110011 0101")
+  assert_equal a.hash, b.hash
+  assert_equal 1, { a => 1 }[b]
+  h = a.hash
+  a[3] = 0
+  assert_not_equal h, a.hash
+  a[3] = 1
+  assert_equal h, a.hash
+  assert_not_equal Bitset.new("0").hash, Bitset.new("00").hash
+end
+
+assert "track!" do
+  bs = Bitset.new("11110000 10101010 0101")
+  assert_false bs.tracked?
+  assert_same bs, bs.track!
+  assert_true bs.tracked?
+  assert_equal 10, bs.popcount
+  bs[0] = 0
+  bs[4, 8] = 0xff
+  assert_equal 15, bs.popcount
+  bs.push 1
+  bs.shift 4
+  assert_equal 13, bs.popcount
+  bs.flip!
+  assert_equal 4, bs.popcount
+  bs.fill
+  assert_true bs.all?
+  bs.fill false
+  assert_true bs.none?
+  bs.msb_or Bitset.new("1")
+  assert_true bs.any?
+  assert_equal 1, bs.popcount
+  assert_true bs.dup.tracked?
+  bs.untrack!
+  assert_false bs.tracked?
+  assert_equal 1, bs.popcount
+end
+
+assert "== and <=>" do
+  a = Bitset.new("0000 0101")
+  assert_true a == Bitset.new("00000101")
+  assert_true a == 5
+  assert_false a == 6
+  assert_false a == -5
+  assert_true a == "0000_0101"
+  assert_false a == "0101"
+  assert_false a.eql?(5)
+  assert_equal 0, a <=> Bitset.new("00000101")
+  assert_equal(-1, Bitset.new("0011") <=> Bitset.new("01"))
+  assert_equal 1, Bitset.new("0011") <=> Bitset.new("001")
+  assert_nil a <=> 5
+  assert_equal 0, Bitset.new("0101").cmp_numeric(a)
+  assert_equal 1, Bitset.new("11").cmp_numeric(Bitset.new("0000010"))
+  sorted = [Bitset.new("11"), Bitset.new("011"), Bitset.new("1")].sort.map(&:to_s)
+  assert_equal %w(011 1 11), sorted
+end
+
+assert "to_bytes and from_bytes" do
+  a = Bitset.new("10000000 11000000 101")
+  assert_equal "\x80\xc0\xa0", a.to_bytes
+  assert_equal "\x01\x03\x05", a.to_bytes(bit_order: :lsb)
+  assert_equal [0x80, 0xc0, 0xa0], a.bytes
+  assert_equal a, Bitset.from_bytes(a.to_bytes, 19)
+  assert_equal a, Bitset.from_bytes(a.to_bytes(bit_order: :lsb), 19, bit_order: :lsb)
+  assert_equal 24, Bitset.from_bytes("\x80\xc0\xa0").size
+  assert_true Bitset.from_bytes("\x80\x01", bit_order: :lsb) == "00000001 10000000"
+  assert_raise(ArgumentError) { a.to_bytes(bit_order: :middle) }
+end
+
+assert "initialize with bit string" do
+  src = "1011001110001111 0000111100001111_01010101.1-1:0 1"
+  bs = Bitset.new(src)
+  assert_equal 44, bs.size
+  assert_equal "10110011 10001111 00001111 00001111  01010101 1101", bs.to_s
+  assert_equal 19, Bitset.new("1111111111111111111x1111").size
+  bs = Bitset.new(70, "1" * 65)
+  assert_equal 70, bs.size
+  assert_equal 65, bs.popcount
+  assert_equal 5, Bitset.new(5, "1" * 65).popcount
+end
+
+assert "from_indices and set_indices!" do
+  bs = Bitset.from_indices([0, 3, 9])
+  assert_equal 10, bs.size
+  assert_true bs == "1001000001"
+  assert_equal [0, 3, 9], bs.to_indices
+  assert_equal 16, Bitset.from_indices([-1, 2], 16).size
+  assert_equal [2, 15], Bitset.from_indices([15, 2, -1], 16, sort: true).to_indices
+  assert_raise(IndexError) { Bitset.from_indices([16], 16) }
+  assert_raise(TypeError) { Bitset.from_indices([1, "2"]) }
+  bs.track!
+  assert_same bs, bs.set_indices!([3, 4, 100, -2])
+  assert_equal 101, bs.size
+  assert_equal [0, 3, 4, 8, 9, 100], bs.to_indices
+  assert_equal 6, bs.popcount
+end
+
+assert "Bitset.stats" do
+  Bitset.reset_stats
+  bs = Bitset.from_bytes("\0" * 32)
+  bs.push 1
+  bs.shift
+  bs.size
+  st = Bitset.stats
+  if st
+    assert_equal 1, st[:promote]
+    assert_true st[:alloc] >= 2
+    assert_equal 2, st[:slide]
+    assert_equal 1, st[:calls][:size][:small]
+    Bitset.reset_stats
+    assert_equal 0, Bitset.stats[:alloc]
+  else
+    assert_nil Bitset.reset_stats
+  end
+end
+
+assert "Bitset::Fixed" do
+  bs = Bitset::Fixed.new(300)
+  assert_kind_of Bitset, bs
+  assert_equal 300, bs.size
+  assert_true bs.none?
+  bs[299] = 1
+  bs[-2] = true
+  bs[0, 8] = 0xa5
+  assert_equal 6, bs.popcount
+  assert_equal 0xa5, bs[0, 8]
+  assert_raise(IndexError) { bs[300] = 1 }
+  assert_raise(IndexError) { bs[-301] = 1 }
+  assert_raise(TypeError) { bs.push 1 }
+  assert_raise(TypeError) { bs.shift }
+  assert_raise(TypeError) { bs.clear }
+  assert_equal 300, bs.size
+  assert_true bs.dup.flip!.is_a?(Bitset::Fixed)
+  assert_raise(TypeError) { bs.dup.push 1 }
+  assert_equal 5, Bitset::Fixed.new(5, true).popcount
+  assert_equal "0101", Bitset::Fixed.new(4, 5).to_s
+end
+
+assert "single bit operations" do
+  bs = Bitset.new("0101")
+  assert_true bs.test?(1)
+  assert_false bs.test?(0)
+  assert_false bs.test?(100)
+  assert_true bs.test(-1)
+  assert_same bs, bs.set!(0)
+  bs.reset!(1).toggle!(2)
+  assert_equal "1011", bs.to_s
+  assert_false bs.test_and_set!(1)
+  assert_true bs.test_and_set!(1)
+  assert_true bs.test_and_reset!(0)
+  assert_false bs.test_and_reset!(0)
+  bs.set!(9)
+  assert_equal "01110000 01", bs.to_s
+  bs.track!
+  bs.toggle!(9)
+  assert_equal 3, bs.popcount
+  assert_raise(IndexError) { bs.set!(-11) }
+  assert_raise(IndexError) { Bitset::Fixed.new(4).set!(4) }
+end
+
+assert "values_at, set_many! and toggle_many!" do
+  bs = Bitset.new("10110000")
+  assert_equal [1, 0, 1, 0, 0], bs.values_at([0, 1, 3, 7, 100])
+  assert_equal [0, 1], bs.values_at([-1, -8], sort: true)
+  assert_equal "1011", bs.values_at([0, 1, 2, 3], packed: true).to_s
+  assert_raise(TypeError) { bs.values_at([nil]) }
+  bs.track!
+  assert_same bs, bs.set_many!([1, 7])
+  assert_equal "11110001", bs.to_s
+  bs.set_many!([0, -1], false)
+  bs.toggle_many!([4, 5, 5, 9], sort: true)
+  assert_equal "01111000 01", bs.to_s
+  assert_equal 5, bs.popcount
+end
+
+assert "next_one, next_zero, prev_one and prev_zero" do
+  bs = Bitset.new("00010000 " + "0" * 64 + " 10111111")
+  assert_equal 3, bs.next_one
+  assert_equal 72, bs.next_one(4)
+  assert_equal 73, bs.next_zero(72)
+  assert_nil bs.next_zero(74)
+  assert_nil bs.next_one(80)
+  assert_equal 3, bs.prev_one(71)
+  assert_equal 79, bs.prev_one
+  assert_equal 73, bs.prev_zero
+  assert_nil bs.prev_one(2)
+  assert_equal 79, bs.next_one(-1)
+  assert_nil Bitset.new.next_one
+end
+
+assert "Bitset::Allocator" do
+  a = Bitset::Allocator.new(10000)
+  assert_equal 10000, a.largest_free_run
+  assert_equal 0, a.alloc(100)
+  assert_equal 100, a.alloc(5000)
+  assert_equal 5100, a.alloc(4900)
+  assert_nil a.alloc(1)
+  assert_same a, a.free(100, 5000)
+  assert_raise(ArgumentError) { a.free(100) }
+  assert_raise(IndexError) { a.free(9999, 2) }
+  assert_equal 5000, a.largest_free_run
+  assert_equal 100, a.alloc(10)
+  a.free(0, 100).free(9000, 30)
+  assert_equal 5120, a.free_count
+  a.policy = :best_fit
+  assert_equal 9000, a.alloc(20)
+  assert_true a.allocated?(9000, 20)
+  assert_false a.allocated?(9000, 21)
+  assert_equal 4900, a.to_bitset.popcount
+  assert_raise(ArgumentError) { a.policy = :worst_fit }
+  b = Bitset::Allocator.new(64, policy: :next_fit)
+  assert_equal :next_fit, b.policy
+  assert_equal 0, b.alloc(8)
+  b.free(0, 8)
+  assert_equal 8, b.alloc(8)
+  assert_equal 16, b.alloc(48)
+  assert_equal 0, b.alloc(8)
+  assert_nil b.alloc(1)
+end
+
+assert "summarize!" do
+  # MRB_INT16 でも収まる大きさで、要約が 2 段になる (32000 ビットは 64 ビットワードで 500 ワード)
+  bs = Bitset.from_indices([100, 20000], 32000)
+  assert_false bs.summarized?
+  assert_same bs, bs.summarize!
+  assert_true bs.summarized?
+  assert_true bs.any?
+  assert_equal 100, bs.clz
+  assert_equal 32000 - 20001, bs.ctz
+  assert_equal 20000, bs.next_one(101)
+  assert_equal 100, bs.prev_one(19999)
+  bs.reset!(100)
+  bs[20000] = 0
+  assert_true bs.none?
+  bs.set_many!([5, 31000])
+  assert_equal [5, 31000], bs.to_indices
+  bs.msb_and Bitset.from_indices([5], 10)
+  assert_equal [5], bs.to_indices
+  bs.push 1
+  assert_equal 32000, bs.next_one(6)
+  assert_true bs.dup.summarized?
+  bs.unsummarize!
+  assert_false bs.summarized?
+end
+
+assert "Bitset::Bloom" do
+  bf = Bitset::Bloom.new(1000, 0.01)
+  assert_equal 9586, bf.bitsize
+  assert_equal 7, bf.hashes
+  assert_same bf, bf.add("apple")
+  bf << :banana << 42
+  assert_true bf.include?("apple")
+  assert_true bf.include?("banana")
+  assert_true bf.include?(42)
+  assert_false bf.include?("durian")
+  bf.add_all(%w(a b c))
+  assert_true bf.include_all?(%w(a b c apple))
+  assert_false bf.include_all?(%w(a z1 z2 z3))
+  other = Bitset::Bloom.new(1000, 0.01).add("cherry")
+  u = bf | other
+  assert_true u.include_all?(%w(apple cherry))
+  assert_false bf.intersect(other).include?("apple")
+  assert_raise(ArgumentError) { bf.union(Bitset::Bloom.new(10)) }
+  copy = Bitset::Bloom.from_bytes(bf.to_bytes, bf.hashes, bf.bitsize)
+  assert_true copy.include_all?(%w(a b c apple))
+  assert_equal bf.popcount, copy.popcount
+  assert_true bf.clear.to_bitset.none?
+end
+
+assert "Bitset::SlicedIndex" do
+  bsi = Bitset::SlicedIndex.new([5, 3, 9, 0, 9, 2, 7])
+  assert_equal 7, bsi.size
+  assert_equal 4, bsi.slices
+  assert_equal 9, bsi[2]
+  assert_equal 7, bsi.eq(9).size
+  assert_equal [2, 4], bsi.eq(9).to_indices
+  assert_equal [0, 1, 2, 4, 5, 6], bsi.ne(0).to_indices
+  assert_equal [3, 5], bsi.lt(3).to_indices
+  assert_equal [1, 3, 5], bsi.le(3).to_indices
+  assert_equal [2, 4], bsi.gt(7).to_indices
+  assert_equal [], bsi.ge(100).to_indices
+  assert_equal [0, 1, 6], bsi.between(3, 7).to_indices
+  assert_equal 35, bsi.sum
+  assert_equal 14, bsi.sum(Bitset.from_indices([0, 2], 7))
+  assert_equal [2, 4, 6], bsi.top_k(3).to_indices
+  assert_equal [2], bsi.top_k(1).to_indices
+  bsi[3] = 15
+  assert_equal [3], bsi.top_k(1).to_indices
+  assert_raise(RangeError) { bsi[0] = 16 }
+  assert_equal [5, 3, 9, 15, 9, 2, 7], bsi.to_a
+  d = bsi.dup
+  d[0] = 1
+  assert_equal [1, 3, 9, 15, 9, 2, 7], d.to_a
+  assert_equal [5, 3, 9, 15, 9, 2, 7], bsi.to_a
+  assert_equal 4, d.slices
+  assert_equal [3], d.top_k(1).to_indices
+end
+
+assert "Bitset::Matrix" do
+  m = Bitset::Matrix.new(4, 4)
+  m[0, 1] = 1
+  m[1, 2] = 1
+  m[2, 3] = 1
+  assert_equal [4, 4], [m.rows, m.cols]
+  assert_equal 1, m[1, 2]
+  assert_equal 0, m[2, 1]
+  t = m.transpose
+  assert_equal 1, t[2, 1]
+  assert_equal 0, t[1, 2]
+  m2 = m * m
+  assert_equal [2], m2.row(0).to_indices
+  assert_equal [3], m2.row(1).to_indices
+  assert_equal [], m2.row(2).to_indices
+  row = m.row(0)
+  assert_kind_of Bitset::Fixed, row
+  row[3] = 1
+  assert_equal 1, m[0, 3]
+  m[0, 0] = 1
+  assert_equal [0, 1, 3], row.to_indices
+  row.msb_or m.row(1)
+  assert_equal [0, 1, 2, 3], m.to_a[0].to_indices
+  assert_raise(TypeError) { row.push 1 }
+  assert_raise(TypeError) { row.track! }
+  r = Bitset::Matrix.from_rows([Bitset.from_indices([0], 3), Bitset.from_indices([1, 2], 3)])
+  assert_equal [2, 3], [r.rows, r.cols]
+  assert_equal [[0, 1], [0, 2]], r.transpose.to_a.map(&:to_indices)
+  assert_raise(ArgumentError) { r * r }
+end
+
+assert "Bitset#add! / sub! / inc! / dec!" do
+  bs = Bitset::Fixed.new(8, 250)
+  assert_same bs, bs.add!(5)
+  assert_true bs == 255
+  assert_true bs.inc! == 0
+  assert_true bs.dec! == 255
+  assert_raise(RangeError) { bs.inc!(overflow: :raise) }
+  assert_true bs == 255
+  assert_true bs.add!(10, overflow: :saturate) == 255
+  assert_true bs.sub!(Bitset.new("1111")) == 240
+  assert_true bs.sub!(241, overflow: :saturate) == 0
+  assert_true bs.add!(-1) == 255
+  assert_raise(RangeError) { bs.add!(Bitset.new("100000000"), overflow: :raise) }
+  assert_raise(ArgumentError) { bs.add!(1, overflow: :clamp) }
+  big = Bitset::Fixed.new(130)
+  assert_equal 130, big.dec!.popcount
+  assert_true big.inc!.none?
+end
+
+assert "Bitset#bitreflect" do
+  [0, 1, 63, 64, 65, 127, 200, 1000].each do |n|
+    str = (0...n).map { |i| (i * 7 + i / 3) % 5 < 2 ? "1" : "0" }.join
+    bs = Bitset.new(str)
+    assert_equal Bitset.new(str.reverse), bs.bitreflect
+    assert_equal Bitset.new(str.reverse), bs.bitreflect!
+    assert_equal Bitset.new(str), bs.bitreflect!
+  end
+end
+
+assert "Bitset#extract / deposit" do
+  bs = Bitset.new("10110010")
+  mask = Bitset.new("11001100")
+  assert_equal "1000", bs.extract(mask).to_s
+  assert_equal "01111110", bs.deposit(mask, Bitset.new("0111")).to_s
+  assert_equal "10110010", bs.deposit(mask, Bitset.new("1")).to_s
+  assert_equal bs, bs.deposit(mask, bs.extract(mask))
+  mask = Bitset.from_indices([3, 64, 130, 199], 200)
+  assert_equal "1111", Bitset.new("1" * 200).extract(mask).to_s
+  z = Bitset::Fixed.new(200)
+  assert_same z, z.deposit!(mask, Bitset.new("1011"))
+  assert_equal [3, 130, 199], z.to_indices
+end
+
+assert "Bitset.interleave / Bitset#deinterleave" do
+  a = Bitset.new("1100")
+  b = Bitset.new("1010")
+  z = Bitset.interleave(a, b)
+  assert_equal "11100100", z.to_s
+  assert_equal %w(1100 1010), z.deinterleave(2).map(&:to_s)
+  assert_equal "101011", Bitset.interleave(Bitset.new("10"), Bitset.new("01"), Bitset.new("11")).to_s
+  xs = [0, 1, 2].map { |k| Bitset.new((0...100).map { |i| (i * (k + 3)) % 7 < 3 ? "1" : "0" }.join) }
+  assert_equal xs.map(&:to_s), Bitset.interleave(*xs).deinterleave(3).map(&:to_s)
+  assert_raise(ArgumentError) { Bitset.interleave(a, Bitset.new("1")) }
+  assert_raise(ArgumentError) { z.deinterleave(3) }
+end
+
+assert "Bitset::Sparse" do
+  a = Bitset::Sparse.new
+  a[3] = 1
+  a[30000] = 1
+  a[200] = 1
+  a[200] = 0
+  assert_equal 1, a[3]
+  assert_equal 0, a[200]
+  assert_equal 1, a[30000]
+  assert_equal 2, a.popcount
+  assert_equal [3, 30000], a.to_indices
+  assert_equal [3, 30000], a.each.to_a
+  assert_equal [4, 30001], a.map { |i| i + 1 }
+  b = Bitset::Sparse.new
+  b[3] = 1
+  b[70] = 1
+  assert_equal [3], (a & b).to_indices
+  assert_equal [3, 70, 30000], (a | b).to_indices
+  assert_equal [70, 30000], (a ^ b).to_indices
+  assert_equal [30000], (a - b).to_indices
+  assert_true (a - a).empty?
+  assert_equal [0, 67], b.to_bitset(3, 100).to_indices
+  assert_equal 100, b.to_bitset(3, 100).size
+  assert_equal [], a.dup.clear.to_indices
+
+  # 負の位置は 2 の補数として、正の位置すべての後ろに並ぶ
+  c = Bitset::Sparse.new
+  c[-1] = 1
+  c[5] = 1
+  assert_equal 1, c[-1]
+  assert_equal 0, c[-2]
+  assert_equal [5, -1], c.to_indices
+  assert_equal [5, -1], c.each.to_a
+  assert_equal [1], c.to_bitset(-2, 2).to_indices
+  assert_raise(RangeError) { c.to_bitset(-1, 2) }
+  c[-1] = 0
+  assert_equal [5], c.to_indices
+end
+
+if Bitset::BITWIDTH_MAX > 41
+  assert "Bitset::Sparse (large index)" do
+    a = Bitset::Sparse.new
+    a[3] = 1
+    a[1 << 40] = 1
+    assert_equal 1, a[1 << 40]
+    assert_equal 0, a[(1 << 40) + 1]
+    assert_equal [3, 1 << 40], a.to_indices
+    assert_equal [3, 1 << 40], a.each.to_a
+    assert_equal [1], a.to_bitset((1 << 40) - 1, 3).to_indices
+  end
+end
+
+assert "Bitset#lazy / Bitset.expr" do
+  a = Bitset.new("11001100")
+  b = Bitset.new("10101010")
+  c = Bitset.new("1111")
+  e = Bitset.new("01100110")
+  eager = (a & b) | (c ^ b) & ~e
+  assert_equal eager.to_s, ((a.lazy & b) | (c.lazy ^ b) & ~e.lazy).to_bitset.to_s
+  assert_equal (a ^ b).popcount, (a.lazy ^ b).count
+  assert_equal "01000100", (a.lazy - b).to_bitset.to_s
+  assert_equal "0000", (~c.lazy).to_bitset.to_s
+  assert_equal "00110000", Bitset.expr(a, c) { |x, y| ~x & ~(~y) | x & ~x }.to_bitset.to_s
+  big = Bitset.new(1000)
+  big[999] = 1
+  assert_equal 999, (~big.lazy).count
+end
+
+assert "Bitset#write_hex / write_bin / write_raw / each_hex_chunk" do
+  io = Object.new
+  def io.buf; @buf ||= []; end
+  def io.write(s); buf << s; s.bytesize; end
+
+  a = Bitset.new((0...3000).map { |i| (i * 7) % 11 < 5 ? "1" : "0" }.join)
+  assert_equal a.hexdigest.bytesize, a.write_hex(io)
+  assert_equal a.hexdigest, io.buf.join
+  io.buf.clear
+  assert_equal a.bindigest.bytesize, a.write_bin(io)
+  assert_equal a.bindigest, io.buf.join
+  io.buf.clear
+  a.write_raw(io, bit_order: :lsb)
+  assert_equal a.to_bytes(bit_order: :lsb), io.buf.join
+  chunks = []
+  a.each_hex_chunk(100) { |s| chunks << s }
+  assert_equal a.hexdigest, chunks.join
+  assert_equal [100], chunks[0...-1].map(&:bytesize).uniq
+  assert_equal 0, Bitset.new.write_hex(io)
+  assert_raise(ArgumentError) { a.each_hex_chunk(0) { } }
+end
+
 __END__
 
 p Bitset.spec
@@ -10,12 +10,13 @@ build:
     - :core: mruby-sprintf
     - :core: mruby-print
     - :core: mruby-random
+    - :core: mruby-time
     - :core: mruby-bin-mrbc
     - :core: mruby-bin-mirb
     - :core: mruby-bin-mruby
   host16-nan:
     enables: [debug, test]
-    defines: [MRB_NAN_BOXING, MRB_INT16]
+    defines: [MRB_NAN_BOXING, MRB_INT16, MRUBY_BITSET_STATS]
     gems:
     - :core: mruby-print
     - :core: mruby-bin-mrbc
@@ -24,6 +25,7 @@ build:
     enables: [debug, test, word boxing]
     gems:
     - :core: mruby-print
+    - :core: mruby-time
     - :core: mruby-bin-mrbc
     - :core: mruby-bin-mruby
   host-opt:
@@ -36,6 +38,10 @@ build:
     enables: word boxing
     cflags: ["-Os", "-m32"]
     ldflags: "-m32"
+    gems:
+    - :core: mruby-print
+    - :core: mruby-time
+    - :core: mruby-bin-mruby
 CONFIGURATIONS
 
 configurations["build"].each_pair do |n, c|